@@ -0,0 +1,363 @@
+/**
+ * @file block.c
+ *
+ * @brief The block word set: block, buffer, update, save-buffers, flush,
+ * load and list, over a block file of BLOCK_SIZE byte blocks.
+ *
+ * Block n is at offset n * BLOCK_SIZE of the file, which is 'blocks.fb'
+ * in the current directory until 'use <file>' names another one. Only
+ * blocks that are asked for are read, with pread, into a fixed pool of
+ * BLOCK_BUFFERS buffers. When all buffers are taken the least recently
+ * used one is reused, and written back first with pwrite if it was
+ * updated. So a block file can be much larger than memory, and the cache
+ * never takes more than the pool.
+ *
+ * The buffers are outside the dictionary but @ ! and friends accept
+ * addresses in them, see addr_valid. Blocks past the end of the file read
+ * as spaces. Block words are not meant to be used by par.c tasks.
+ */
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define BLOCK_FILE_DEFAULT "blocks.fb"
+
+/* list and load see a block as this many lines of this many characters */
+#define BLOCK_LINES 16
+#define BLOCK_LINE_LEN ((int)BLOCK_SIZE / BLOCK_LINES)
+
+struct block_cache {
+	/* first, so that addr_valid can find them through dict.blocks */
+	unsigned char buffers[BLOCK_BUFFERS][BLOCK_SIZE];
+	stack_cell_t number[BLOCK_BUFFERS]; /* block in each buffer, or -1 */
+	bool dirty[BLOCK_BUFFERS];
+	unsigned long used[BLOCK_BUFFERS]; /* clock when last asked for */
+	unsigned long clock;
+	unsigned int current; /* buffer update marks */
+	int fd;		      /* block file, -1 until first needed */
+	char name[PATH_MAX];
+};
+
+/* the block cache of ctx, made on first use */
+static struct block_cache *block_cache(struct forth_ctx *ctx)
+{
+	struct block_cache *c = ctx->dict.blocks;
+
+	/* the buffers are shared with tasks, and not locked */
+	par_task_check(ctx);
+	if (c != NULL) {
+		return c;
+	}
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		ctx->plat.puts("block: out of memory\n");
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+	for (unsigned int i = 0; i < BLOCK_BUFFERS; i++) {
+		c->number[i] = -1;
+	}
+	c->fd = -1;
+	strcpy(c->name, BLOCK_FILE_DEFAULT);
+	ctx->dict.blocks = c;
+	return c;
+}
+
+static void block_open(struct forth_ctx *ctx, struct block_cache *c)
+{
+	if (c->fd >= 0) {
+		return;
+	}
+	c->fd = open(c->name, O_RDWR | O_CREAT, 0666);
+	if (c->fd < 0) {
+		ctx->plat.puts("block: cannot open ");
+		ctx->plat.puts(c->name);
+		ctx->plat.puts("\n");
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+}
+
+static void block_read(struct forth_ctx *ctx, struct block_cache *c,
+		       unsigned int i)
+{
+	off_t at = (off_t)c->number[i] * BLOCK_SIZE;
+	size_t done = 0;
+
+	block_open(ctx, c);
+	while (done < BLOCK_SIZE) {
+		ssize_t n = pread(c->fd, c->buffers[i] + done,
+				  BLOCK_SIZE - done, at + done);
+
+		if (n < 0) {
+			c->number[i] = -1;
+			forth_throw(ctx, THROW_BLOCK_READ);
+		}
+		if (n == 0) {
+			/* past the end of the file */
+			memset(c->buffers[i] + done, ' ', BLOCK_SIZE - done);
+			break;
+		}
+		done += n;
+	}
+}
+
+static void block_write(struct forth_ctx *ctx, struct block_cache *c,
+			unsigned int i)
+{
+	off_t at = (off_t)c->number[i] * BLOCK_SIZE;
+	size_t done = 0;
+
+	block_open(ctx, c);
+	while (done < BLOCK_SIZE) {
+		ssize_t n = pwrite(c->fd, c->buffers[i] + done,
+				   BLOCK_SIZE - done, at + done);
+
+		if (n <= 0) {
+			forth_throw(ctx, THROW_BLOCK_WRITE);
+		}
+		done += n;
+	}
+	c->dirty[i] = false;
+}
+
+/*
+ * The buffer assigned to block u, read from the file when read is set and
+ * it is not in a buffer yet. Becomes the current buffer.
+ */
+static unsigned char *block_get(struct forth_ctx *ctx, stack_cell_t u,
+				bool read)
+{
+	struct block_cache *c = block_cache(ctx);
+	unsigned int i, victim = 0;
+
+	if (u < 0 || u > INTPTR_MAX / (stack_cell_t)BLOCK_SIZE) {
+		forth_throw(ctx, THROW_INVALID_BLOCK);
+	}
+
+	if (c->number[c->current] == u) {
+		i = c->current;
+		goto found;
+	}
+	for (i = 0; i < BLOCK_BUFFERS; i++) {
+		if (c->number[i] == u) {
+			goto found;
+		}
+		if (c->number[i] < 0) {
+			victim = i;
+		} else if (c->number[victim] >= 0 &&
+			   c->used[i] < c->used[victim]) {
+			victim = i;
+		}
+	}
+
+	i = victim;
+	if (c->dirty[i]) {
+		block_write(ctx, c, i);
+	}
+	c->number[i] = u;
+	if (read) {
+		block_read(ctx, c, i);
+	}
+
+found:
+	c->used[i] = ++c->clock;
+	c->current = i;
+	return c->buffers[i];
+}
+
+/* writes every updated buffer back to the file */
+static void block_save(struct forth_ctx *ctx, struct block_cache *c)
+{
+	for (unsigned int i = 0; i < BLOCK_BUFFERS; i++) {
+		if (c->number[i] >= 0 && c->dirty[i]) {
+			block_write(ctx, c, i);
+		}
+	}
+	if (c->fd >= 0 && fsync(c->fd) != 0) {
+		forth_throw(ctx, THROW_BLOCK_WRITE);
+	}
+}
+
+/* saves and unassigns every buffer */
+static void block_flush(struct forth_ctx *ctx, struct block_cache *c)
+{
+	block_save(ctx, c);
+	for (unsigned int i = 0; i < BLOCK_BUFFERS; i++) {
+		c->number[i] = -1;
+	}
+}
+
+/* == words == */
+
+/**
+ * @brief ( u -- addr ) address of a buffer holding block u, read from the
+ * file unless a buffer has it already
+ */
+void do_block(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)block_get(ctx, stack_pop(ctx), true));
+}
+
+/**
+ * @brief ( u -- addr ) address of a buffer assigned to block u, without
+ * reading it from the file
+ */
+void do_buffer(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)block_get(ctx, stack_pop(ctx), false));
+}
+
+/**
+ * @brief ( -- ) marks the buffer of the last block or buffer as changed,
+ * so it is written back before it is reused
+ */
+void do_update(struct forth_ctx *ctx)
+{
+	struct block_cache *c = block_cache(ctx);
+
+	if (c->number[c->current] >= 0) {
+		c->dirty[c->current] = true;
+	}
+}
+
+/**
+ * @brief ( -- ) writes updated buffers to the block file
+ */
+void do_save_buffers(struct forth_ctx *ctx)
+{
+	block_save(ctx, block_cache(ctx));
+}
+
+/**
+ * @brief ( -- ) writes updated buffers to the block file and forgets
+ * which blocks the buffers held
+ */
+void do_flush(struct forth_ctx *ctx)
+{
+	block_flush(ctx, block_cache(ctx));
+}
+
+/**
+ * @brief ( i*x u -- j*x ) interprets block u. Each BLOCK_LINE_LEN
+ * characters are a line, so \ comments end with them.
+ */
+void do_load(struct forth_ctx *ctx)
+{
+	char src[BLOCK_LINES * (BLOCK_LINE_LEN + 1)];
+	const unsigned char *b = block_get(ctx, stack_pop(ctx), true);
+
+	/* a copy, since the words loaded may reuse the buffer */
+	for (int line = 0; line < BLOCK_LINES; line++) {
+		memcpy(&src[line * (BLOCK_LINE_LEN + 1)],
+		       b + line * BLOCK_LINE_LEN, BLOCK_LINE_LEN);
+		src[line * (BLOCK_LINE_LEN + 1) + BLOCK_LINE_LEN] = '\n';
+	}
+	evaluate_buffer(ctx, src, sizeof(src));
+}
+
+/**
+ * @brief ( u -- ) prints block u as numbered lines
+ */
+void do_list(struct forth_ctx *ctx)
+{
+	const unsigned char *b = block_get(ctx, stack_pop(ctx), true);
+	char line[4 + BLOCK_LINE_LEN + 2];
+
+	for (int n = 0; n < BLOCK_LINES; n++) {
+		line[0] = n >= 10 ? '0' + n / 10 : ' ';
+		line[1] = '0' + n % 10;
+		line[2] = ' ';
+		line[3] = ' ';
+		for (int i = 0; i < BLOCK_LINE_LEN; i++) {
+			unsigned char ch = b[n * BLOCK_LINE_LEN + i];
+
+			line[4 + i] = (ch >= ' ' && ch < 127) ? ch : ' ';
+		}
+		line[4 + BLOCK_LINE_LEN] = '\n';
+		line[4 + BLOCK_LINE_LEN + 1] = 0;
+		ctx->plat.puts(line);
+	}
+}
+
+/**
+ * @brief use <file>, flushes the buffers and makes file the block file
+ */
+void do_use(struct forth_ctx *ctx)
+{
+	struct block_cache *c = block_cache(ctx);
+	char name[MAX_INPUT_LEN + 1];
+	int len = read_token(ctx, name, MAX_INPUT_LEN);
+
+	if (len <= 0) {
+		ctx->plat.puts("use: file name expected\n");
+		return;
+	}
+	name[len] = '\0';
+
+	block_flush(ctx, c);
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+	strcpy(c->name, name);
+}
+
+void block_cache_free(struct forth_ctx *ctx)
+{
+	struct block_cache *c = ctx->dict.blocks;
+	struct catch_frame frame;
+
+	if (c == NULL) {
+		return;
+	}
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		block_save(ctx, c);
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+		ctx->plat.puts("block: cannot save buffers\n");
+	}
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	free(c);
+	ctx->dict.blocks = NULL;
+}
+
+size_t block_cache_size(void)
+{
+	return sizeof(struct block_cache);
+}
+
+static const struct bultin_entry block_builtin_table[] = {
+    {.word = "block", .c_func = do_block, .flags = {}},
+    {.word = "buffer", .c_func = do_buffer, .flags = {}},
+    {.word = "update", .c_func = do_update, .flags = {}},
+    {.word = "save-buffers", .c_func = do_save_buffers, .flags = {}},
+    {.word = "flush", .c_func = do_flush, .flags = {}},
+    {.word = "load", .c_func = do_load, .flags = {}},
+    {.word = "list", .c_func = do_list, .flags = {}},
+    {.word = "use", .c_func = do_use, .flags = {}},
+};
+
+int block_builtins_init(struct forth_ctx *ctx)
+{
+	ctx->dict.blocks = NULL;
+	return builtins_register(ctx, block_builtin_table,
+				 ARRAY_SIZE(block_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
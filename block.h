@@ -0,0 +1,28 @@
+/**
+ * @file block.h
+ *
+ * @brief The block word set for hosted builds.
+ */
+
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+int block_builtins_init(struct forth_ctx *ctx);
+
+/**
+ * @brief writes updated block buffers back and releases them, called by
+ * emforth_deinit.
+ */
+void block_cache_free(struct forth_ctx *ctx);
+
+/**
+ * @brief size of what dict.blocks points to, for include to tell whether
+ * a file used blocks.
+ */
+size_t block_cache_size(void);
+#endif
+
+#endif /* __BLOCK_H__ */
@@ -8,7 +8,6 @@
 #include "builtins_common.h"
 #include "emforth.h"
 #include <ctype.h>
-#include <stdio.h>
 #include <string.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
@@ -16,20 +15,89 @@
 /* forward declarations of primitive word functions also used by other words */
 void do_word(struct forth_ctx *ctx);
 void do_2dfa(struct forth_ctx *ctx);
+void do_divide(struct forth_ctx *ctx);
+void do_mod(struct forth_ctx *ctx);
+void do_rot(struct forth_ctx *ctx);
+
+word_t prim_table[PRIM_TABLE_MAX];
+unsigned int prim_count;
+
+/**
+ * @brief index of a registered primitive, PRIM_TABLE_MAX if it is not one.
+ * Only used while compiling, so a linear search is fine.
+ */
+unsigned int prim_index(word_t fn)
+{
+	for (unsigned int i = 0; i < prim_count; i++) {
+		if (prim_table[i] == fn) {
+			return i;
+		}
+	}
+	return PRIM_TABLE_MAX;
+}
+
+#ifdef EMFORTH_SANDBOX
+/*
+ * The registered primitives again, hashed by address, so that the inner
+ * interpreter can tell them from other values without a search. Open
+ * addressing, it is twice the size of prim_table and never fills up.
+ */
+#define PRIM_HASH_SIZE (2 * PRIM_TABLE_MAX)
+static word_t prim_hash[PRIM_HASH_SIZE];
+
+static unsigned int prim_hash_slot(word_t fn)
+{
+	uintptr_t a = (uintptr_t)fn;
+
+	return (unsigned int)((a >> 4) ^ (a >> 13)) & (PRIM_HASH_SIZE - 1);
+}
+
+bool prim_known(word_t fn)
+{
+	unsigned int i = prim_hash_slot(fn);
+
+	while (prim_hash[i] != NULL) {
+		if (prim_hash[i] == fn) {
+			return true;
+		}
+		i = (i + 1) & (PRIM_HASH_SIZE - 1);
+	}
+	return false;
+}
+#endif
+
+/* the table is shared by all contexts, registering again is harmless */
+static void prim_register(word_t fn)
+{
+	if (prim_index(fn) == PRIM_TABLE_MAX && prim_count < PRIM_TABLE_MAX) {
+		prim_table[prim_count++] = fn;
+#ifdef EMFORTH_SANDBOX
+		unsigned int i = prim_hash_slot(fn);
+
+		while (prim_hash[i] != NULL) {
+			i = (i + 1) & (PRIM_HASH_SIZE - 1);
+		}
+		prim_hash[i] = fn;
+#endif
+	}
+}
 
 /* === Helper functions === */
 /**
  * @brief pushes string to stack, followed by the length as top of stack
  * Note that string will be pushed will padding if necessary.
  */
-int stack_push_wordname(struct forth_ctx *ctx, char *s, int len)
+int stack_push_wordname(struct forth_ctx *ctx, const char *s, int len)
 {
 	/* maximum 32 len */
 	len = len % (WORD_NAME_MAX_LEN - 1);
 	/* round up to 4 byte boundary */
 	stack_cell_t r_len = ALIGN_UP_WORD_T(len);
 
-	/* clear the to-be-written-to area */
+	/* clear the to-be-written-to area, name and length must fit */
+	if (r_len / (stack_cell_t)sizeof(stack_cell_t) >= STACK_SIZE_MAX - ctx->sp) {
+		forth_throw(ctx, THROW_STACK_OVERFLOW);
+	}
 	memset(&ctx->stack[ctx->sp], 0, r_len);
 
 	/* copy to stack and adjust stack */
@@ -40,77 +108,272 @@ int stack_push_wordname(struct forth_ctx *ctx, char *s, int len)
 	return len;
 }
 
-/* Helper function to find a word's name from its execution token */
-static const char *find_word_name_by_xt(struct forth_ctx *ctx, word_t xt)
+/* two decimal digits per entry, "00" to "99" */
+static const char digit_pairs[] = "00010203040506070809"
+				  "10111213141516171819"
+				  "20212223242526272829"
+				  "30313233343536373839"
+				  "40414243444546474849"
+				  "50515253545556575859"
+				  "60616263646566676869"
+				  "70717273747576777879"
+				  "80818283848586878889"
+				  "90919293949596979899";
+
+static const char digit_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+/**
+ * @brief returns the current number conversion radix, 10 if it is invalid
+ */
+static inline unsigned int current_base(struct forth_ctx *ctx)
+{
+	stack_cell_t base = *ctx->intrp_data.base;
+
+	return (base < 2 || base > 36) ? 10 : (unsigned int)base;
+}
+
+/**
+ * @brief formats u right aligned so that it ends just before end, and
+ * returns a pointer to the first digit.
+ *
+ * Decimal consumes two digits per step from digit_pairs, the constant
+ * divisor is turned into a multiply by the compiler. Power of two bases
+ * only shift and mask, the rest fall back to a divide per digit.
+ */
+static char *format_unsigned(char *end, uintptr_t u, unsigned int base)
+{
+	char *p = end;
+
+	if (base == 10) {
+		while (u >= 100) {
+			uintptr_t q = u / 100;
+			unsigned int r = (unsigned int)(u - q * 100);
+			p -= 2;
+			memcpy(p, &digit_pairs[r * 2], 2);
+			u = q;
+		}
+		if (u >= 10) {
+			p -= 2;
+			memcpy(p, &digit_pairs[u * 2], 2);
+		} else {
+			*--p = (char)('0' + u);
+		}
+	} else if ((base & (base - 1)) == 0) {
+		unsigned int shift = __builtin_ctz(base);
+		do {
+			*--p = digit_chars[u & (base - 1)];
+			u >>= shift;
+		} while (u != 0);
+	} else {
+		do {
+			*--p = digit_chars[u % base];
+			u /= base;
+		} while (u != 0);
+	}
+
+	return p;
+}
+
+/**
+ * @brief prints n in the current base, right aligned in width columns and
+ * followed by a space when trailing_space is set.
+ */
+void print_number(struct forth_ctx *ctx, stack_cell_t n, bool is_signed,
+		  stack_cell_t width, bool trailing_space)
+{
+	char buf[HOLD_BUFFER_SIZE + 2];
+	char *end = &buf[sizeof(buf) - 2];
+	bool negative = is_signed && n < 0;
+	uintptr_t u = negative ? 0 - (uintptr_t)n : (uintptr_t)n;
+	char *p = format_unsigned(end, u, current_base(ctx));
+
+	if (negative) {
+		*--p = '-';
+	}
+
+	while (end - p < width && p > buf) {
+		*--p = ' ';
+	}
+
+	if (trailing_space) {
+		*end++ = ' ';
+	}
+	*end = 0;
+
+	ctx->plat.puts(p);
+}
+
+static const struct {
+	stack_cell_t code;
+	const char *message;
+} throw_messages[] = {
+    {THROW_STACK_OVERFLOW, "Stack overflow\n"},
+    {THROW_STACK_UNDERFLOW, "Stack underflow\n"},
+    {THROW_RSTACK_OVERFLOW, "Return stack overflow\n"},
+    {THROW_INVALID_ADDRESS, "Invalid memory address\n"},
+    {THROW_DIVISION_BY_ZERO, "Division by zero error\n"},
+    {THROW_UNDEFINED_WORD, "Word not found\n"},
+    {THROW_COMPILE_ONLY, "Only valid while compiling\n"},
+    {THROW_PICTURED_OVERFLOW, "Pictured output overflow\n"},
+    {THROW_UNSUPPORTED, "Not possible in a task\n"},
+    {THROW_INVALID_ARGUMENT, "Invalid numeric argument\n"},
+    {THROW_INTERRUPT, "Instruction budget used up\n"},
+    {THROW_NOT_CREATED, "Not a word made by create\n"},
+    {THROW_INVALID_NAME, "Invalid name argument\n"},
+    {THROW_BLOCK_READ, "Block read error\n"},
+    {THROW_BLOCK_WRITE, "Block write error\n"},
+    {THROW_INVALID_BLOCK, "Invalid block number\n"},
+    {THROW_ORDER_OVERFLOW, "Search order overflow\n"},
+    {THROW_ORDER_UNDERFLOW, "Search order underflow\n"},
+    {THROW_ALLOCATE, "Allocate error\n"},
+    {THROW_FREE, "Free error\n"},
+    {THROW_RESIZE, "Resize error\n"},
+};
+
+/**
+ * @brief reports a throw nothing caught, abort (-1) is silent
+ */
+void print_throw(struct forth_ctx *ctx, stack_cell_t code)
+{
+	if (code == THROW_ABORT || code == THROW_ABORT_MESSAGE) {
+		return;
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(throw_messages); i++) {
+		if (throw_messages[i].code == code) {
+			ctx->plat.puts(throw_messages[i].message);
+			return;
+		}
+	}
+	ctx->plat.puts("Uncaught exception ");
+	print_number(ctx, code, true, 0, false);
+	ctx->plat.puts("\n");
+}
+
+/* Helper function to find a word's header from its execution token */
+static dict_header_t *find_word_header_by_xt(struct forth_ctx *ctx,
+					     stack_cell_t xt)
 {
 	/**
 	 * TODO: this might not need traversal..
 	 */
-	dict_header_t *header = ctx->dict.latest;
-	while (header != DICT_NULL) {
-		char *word_name = (char *)(header + 1);
-		word_t *codeword_addr =
-		    (word_t *)(word_name +
-			       ALIGN_UP_WORD_T(header->flags.f.length));
-		word_t codeword = *codeword_addr;
-
-		if (codeword == do_docol) {
-			/* For a colon word, compare the CFA */
-			if ((word_t)codeword_addr == xt) {
-				return word_name;
-			}
-		} else {
-			/* For a primitive, compare the function pointer */
-			if (codeword == xt) {
-				return word_name;
+	for (wordlist_t *wl = ctx->dict.wordlists; wl != NULL; wl = wl->prev) {
+		dict_header_t *header = wl->latest;
+		while (header != DICT_NULL) {
+			if (cfa_to_xt(ctx, dict_header_cfa(header)) == xt) {
+				return header;
 			}
+			header = header->link;
 		}
-		header = header->link;
 	}
 	return NULL;
 }
 
+/* names are not NUL terminated when their length fills the padding */
+static void print_word_name(struct forth_ctx *ctx, dict_header_t *header)
+{
+	char buf[WORD_NAME_MAX_LEN + 1];
+
+	memcpy(buf, dict_header_name(header), header->flags.f.length);
+	buf[header->flags.f.length] = 0;
+	ctx->plat.puts(buf);
+}
+
 /* helper function to print word defintion from dictionary header */
 void print_word_def(struct forth_ctx *ctx)
 {
 	dict_header_t *header = (dict_header_t *) stack_pop(ctx);
-	char buf[MAX_INPUT_LEN + 1];
-
-	char *word_name = (char *)(header + 1);
-	word_t *cfa =
-	    (word_t *)(word_name + ALIGN_UP_WORD_T(header->flags.f.length));
+	word_t *cfa = dict_header_cfa(header);
 
 	if (header->flags.f.hidden) {
 		return;
 	}
 
-	memcpy(buf, word_name, header->flags.f.length);
-	buf[header->flags.f.length] = 0;
 	ctx->plat.puts(": ");
-	ctx->plat.puts(buf);
+	print_word_name(ctx, header);
 	ctx->plat.puts(" ");
 
 	if (header->flags.f.immediate) {
 		ctx->plat.puts("immediate ");
 	}
 
-	if (*cfa != do_docol) {
+	thread_t *ip = (thread_t *)(cfa + 1);
+
+	if (*cfa == do_const) {
+		ctx->plat.puts("[constant] ");
+		print_number(ctx, *(stack_cell_t *)(cfa + 1), true, 0, true);
+		ctx->plat.puts("\n");
+		return;
+	} else if (*cfa == do_val) {
+		ctx->plat.puts("[value] ");
+		print_number(ctx, *(stack_cell_t *)(cfa + 1), true, 0, true);
+		ctx->plat.puts("\n");
+		return;
+	} else if (*cfa == do_var) {
+		ctx->plat.puts("[variable]\n");
+		return;
+	} else if (*cfa == do_does) {
+		ctx->plat.puts("[created] ");
+		ip = ((thread_t **)cfa)[1];
+		if (ip == NULL) {
+			ctx->plat.puts("\n");
+			return;
+		}
+		ctx->plat.puts("does> ");
+	} else if (*cfa != do_docol) {
 		ctx->plat.puts("[primitive]\n");
 		return;
 	}
 
-	word_t *ip = cfa + 1;
-	while (*ip != do_exit) {
-		const char *word_name = find_word_name_by_xt(ctx, *ip);
-		if (word_name) {
-			ctx->plat.puts(word_name);
+	stack_cell_t exit_xt = prim_xt(do_exit);
+	while (code_addr_valid(ctx, ip) && (stack_cell_t)*ip != exit_xt) {
+		stack_cell_t xt = (stack_cell_t)*ip++;
+		dict_header_t *w_h = find_word_header_by_xt(ctx, xt);
+		if (w_h) {
+			print_word_name(ctx, w_h);
 			ctx->plat.puts(" ");
 		} else {
-			char buf[32];
-			snprintf(buf, sizeof(buf), "%lu ", (unsigned long)*ip);
-			ctx->plat.puts(buf);
+			print_number(ctx, xt, true, 0, true);
+		}
+
+		/* inline operands of words that read from ip */
+		if (xt == prim_xt(do_lit)) {
+			print_number(ctx, thread_literal(ip), true, 0, true);
+			ip += LITERAL_THREAD_CELLS;
+#ifdef EMFORTH_TOKEN_THREADED
+		} else if (xt == prim_xt(do_lit16)) {
+			print_number(ctx, (int16_t)*ip, true, 0, true);
+			ip++;
+#endif
+		} else if (xt == prim_xt(do_jumptable)) {
+			stack_cell_t n;
+
+			print_number(ctx, thread_literal(ip), true, 0, true);
+			ip += LITERAL_THREAD_CELLS;
+			n = thread_offset(ip);
+			for (stack_cell_t i = 0;
+			     i < n + 2 && code_addr_valid(ctx, ip); i++) {
+				print_number(ctx, thread_offset(ip++), true, 0,
+					     true);
+			}
+		} else if (xt == prim_xt(do_branch) ||
+			   xt == prim_xt(do_0branch) ||
+			   xt == prim_xt(do_of) ||
+			   xt == prim_xt(do_local_fetch) ||
+			   xt == prim_xt(do_local_store)) {
+			print_number(ctx, thread_offset(ip), true, 0, true);
+			ip++;
+		} else if (xt == prim_xt(do_locals_enter)) {
+			print_number(ctx, thread_offset(ip), true, 0, true);
+			print_number(ctx, thread_offset(ip + 1), true, 0, true);
+			ip += 2;
+		} else if (xt == prim_xt(do_tick)) {
+			w_h = find_word_header_by_xt(ctx, (stack_cell_t)*ip);
+			if (w_h) {
+				print_word_name(ctx, w_h);
+				ctx->plat.puts(" ");
+			}
+			ip++;
 		}
-		ip++;
 	}
 
 	ctx->plat.puts(";\n");
@@ -126,29 +389,58 @@ void print_word_def(struct forth_ctx *ctx)
  */
 void do_create_word(struct forth_ctx *ctx)
 {
-	dict_header_t *old_latest;
 	dict_header_t *new;
+	stack_cell_t len = stack_pop(ctx);
+	size_t header_size;
+
+#ifdef EMFORTH_SANDBOX
+	/* (create) can be reached with any length */
+	if (len < 0 || len > WORD_NAME_MAX_LEN) {
+		forth_throw(ctx, THROW_INVALID_ARGUMENT);
+	}
+#endif
+	header_size = sizeof(dict_header_t) + ALIGN_UP_WORD_T(len);
+	stack_sub(ctx, ALIGN_UP_WORD_T(len) / (sizeof(word_t)));
 
-	old_latest = ctx->dict.latest;
+	/* the definition that follows starts word_t aligned */
 	ctx->dict.here = (unsigned char *)ALIGN_UP_WORD_T(ctx->dict.here);
-	new = (dict_header_t *)ctx->dict.here;
-	ctx->dict.here = (unsigned char *)(new + 1);
 
-	new->link = old_latest;
+	/* header and padded name must fit before anything is written */
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char **header_here = &ctx->dict.names_here;
+	if (!dict_names_reserve(ctx, header_size)) {
+		return;
+	}
+#else
+	unsigned char **header_here = &ctx->dict.here;
+	if (!dict_reserve(ctx, header_size)) {
+		return;
+	}
+#endif
+
+	wordlist_t *wl = ctx->dict.current;
+	unsigned int bucket = name_hash((char *)&ctx->stack[ctx->sp], len);
+
+	new = (dict_header_t *)*header_here;
+
+	new->link = wl->latest;
+	new->hlink = wl->buckets[bucket];
 	new->flags.f.hidden = 0;
 	new->flags.f.immediate = 0;
-	new->flags.f.length = stack_pop(ctx);
+	new->flags.f.length = len;
 
-	stack_sub(ctx, ALIGN_UP_WORD_T(new->flags.f.length) / (sizeof(word_t)));
-	memset(ctx->dict.here, 0, ALIGN_UP_WORD_T(new->flags.f.length));
-	memcpy(ctx->dict.here, &ctx->stack[ctx->sp], new->flags.f.length);
+	memset(dict_header_name(new), 0, ALIGN_UP_WORD_T(len));
+	memcpy(dict_header_name(new), &ctx->stack[ctx->sp], len);
 
 	/**
-	 * add length to 'here' round up to word_t size for alignment.
+	 * 'here' moves past the name, which is padded to word_t size.
 	 */
-	ctx->dict.here += new->flags.f.length;
-	ctx->dict.here =
-	    (unsigned char *)ALIGN_UP_WORD_T((stack_cell_t)ctx->dict.here);
+	*header_here = dict_header_end(new);
+#ifdef EMFORTH_SPLIT_DICT
+	new->cfa = (word_t *)ctx->dict.here;
+#endif
+	wl->latest = new;
+	wl->buckets[bucket] = new;
 	ctx->dict.latest = new;
 }
 
@@ -157,18 +449,228 @@ void do_find(struct forth_ctx *ctx)
 	stack_cell_t len = stack_pop(ctx);
 	size_t num_cells = ALIGN_UP_WORD_T(len) / sizeof(word_t);
 	char *addr = (char *)&ctx->stack[ctx->sp - num_cells];
+
+#ifdef EMFORTH_SANDBOX
+	if (len < 0) {
+		forth_throw(ctx, THROW_INVALID_ARGUMENT);
+	}
+#endif
 	stack_sub(ctx, num_cells);
 	stack_push(ctx, (stack_cell_t)find_word_header(ctx, addr, len));
 }
 
 void do_tick(struct forth_ctx *ctx)
 {
+	if (ctx->ip == NULL) {
+		/* interpreted, the next word comes from the input */
+		char name[MAX_INPUT_LEN + 1];
+		int len = read_token(ctx, name, MAX_INPUT_LEN);
+		dict_header_t *header =
+		    len > 0 ? find_word_header(ctx, name, len) : NULL;
+
+		if (header == NULL) {
+			forth_throw(ctx, THROW_UNDEFINED_WORD);
+		}
+		stack_push(ctx, cfa_to_xt(ctx, dict_header_cfa(header)));
+		return;
+	}
 	/* push the xt of the next word to stack */
 	stack_push(ctx, (stack_cell_t)*ctx->ip);
 	/* Skip over the next word */
 	ctx->ip += 1;
 }
 
+/**
+ * @brief ( xt -- ) appends xt to the current definition. Unlike ',' this
+ * compiles a thread cell, which is not a full cell with tokens.
+ */
+void do_compile_comma(struct forth_ctx *ctx)
+{
+	stack_cell_t xt = stack_pop(ctx);
+
+	if (!fold_xt(ctx, xt)) {
+		compile_xt(ctx, xt);
+	}
+}
+
+/**
+ * @brief ( -- addr ) compiles a forward branch offset to be filled in by
+ * >resolve, and pushes its address.
+ */
+void do_mark_forward(struct forth_ctx *ctx)
+{
+	thread_t offset = 0;
+
+	if (fold_mark(ctx)) {
+		return;
+	}
+	stack_push(ctx, (stack_cell_t)ctx->dict.here);
+	compile_bytes(ctx, &offset, sizeof(offset));
+}
+
+/**
+ * @brief ( addr -- ) makes the forward branch offset at addr jump to here
+ */
+void do_resolve_forward(struct forth_ctx *ctx)
+{
+	thread_t *offset_p = (thread_t *)stack_pop(ctx);
+
+#ifdef EMFORTH_SANDBOX
+	if (offset_p != &ctx->intrp_data.fold_dead &&
+	    !code_addr_valid(ctx, offset_p)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+	/* code before here is a branch target now */
+	fold_barrier(ctx);
+	thread_set_offset(offset_p, ctx->dict.here - (unsigned char *)offset_p);
+}
+
+/* == constant folding == */
+
+/*
+ * Pure primitives, and how many cells they take and leave. When the cells
+ * they take were all compiled as literals just before, they are run at
+ * compile time and the literals are replaced with what they leave.
+ */
+static const struct fold_entry {
+	word_t fn;
+	unsigned char in, out;
+} fold_table[] = {
+    {do_plus, 2, 1},	   {do_minus, 2, 1},	  {do_multiply, 2, 1},
+    {do_divide, 2, 1},	   {do_mod, 2, 1},	  {do_incr, 1, 1},
+    {do_decr, 1, 1},	   {do_equal, 2, 1},	  {do_less_than, 2, 1},
+    {do_greater_than, 2, 1}, {do_zero_equal, 1, 1}, {do_dup, 1, 2},
+    {do_drop, 1, 0},	   {do_swap, 2, 2},	  {do_over, 2, 3},
+    {do_rot, 3, 3},
+};
+
+/* value of the literal compiled at p */
+static stack_cell_t fold_value(const thread_t *p)
+{
+#ifdef EMFORTH_TOKEN_THREADED
+	if (*p == prim_xt(do_lit16)) {
+		return (int16_t)p[1];
+	}
+#endif
+	return thread_literal(p + 1);
+}
+
+/* the pending literals, or 0 when something was compiled after them */
+static int fold_pending(struct forth_ctx *ctx)
+{
+	struct interpreter_data *d = &ctx->intrp_data;
+
+	if (d->fold_end != ctx->dict.here || d->fold_0branch) {
+		d->fold_count = 0;
+	}
+	return d->fold_count;
+}
+
+void fold_barrier(struct forth_ctx *ctx)
+{
+	ctx->intrp_data.fold_count = 0;
+	ctx->intrp_data.fold_0branch = false;
+	ctx->intrp_data.fold_end = NULL;
+}
+
+void fold_literal(struct forth_ctx *ctx, stack_cell_t n)
+{
+	struct interpreter_data *d = &ctx->intrp_data;
+	thread_t *start = (thread_t *)ctx->dict.here;
+
+	if (fold_pending(ctx) == FOLD_LITS_MAX) {
+		/* only the newest ones can still fold */
+		memmove(d->fold_lits, d->fold_lits + 1,
+			(FOLD_LITS_MAX - 1) * sizeof(d->fold_lits[0]));
+		d->fold_count--;
+	}
+	compile_literal(ctx, n);
+	d->fold_lits[d->fold_count++] = start;
+	d->fold_end = ctx->dict.here;
+}
+
+bool fold_xt(struct forth_ctx *ctx, stack_cell_t xt)
+{
+	struct interpreter_data *d = &ctx->intrp_data;
+	int pending = fold_pending(ctx);
+	stack_cell_t out[3];
+	struct catch_frame frame;
+	word_t fn;
+	size_t i;
+
+#ifdef EMFORTH_TOKEN_THREADED
+	fn = (thread_t)xt < PRIM_TABLE_MAX ? prim_table[xt] : NULL;
+#else
+	fn = xt_to_cfa(ctx, xt) == NULL ? (word_t)xt : NULL;
+#endif
+	if (pending == 0 || fn == NULL) {
+		return false;
+	}
+	if (fn == do_0branch) {
+		/* >mark decides once the branch is complete */
+		compile_xt(ctx, xt);
+		d->fold_0branch = true;
+		d->fold_end = ctx->dict.here;
+		return true;
+	}
+	for (i = 0; i < ARRAY_SIZE(fold_table); i++) {
+		if (fold_table[i].fn == fn) {
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(fold_table) || fold_table[i].in > pending) {
+		return false;
+	}
+
+	/* run it on the literals, unless it throws (division by zero) */
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		for (int k = pending - fold_table[i].in; k < pending; k++) {
+			stack_push(ctx, fold_value(d->fold_lits[k]));
+		}
+		fn(ctx);
+		for (int k = fold_table[i].out - 1; k >= 0; k--) {
+			out[k] = stack_pop(ctx);
+		}
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+		return false;
+	}
+
+	d->fold_count = pending - fold_table[i].in;
+	ctx->dict.here = d->fold_count < pending
+			     ? (unsigned char *)d->fold_lits[d->fold_count]
+			     : ctx->dict.here;
+	d->fold_end = ctx->dict.here;
+	for (int k = 0; k < fold_table[i].out; k++) {
+		fold_literal(ctx, out[k]);
+	}
+	return true;
+}
+
+bool fold_mark(struct forth_ctx *ctx)
+{
+	struct interpreter_data *d = &ctx->intrp_data;
+	thread_t *lit;
+
+	if (!d->fold_0branch || d->fold_end != ctx->dict.here) {
+		return false;
+	}
+	lit = d->fold_lits[d->fold_count - 1];
+	ctx->dict.here = (unsigned char *)lit;
+	fold_barrier(ctx);
+	if (fold_value(lit) == 0) {
+		/* always taken, the caller compiles the offset */
+		compile_xt(ctx, prim_xt(do_branch));
+		return false;
+	}
+	/* never taken, nothing is left of it and >resolve fills in a dummy */
+	stack_push(ctx, (stack_cell_t)&d->fold_dead);
+	return true;
+}
+
 /**
  * @brief creates new dictionaly item
  *
@@ -181,582 +683,1957 @@ void do_comma(struct forth_ctx *ctx)
 	compile_word(ctx, codeword);
 }
 
-void do_printstack(struct forth_ctx *ctx)
+/**
+ * @brief ( n -- ) reserves n bytes of dictionary space, releases it when
+ * n is negative, down to what emforth_init defined.
+ */
+void do_allot(struct forth_ctx *ctx)
 {
-	ctx->plat.puts("STACK > ");
-	stack_cell_t p = ctx->sp;
-	char str[32];
-	while (p > 0 && p <= STACK_SIZE_MAX) {
-		if (p - 1 < STACK_SIZE_MAX) {
-			snprintf(str, sizeof(str), "%lu ", ctx->stack[p - 1]);
-		} else {
-			snprintf(str, sizeof(str), "??? ");
+	stack_cell_t n = stack_pop(ctx);
+
+	if (n < 0) {
+#ifdef EMFORTH_HOSTED
+		par_task_check(ctx);
+#endif
+		/* never below what emforth_init defined, like forget */
+		if (-n > ctx->dict.here - ctx->dict.fence) {
+			n = -(ctx->dict.here - ctx->dict.fence);
 		}
-		str[sizeof(str) - 1] = 0;
-		ctx->plat.puts(str);
-		p--;
+	} else if (!dict_reserve(ctx, n)) {
+		return;
 	}
-	ctx->plat.puts("\n");
+	ctx->dict.here += n;
 }
 
-void do_dot(struct forth_ctx *ctx)
+/**
+ * @brief ( -- u ) number of bytes the dictionary can still grow by
+ */
+void do_unused(struct forth_ctx *ctx)
 {
-	char str[30];
-	if (ctx->sp > 0) {
-		snprintf(str, sizeof(str), "%lu\n", stack_pop(ctx));
-		str[sizeof(str) - 1] = 0;
-		ctx->plat.puts(str);
-	} else {
-		snprintf(str, sizeof(str), "Data stack underflow\n");
-		str[sizeof(str) - 1] = 0;
-		ctx->plat.puts(str);
-	}
+	stack_push(ctx, ctx->dict.end - ctx->dict.here);
 }
 
-/**
- * @brief drops top item from stack
- */
-void do_drop(struct forth_ctx *ctx)
+void do_printstack(struct forth_ctx *ctx)
 {
-	if (ctx->sp > 0) {
-		(void)stack_pop(ctx);
+	ctx->plat.puts("STACK > ");
+	for (stack_cell_t p = ctx->sp; p > 0; p--) {
+		print_number(ctx, ctx->stack[p - 1], true, 0, true);
 	}
+	ctx->plat.puts("\n");
 }
 
 /**
- * @brief duplicates top item on stack
+ * @brief prints top of stack as a signed number followed by a space
  */
-void do_dup(struct forth_ctx *ctx)
+void do_dot(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 1) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_push(ctx, n1);
-		stack_push(ctx, n1);
-	}
+	print_number(ctx, stack_pop(ctx), true, 0, true);
 }
 
 /**
- * @brief swaps top two items on stack
+ * @brief prints top of stack as an unsigned number followed by a space
  */
-void do_swap(struct forth_ctx *ctx)
+void do_udot(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_cell_t n2 = stack_pop(ctx);
-		stack_push(ctx, n1);
-		stack_push(ctx, n2);
-	}
+	print_number(ctx, stack_pop(ctx), false, 0, true);
 }
 
 /**
- * @brief rotates top three items on stack
+ * @brief ( n width -- ) prints n right aligned in width columns
  */
-void do_rot(struct forth_ctx *ctx)
+void do_dot_r(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 3) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_cell_t n2 = stack_pop(ctx);
-		stack_cell_t n3 = stack_pop(ctx);
-		stack_push(ctx, n2);
-		stack_push(ctx, n1);
-		stack_push(ctx, n3);
-	}
+	stack_cell_t width = stack_pop(ctx);
+	print_number(ctx, stack_pop(ctx), true, width, false);
+}
+
+void do_hex(struct forth_ctx *ctx)
+{
+	*ctx->intrp_data.base = 16;
+}
+
+void do_decimal(struct forth_ctx *ctx)
+{
+	*ctx->intrp_data.base = 10;
 }
 
 /**
- * @brief copies second item to top of stack
+ * @brief ( addr len -- ) prints len characters starting at addr
  */
-void do_over(struct forth_ctx *ctx)
+void do_type(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_cell_t n2 = stack_pop(ctx);
-		stack_push(ctx, n2);
-		stack_push(ctx, n1);
-		stack_push(ctx, n2);
+	stack_cell_t len = stack_pop(ctx);
+	const char *addr = (const char *)stack_pop(ctx);
+	char buf[64];
+
+#ifdef EMFORTH_SANDBOX
+	if (len > 0 && !addr_valid(ctx, (stack_cell_t)addr, len)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+
+	while (len > 0) {
+		size_t n = len < (stack_cell_t)sizeof(buf) - 1
+			       ? (size_t)len
+			       : sizeof(buf) - 1;
+		memcpy(buf, addr, n);
+		buf[n] = 0;
+		ctx->plat.puts(buf);
+		addr += n;
+		len -= n;
 	}
 }
 
-void do_plus(struct forth_ctx *ctx)
+/**
+ * Pictured numeric output. Digits are prepended to a buffer that ends at
+ * intrp_data.hold_end. These work on single unsigned cells as this forth
+ * has no double cell arithmetic.
+ */
+
+/**
+ * @brief begin pictured numeric output
+ */
+void do_less_number_sign(struct forth_ctx *ctx)
 {
-	stack_cell_t n1 = stack_pop(ctx);
-	stack_cell_t n2 = stack_pop(ctx);
-	stack_push(ctx, n1 + n2);
+	ctx->intrp_data.hld = ctx->intrp_data.hold_end;
 }
 
-void do_multiply(struct forth_ctx *ctx)
+static inline void hold_char(struct forth_ctx *ctx, char c)
 {
-	stack_cell_t n1 = stack_pop(ctx);
-	stack_cell_t n2 = stack_pop(ctx);
-	stack_push(ctx, n1 * n2);
+	if (ctx->intrp_data.hld <=
+	    ctx->intrp_data.hold_end - HOLD_BUFFER_SIZE) {
+		forth_throw(ctx, THROW_PICTURED_OVERFLOW);
+	}
+	*--ctx->intrp_data.hld = c;
 }
 
-void do_minus(struct forth_ctx *ctx)
+/**
+ * @brief ( c -- ) prepend character to pictured output
+ */
+void do_hold(struct forth_ctx *ctx)
 {
-	stack_cell_t n1 = stack_pop(ctx);
-	stack_cell_t n2 = stack_pop(ctx);
-	stack_push(ctx, n2 - n1);
+	hold_char(ctx, (char)stack_pop(ctx));
 }
 
-void do_divide(struct forth_ctx *ctx)
+/**
+ * @brief ( u -- u' ) prepend the least significant digit of u
+ */
+void do_number_sign(struct forth_ctx *ctx)
 {
-	stack_cell_t n1 = stack_pop(ctx);
-	stack_cell_t n2 = stack_pop(ctx);
-	if (n1 != 0) {
-		stack_push(ctx, n2 / n1);
-	} else {
-		ctx->plat.puts("Division by zero error\n");
-		stack_push(ctx, 0);
-	}
+	uintptr_t u = (uintptr_t)stack_pop(ctx);
+	unsigned int base = current_base(ctx);
+
+	hold_char(ctx, digit_chars[u % base]);
+	stack_push(ctx, (stack_cell_t)(u / base));
 }
 
 /**
- * @brief pops top two items on stack and pushes result of their modulo.
+ * @brief ( u -- 0 ) prepend all remaining digits of u
  */
-void do_mod(struct forth_ctx *ctx)
+void do_number_sign_s(struct forth_ctx *ctx)
 {
-	stack_cell_t n1 = stack_pop(ctx);
-	stack_cell_t n2 = stack_pop(ctx);
-	if (n1 != 0) {
-		stack_push(ctx, n2 % n1);
-	} else {
-		ctx->plat.puts("Division by zero error\n");
-		stack_push(ctx, 0);
+	char buf[HOLD_BUFFER_SIZE];
+	char *end = &buf[sizeof(buf)];
+	char *p = format_unsigned(end, (uintptr_t)stack_pop(ctx),
+				  current_base(ctx));
+
+	while (end > p) {
+		hold_char(ctx, *--end);
 	}
+	stack_push(ctx, 0);
 }
 
 /**
- * @brief increments top stack item by 1.
+ * @brief ( n -- ) prepend a minus sign if n is negative
  */
-void do_incr(struct forth_ctx *ctx)
+void do_sign(struct forth_ctx *ctx)
 {
-	if (ctx->sp > 0) {
-		/* sp is next available slot */
-		ctx->stack[ctx->sp - 1]++;
+	if (stack_pop(ctx) < 0) {
+		hold_char(ctx, '-');
 	}
 }
 
 /**
- * @brief decrements top stack item by 1.
+ * @brief ( u -- addr len ) end pictured output, leave the string
  */
-void do_decr(struct forth_ctx *ctx)
+void do_number_sign_greater(struct forth_ctx *ctx)
 {
-	if (ctx->sp > 0) {
-		/* sp is next available slot */
-		ctx->stack[ctx->sp - 1]--;
-	}
+	(void)stack_pop(ctx);
+	stack_push(ctx, (stack_cell_t)ctx->intrp_data.hld);
+	stack_push(ctx,
+		   ctx->intrp_data.hold_end - ctx->intrp_data.hld);
 }
 
 /**
- * @brief compares top two items on stack for equality.
+ * @brief drops top item from stack
  */
-void do_equal(struct forth_ctx *ctx)
+void do_drop(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_cell_t n2 = stack_pop(ctx);
-		stack_push(ctx, n1 == n2 ? 1 : 0);
-	} else {
-		stack_push(ctx, 0);
-	}
+	(void)stack_pop(ctx);
 }
 
 /**
- * @brief compares top two items on stack (n1 n2 -- flag), flag is true if n1 <
- * n2.
+ * @brief duplicates top item on stack
+ */
+void do_dup(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_push(ctx, n1);
+	stack_push(ctx, n1);
+}
+
+/**
+ * @brief swaps top two items on stack
+ */
+void do_swap(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n1);
+	stack_push(ctx, n2);
+}
+
+/**
+ * @brief rotates top three items on stack
+ */
+void do_rot(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_cell_t n3 = stack_pop(ctx);
+	stack_push(ctx, n2);
+	stack_push(ctx, n1);
+	stack_push(ctx, n3);
+}
+
+/**
+ * @brief copies second item to top of stack
+ */
+void do_over(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n2);
+	stack_push(ctx, n1);
+	stack_push(ctx, n2);
+}
+
+void do_plus(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n1 + n2);
+}
+
+void do_multiply(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n1 * n2);
+}
+
+void do_minus(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n2 - n1);
+}
+
+void do_divide(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	if (n1 == 0) {
+		forth_throw(ctx, THROW_DIVISION_BY_ZERO);
+	}
+	stack_push(ctx, n2 / n1);
+}
+
+/**
+ * @brief pops top two items on stack and pushes result of their modulo.
+ */
+void do_mod(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	if (n1 == 0) {
+		forth_throw(ctx, THROW_DIVISION_BY_ZERO);
+	}
+	stack_push(ctx, n2 % n1);
+}
+
+/**
+ * @brief increments top stack item by 1.
+ */
+void do_incr(struct forth_ctx *ctx)
+{
+	if (ctx->sp == 0) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
+	/* sp is next available slot */
+	ctx->stack[ctx->sp - 1]++;
+}
+
+/**
+ * @brief decrements top stack item by 1.
+ */
+void do_decr(struct forth_ctx *ctx)
+{
+	if (ctx->sp == 0) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
+	/* sp is next available slot */
+	ctx->stack[ctx->sp - 1]--;
+}
+
+/**
+ * @brief compares top two items on stack for equality.
+ */
+void do_equal(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n1 == n2 ? 1 : 0);
+}
+
+/**
+ * @brief compares top two items on stack (n1 n2 -- flag), flag is true if n1 <
+ * n2.
  */
 void do_less_than(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_cell_t n2 = stack_pop(ctx);
-		stack_push(ctx, n2 < n1 ? 1 : 0);
-	} else {
-		stack_push(ctx, 0);
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n2 < n1 ? 1 : 0);
+}
+
+/**
+ * @brief compares top two items on stack (n1 n2 -- flag), flag is true if n1 >
+ * n2.
+ */
+void do_greater_than(struct forth_ctx *ctx)
+{
+	stack_cell_t n1 = stack_pop(ctx);
+	stack_cell_t n2 = stack_pop(ctx);
+	stack_push(ctx, n2 > n1 ? 1 : 0);
+}
+
+/**
+ * @brief tests if top stack item equals zero.
+ */
+void do_zero_equal(struct forth_ctx *ctx)
+{
+	stack_cell_t n = stack_pop(ctx);
+	stack_push(ctx, n == 0 ? 1 : 0);
+}
+
+/**
+ * @brief fetches a cell from memory at given address.
+ */
+void do_fetch(struct forth_ctx *ctx)
+{
+	stack_cell_t *p = access_ptr(ctx, stack_pop(ctx), sizeof(*p));
+
+	stack_push(ctx, *p);
+}
+
+/**
+ * @brief stores a cell to memory at given address.
+ */
+void do_store(struct forth_ctx *ctx)
+{
+	stack_cell_t *p = store_ptr(ctx, stack_pop(ctx), sizeof(*p));
+
+	*p = stack_pop(ctx);
+}
+
+/**
+ * @brief fetches a single byte from memory at given address.
+ */
+void do_cfetch(struct forth_ctx *ctx)
+{
+	unsigned char *p = access_ptr(ctx, stack_pop(ctx), 1);
+
+	stack_push(ctx, *p);
+}
+
+/**
+ * @brief stores a single byte to memory at given address.
+ */
+void do_cstore(struct forth_ctx *ctx)
+{
+	unsigned char *p = store_ptr(ctx, stack_pop(ctx), 1);
+
+	*p = (unsigned char)(stack_pop(ctx) & 0xFF);
+}
+
+#ifdef EMFORTH_SANDBOX
+/*
+ * Words that take a header or a wordlist from the stack check that it is
+ * one in sandbox builds, headers by walking every wordlist.
+ */
+static void header_check(struct forth_ctx *ctx, dict_header_t *h)
+{
+	for (wordlist_t *wl = ctx->dict.wordlists; wl != NULL; wl = wl->prev) {
+		for (dict_header_t *p = wl->latest; p != DICT_NULL;
+		     p = p->link) {
+			if (p == h) {
+				return;
+			}
+		}
+	}
+	forth_throw(ctx, THROW_INVALID_ADDRESS);
+}
+
+#endif
+
+/* throws unless wl is a wordlist, in every build since set-order needs it */
+static void wordlist_check(struct forth_ctx *ctx, wordlist_t *wl)
+{
+	for (wordlist_t *p = ctx->dict.wordlists; p != NULL; p = p->prev) {
+		if (p == wl) {
+			return;
+		}
+	}
+	forth_throw(ctx, THROW_INVALID_ADDRESS);
+}
+
+/**
+ * @brief convert pointer to word in dictionary to the code field address.
+ * stack_pop(ctx) -> dictionary word pointer
+ * ----
+ * stack_push(ctx, address)
+ */
+void do_2cfa(struct forth_ctx *ctx)
+{
+	dict_header_t *w_h = (dict_header_t *)stack_pop(ctx);
+	stack_push(ctx, (stack_cell_t)(w_h + 1));
+}
+
+/**
+ * @brief this one gives the same address as would be compiled for a word
+ * which is included in the definition of a forth word. We also call it xt
+ * or execution token.
+ *
+ * stack_pop(ctx) -> dictionary word pointer
+ * ----
+ * stack_push(ctx, address)
+ */
+void do_2dfa(struct forth_ctx *ctx)
+{
+	dict_header_t *w_h = (dict_header_t *)stack_pop(ctx);
+	word_t *codeword_addr;
+
+#ifdef EMFORTH_SANDBOX
+	header_check(ctx, w_h);
+#endif
+	codeword_addr = dict_header_cfa(w_h);
+
+	/* For a colon word, the xt is the address of its definition (the
+	 * CFA), for a primitive, the function pointer itself (the code). */
+	stack_push(ctx, cfa_to_xt(ctx, codeword_addr));
+}
+
+/**
+ * @brief switch to immediatemode
+ */
+void do_lbrac(struct forth_ctx *ctx)
+{
+	ctx->intrp_data.mode = MODE_IMMEDIATE;
+}
+
+/**
+ * @brief switch to compile mode
+ */
+void do_rbrac(struct forth_ctx *ctx)
+{
+	ctx->intrp_data.mode = MODE_COMPILE;
+}
+
+/**
+ * @brief puts value of ctx->dict.latest on the stack
+ **/
+void do_latest_fetch(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)ctx->dict.latest);
+}
+
+/**
+ * @brief pushes current ctx->dict.here pointer to stack
+ */
+void do_here(struct forth_ctx *ctx)
+{
+	/* whoever asks may branch back to it */
+	fold_barrier(ctx);
+	stack_push(ctx, (stack_cell_t)ctx->dict.here);
+}
+
+/**
+ * @brief pushes address of the cell holding the number conversion radix
+ */
+void do_base(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)ctx->intrp_data.base);
+}
+
+/**
+ * @brief Pops link pointer to word, and toggles the hidden flag.
+ */
+void do_hidden(struct forth_ctx *ctx)
+{
+	dict_header_t *w_h = (dict_header_t *)stack_pop(ctx);
+	w_h -= 1;
+#ifdef EMFORTH_SANDBOX
+	header_check(ctx, w_h);
+#endif
+	w_h->flags.f.hidden ^= 1;
+}
+
+/**
+ * @brief toggles immediate mode of latest word
+ */
+void do_immediate(struct forth_ctx *ctx)
+{
+	ctx->dict.latest->flags.f.immediate ^= 1;
+}
+
+/**
+ * @brief reads a token and pushes to stack (string and length on top)
+ */
+void do_word(struct forth_ctx *ctx)
+{
+	char token[MAX_INPUT_LEN + 1];
+	int len = read_token(ctx, token, MAX_INPUT_LEN);
+
+	/* an empty name is pushed at end of input */
+	stack_push_wordname(ctx, token, len < 0 ? 0 : len);
+}
+
+/**
+ * @brief reads an input character to top of stack
+ */
+void do_key(struct forth_ctx *ctx)
+{
+	stack_push(ctx, input_getchar(ctx));
+}
+
+/**
+ * @brief ( addr len -- ) interprets the string as if it were typed in
+ */
+void do_evaluate(struct forth_ctx *ctx)
+{
+	stack_cell_t len = stack_pop(ctx);
+	const char *buf = (const char *)stack_pop(ctx);
+
+#ifdef EMFORTH_SANDBOX
+	if (len != 0 && !addr_valid(ctx, (stack_cell_t)buf, len)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+	evaluate_buffer(ctx, buf, len);
+}
+
+/**
+ * @brief ( xt -- ) runs the word with the given execution token
+ */
+void do_execute(struct forth_ctx *ctx)
+{
+	execute_xt(ctx, stack_pop(ctx));
+}
+
+/**
+ * @brief ( xt -- code ) runs xt, pushing 0 when it returns normally or
+ * the code it threw, with both stacks cut back to their depth at catch.
+ */
+void do_catch(struct forth_ctx *ctx)
+{
+	stack_cell_t xt = stack_pop(ctx);
+	struct catch_frame frame;
+
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		execute_xt(ctx, xt);
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+	}
+	stack_push(ctx, frame.code);
+}
+
+/**
+ * @brief ( code -- ) unwinds to the innermost catch unless code is 0
+ */
+void do_throw(struct forth_ctx *ctx)
+{
+	stack_cell_t code = stack_pop(ctx);
+
+	if (code != 0) {
+		forth_throw(ctx, code);
+	}
+}
+
+/**
+ * @brief empties the stacks and returns to the interpreter, a throw of -1
+ */
+void do_abort(struct forth_ctx *ctx)
+{
+	forth_throw(ctx, THROW_ABORT);
+}
+
+/**
+ * @brief the ':' compilation word. Reads token, creates dictionary header
+ * marks it hidden until ';' unhides it, switches to compilation mode to
+ * begin compilation of the word. The first word (codeword) will be do_docol.
+ */
+void do_colon(struct forth_ctx *ctx)
+{
+	dict_header_t *old_latest = ctx->dict.latest;
+
+	/* Read next word and create dictionary entry */
+	do_word(ctx);
+	do_create_word(ctx);
+	if (ctx->dict.latest == old_latest) {
+		return;
+	}
+
+	/* Hide the word until definition is complete */
+	ctx->dict.latest->flags.f.hidden = 1;
+	ctx->intrp_data.locals_count = 0;
+
+	/* Compile DOCOL as the codeword for this definition */
+	word_t w = do_docol;
+	compile_word(ctx, (stack_cell_t)w);
+
+	/* Switch to compile mode */
+	ctx->intrp_data.mode = MODE_COMPILE;
+}
+
+/**
+ * @brief ( here names -- ) the runtime of a marker, removes every
+ * definition from here on, which includes the marker itself. names is
+ * where its header went in name space, see dict_rollback().
+ */
+void do_marker_restore(struct forth_ctx *ctx)
+{
+	unsigned char *names_here = (unsigned char *)stack_pop(ctx);
+	unsigned char *new_here = (unsigned char *)stack_pop(ctx);
+
+	if (!dict_rollback(ctx, new_here, names_here)) {
+		ctx->plat.puts("marker: dictionary already below marker\n");
+	}
+}
+
+/**
+ * @brief creates a word that, when executed, forgets itself and every
+ * word defined after it. It is compiled as
+ * "lit <here> lit <names here> (marker) exit".
+ */
+void do_marker(struct forth_ctx *ctx)
+{
+	unsigned char *saved_here = ctx->dict.here;
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char *saved_names = ctx->dict.names_here;
+#else
+	unsigned char *saved_names = saved_here;
+#endif
+	dict_header_t *old_latest = ctx->dict.latest;
+
+	do_word(ctx);
+	do_create_word(ctx);
+	if (ctx->dict.latest == old_latest) {
+		return;
+	}
+
+	compile_word(ctx, (stack_cell_t)do_docol);
+	compile_literal(ctx, (stack_cell_t)saved_here);
+	compile_literal(ctx, (stack_cell_t)saved_names);
+	compile_xt(ctx, prim_xt(do_marker_restore));
+	compile_xt(ctx, prim_xt(do_exit));
+}
+
+/**
+ * @brief reads a word name, removes it and every word defined after it.
+ */
+void do_forget(struct forth_ctx *ctx)
+{
+	do_word(ctx);
+	stack_cell_t len = stack_pop(ctx);
+	size_t num_cells = ALIGN_UP_WORD_T(len) / sizeof(word_t);
+	char *name = (char *)&ctx->stack[ctx->sp - num_cells];
+	stack_sub(ctx, num_cells);
+
+	dict_header_t *header = find_word_header(ctx, name, len);
+	if (!header) {
+		ctx->plat.puts("forget: word not found\n");
+		return;
+	}
+
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char *new_here = (unsigned char *)dict_header_cfa(header);
+#else
+	unsigned char *new_here = (unsigned char *)header;
+#endif
+
+	if (!dict_rollback(ctx, new_here, (unsigned char *)header)) {
+		ctx->plat.puts("forget: cannot forget a builtin word\n");
+	}
+}
+
+/**
+ * @brief finishes compilation of currently being defined word by
+ * compiling do_exit as the last word, unhides it, switches back to
+ * immediate mode.
+ */
+void do_semicolon(struct forth_ctx *ctx)
+{
+	word_t w;
+
+	/* Compile EXIT to end definition, releasing any locals first */
+	if (ctx->intrp_data.locals_count > 0) {
+		compile_xt(ctx, prim_xt(do_locals_leave));
+		ctx->intrp_data.locals_count = 0;
+	}
+	w = do_exit;
+	compile_xt(ctx, prim_xt(w));
+
+	/* Unhide the word */
+	ctx->dict.latest->flags.f.hidden = 0;
+
+	/* Switch back to immediate mode */
+	ctx->intrp_data.mode = MODE_IMMEDIATE;
+}
+
+/* == defining words == */
+
+/* reads a name and creates a header for it, false if that failed */
+static bool create_named(struct forth_ctx *ctx)
+{
+	dict_header_t *old_latest = ctx->dict.latest;
+
+	do_word(ctx);
+	do_create_word(ctx);
+	return ctx->dict.latest != old_latest;
+}
+
+/**
+ * @brief ( x -- ) constant name, defines name to push x
+ */
+void do_constant(struct forth_ctx *ctx)
+{
+	stack_cell_t x = stack_pop(ctx);
+
+	if (create_named(ctx)) {
+		compile_word(ctx, (stack_cell_t)do_const);
+		compile_word(ctx, x);
+	}
+}
+
+/**
+ * @brief ( x -- ) value name, like constant, but 'to name' changes it
+ */
+void do_value(struct forth_ctx *ctx)
+{
+	stack_cell_t x = stack_pop(ctx);
+
+	if (create_named(ctx)) {
+		compile_word(ctx, (stack_cell_t)do_val);
+		compile_word(ctx, x);
+	}
+}
+
+/**
+ * @brief variable name, defines name to push the address of a cell
+ */
+void do_variable(struct forth_ctx *ctx)
+{
+	if (create_named(ctx)) {
+		compile_word(ctx, (stack_cell_t)do_var);
+		compile_word(ctx, 0);
+	}
+}
+
+/**
+ * @brief create name, defines name to push the address of the data space
+ * that follows it, which allot and ',' extend.
+ */
+void do_create(struct forth_ctx *ctx)
+{
+	if (create_named(ctx)) {
+		compile_word(ctx, (stack_cell_t)do_does);
+		compile_word(ctx, 0); /* no does> code yet */
+	}
+}
+
+/**
+ * @brief the runtime of does>, gives the word create made last the code
+ * that follows, then leaves the defining word.
+ */
+void do_does_set(struct forth_ctx *ctx)
+{
+	word_t *cfa = dict_header_cfa(ctx->dict.latest);
+
+	if (*cfa != do_does) {
+		forth_throw(ctx, THROW_NOT_CREATED);
+	}
+	((thread_t **)cfa)[1] = ctx->ip;
+	do_exit(ctx);
+}
+
+/**
+ * @brief does> ends the part of a defining word that runs when it
+ * defines a word, the rest of it runs when that word does, with the
+ * address of its data on the stack.
+ */
+void do_does_compile(struct forth_ctx *ctx)
+{
+	if (ctx->intrp_data.mode != MODE_COMPILE) {
+		forth_throw(ctx, THROW_COMPILE_ONLY);
+	}
+	if (ctx->intrp_data.locals_count > 0) {
+		compile_xt(ctx, prim_xt(do_locals_leave));
+		ctx->intrp_data.locals_count = 0;
+	}
+	compile_xt(ctx, prim_xt(do_does_set));
+}
+
+/**
+ * @brief ( xt -- addr ) data address of a word made by create
+ */
+void do_to_body(struct forth_ctx *ctx)
+{
+	word_t *cfa = xt_to_cfa(ctx, stack_pop(ctx));
+
+	if (cfa == NULL || *cfa != do_does) {
+		forth_throw(ctx, THROW_NOT_CREATED);
+	}
+	stack_push(ctx, (stack_cell_t)(cfa + 2));
+}
+
+/* == memoization == */
+
+/*
+ * memoize makes a headerless created word whose does> code is
+ * "(memo) exit" and whose data is a struct memo:
+ *
+ *   [do_does][code][struct memo][(memo) exit][entries]
+ *
+ * Each entry is a stamp, 0 while unused, followed by n_in input cells
+ * and n_out result cells. Inputs hash to an entry, and are looked for
+ * there and in the MEMO_PROBE - 1 entries after it. A miss takes the
+ * unused or least recently used entry of those.
+ */
+#define MEMO_ENTRIES 64u /* must be a power of 2 */
+#define MEMO_PROBE 4u
+#define MEMO_CELLS_MAX 8
+
+struct memo {
+	stack_cell_t xt; /* the word memoized */
+	stack_cell_t n_in;
+	stack_cell_t n_out;
+	stack_cell_t hits;
+	stack_cell_t misses;
+	stack_cell_t clock; /* stamp of the last entry used */
+	stack_cell_t *entries;
+};
+
+#ifdef EMFORTH_SANDBOX
+/*
+ * A struct memo a program got to, which may be anything: it must be laid
+ * out the way do_memoize() leaves it, with sizes it allows.
+ */
+static void memo_check(struct forth_ctx *ctx, struct memo *m)
+{
+	word_t *cfa = (word_t *)m - 2;
+	thread_t *code = (thread_t *)(m + 1);
+	stack_cell_t *entries = (stack_cell_t *)ALIGN_UP_WORD_T(code + 2);
+	size_t here_off = ctx->dict.here - ctx->dict.mem;
+
+	if (!cfa_valid(ctx, cfa) ||
+	    !region_valid(ctx->dict.mem, here_off, (stack_cell_t)m,
+			  sizeof(*m)) ||
+	    *cfa != do_does || ((thread_t **)cfa)[1] != code ||
+	    m->n_in < 0 || m->n_in > MEMO_CELLS_MAX || m->n_out < 0 ||
+	    m->n_out > MEMO_CELLS_MAX || m->entries != entries ||
+	    !region_valid(ctx->dict.mem, here_off, (stack_cell_t)entries,
+			  MEMO_ENTRIES * (1 + m->n_in + m->n_out) *
+			      sizeof(stack_cell_t))) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+}
+#endif
+
+static unsigned int memo_hash(const stack_cell_t *key, stack_cell_t n)
+{
+	uintptr_t h = 0;
+
+	for (stack_cell_t i = 0; i < n; i++) {
+		h = (h ^ (uintptr_t)key[i]) * 0x9e3779b1u;
+		h ^= h >> 15;
+	}
+	return h & (MEMO_ENTRIES - 1);
+}
+
+/**
+ * @brief ( i*x memo -- j*x ) the does> code of memoized words, pushes the
+ * results remembered for the inputs, or runs the word for them and
+ * remembers what it left.
+ */
+void do_memo_run(struct forth_ctx *ctx)
+{
+	struct memo *m = (struct memo *)stack_pop(ctx);
+	stack_cell_t n_in, n_out, size;
+	stack_cell_t key[MEMO_CELLS_MAX];
+	stack_cell_t *victim = NULL;
+	unsigned int h;
+
+#ifdef EMFORTH_HOSTED
+	/* entries are not locked, tasks would see each other's half written */
+	par_task_check(ctx);
+#endif
+#ifdef EMFORTH_SANDBOX
+	memo_check(ctx, m);
+#endif
+	/* the word run below may change m, what is checked is kept */
+	n_in = m->n_in;
+	n_out = m->n_out;
+	size = 1 + n_in + n_out;
+
+	if (ctx->sp < n_in) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
+	memcpy(key, &ctx->stack[ctx->sp - n_in], n_in * sizeof(*key));
+	h = memo_hash(key, n_in);
+
+	for (unsigned int i = 0; i < MEMO_PROBE; i++) {
+		stack_cell_t *e =
+		    m->entries + ((h + i) & (MEMO_ENTRIES - 1)) * size;
+
+		if (e[0] != 0 &&
+		    memcmp(e + 1, key, n_in * sizeof(*key)) == 0) {
+			e[0] = ++m->clock;
+			m->hits++;
+			stack_sub(ctx, n_in);
+			for (stack_cell_t j = 0; j < n_out; j++) {
+				stack_push(ctx, e[1 + n_in + j]);
+			}
+			return;
+		}
+		if (victim == NULL || e[0] < victim[0]) {
+			victim = e;
+		}
+	}
+
+	m->misses++;
+	execute_xt(ctx, m->xt);
+	if (ctx->sp < n_out) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
+	/* the stamp makes the entry valid, so it is written last */
+	victim[0] = 0;
+	memcpy(victim + 1, key, n_in * sizeof(*key));
+	memcpy(victim + 1 + n_in, &ctx->stack[ctx->sp - n_out],
+	       n_out * sizeof(*key));
+	victim[0] = ++m->clock;
+}
+
+/**
+ * @brief ( xt n-in n-out -- xt' ) makes a word that behaves like xt for
+ * words that always leave the same n-out cells for the same n-in cells,
+ * but remembers results for recent inputs instead of computing them again.
+ */
+void do_memoize(struct forth_ctx *ctx)
+{
+	stack_cell_t n_out = stack_pop(ctx);
+	stack_cell_t n_in = stack_pop(ctx);
+	stack_cell_t xt = stack_pop(ctx);
+	size_t entries_size;
+	word_t *cfa;
+	thread_t *code;
+	struct memo *m;
+
+	if (n_in < 0 || n_in > MEMO_CELLS_MAX || n_out < 0 ||
+	    n_out > MEMO_CELLS_MAX) {
+		forth_throw(ctx, THROW_INVALID_ARGUMENT);
+	}
+	entries_size = MEMO_ENTRIES * (1 + n_in + n_out) * sizeof(stack_cell_t);
+
+	ctx->dict.here = (unsigned char *)ALIGN_UP_WORD_T(ctx->dict.here);
+	if (!dict_reserve(ctx, 2 * sizeof(word_t) + sizeof(*m) +
+				   ALIGN_UP_WORD_T(2 * sizeof(thread_t)) +
+				   entries_size)) {
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+
+	cfa = (word_t *)ctx->dict.here;
+	compile_word(ctx, (stack_cell_t)do_does);
+	compile_word(ctx, 0);
+
+	m = (struct memo *)ctx->dict.here;
+	ctx->dict.here += sizeof(*m);
+	memset(m, 0, sizeof(*m));
+	m->xt = xt;
+	m->n_in = n_in;
+	m->n_out = n_out;
+
+	code = (thread_t *)ctx->dict.here;
+	compile_xt(ctx, prim_xt(do_memo_run));
+	compile_xt(ctx, prim_xt(do_exit));
+	((thread_t **)cfa)[1] = code;
+
+	ctx->dict.here = (unsigned char *)ALIGN_UP_WORD_T(ctx->dict.here);
+	m->entries = (stack_cell_t *)ctx->dict.here;
+	memset(m->entries, 0, entries_size);
+	ctx->dict.here += entries_size;
+
+	stack_push(ctx, cfa_to_xt(ctx, cfa));
+}
+
+/*
+ * the struct memo of a word made by memoize, throws for other words and
+ * inside a task
+ */
+static struct memo *memo_get(struct forth_ctx *ctx, stack_cell_t xt)
+{
+	word_t *cfa = xt_to_cfa(ctx, xt);
+	thread_t *code;
+
+#ifdef EMFORTH_HOSTED
+	par_task_check(ctx);
+#endif
+	if (cfa == NULL || *cfa != do_does) {
+		forth_throw(ctx, THROW_NOT_CREATED);
+	}
+#ifdef EMFORTH_SANDBOX
+	memo_check(ctx, (struct memo *)(cfa + 2));
+#endif
+	code = ((thread_t **)cfa)[1];
+	if (code == NULL || *code != (thread_t)prim_xt(do_memo_run)) {
+		forth_throw(ctx, THROW_INVALID_ARGUMENT);
+	}
+	return (struct memo *)(cfa + 2);
+}
+
+/**
+ * @brief ( xt' -- hits misses ) how often a word made by memoize found
+ * its inputs remembered, and how often it ran the word
+ */
+void do_memo_stats(struct forth_ctx *ctx)
+{
+	struct memo *m = memo_get(ctx, stack_pop(ctx));
+
+	stack_push(ctx, m->hits);
+	stack_push(ctx, m->misses);
+}
+
+/**
+ * @brief ( xt' -- ) forgets the results a word made by memoize remembers
+ * and zeroes its counters
+ */
+void do_memo_clear(struct forth_ctx *ctx)
+{
+	struct memo *m = memo_get(ctx, stack_pop(ctx));
+
+	memset(m->entries, 0,
+	       MEMO_ENTRIES * (1 + m->n_in + m->n_out) * sizeof(stack_cell_t));
+	m->hits = 0;
+	m->misses = 0;
+	m->clock = 0;
+}
+
+/* == locals == */
+
+/**
+ * Locals live in a frame on the return stack, above the return address
+ * pushed by docol:
+ *
+ *   rstack[fp - 1]        fp of the caller's frame
+ *   rstack[fp + 0 .. n-1] the locals, first declared first
+ *
+ * local@ and local! carry the index as an inline operand, so reading or
+ * writing any local is one load or store, whatever its depth.
+ */
+
+/**
+ * @brief (locals) nargs n, pushes a frame of n locals, the first nargs
+ * taken from the data stack with the top item going to the last of them.
+ */
+void do_locals_enter(struct forth_ctx *ctx)
+{
+	stack_cell_t nargs, n;
+
+	operands_check(ctx);
+	nargs = thread_offset(ctx->ip);
+	n = thread_offset(ctx->ip + 1);
+	ctx->ip += 2;
+#ifdef EMFORTH_SANDBOX
+	if (nargs < 0 || nargs > n) {
+		forth_throw(ctx, THROW_INVALID_ARGUMENT);
+	}
+#endif
+	if (n + 1 > RSTACK_SIZE_MAX - ctx->rsp) {
+		forth_throw(ctx, THROW_RSTACK_OVERFLOW);
+	}
+	if (nargs > ctx->sp) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
+
+	ctx->rstack[ctx->rsp++] = (thread_t *)ctx->fp;
+	ctx->fp = ctx->rsp;
+	ctx->sp -= nargs;
+	for (stack_cell_t i = 0; i < n; i++) {
+		ctx->rstack[ctx->fp + i] =
+		    (thread_t *)(i < nargs ? ctx->stack[ctx->sp + i] : 0);
+	}
+	ctx->rsp += n;
+	stats_depth(ctx);
+}
+
+/**
+ * @brief (unlocals) drops the innermost frame, compiled before exit
+ */
+void do_locals_leave(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_SANDBOX
+	/*
+	 * code laid down with , may leave a frame it never entered, the
+	 * cell below fp is then a return address rather than an older fp
+	 */
+	if (ctx->fp < 1 ||
+	    (uintptr_t)ctx->rstack[ctx->fp - 1] > (uintptr_t)ctx->fp - 1) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+	ctx->rsp = ctx->fp - 1;
+	ctx->fp = (stack_cell_t)ctx->rstack[ctx->rsp];
+}
+
+#ifdef EMFORTH_SANDBOX
+/* a local index read from code, checked against the current frame */
+static void local_check(struct forth_ctx *ctx, stack_cell_t i)
+{
+	if (i < 0 || i >= ctx->rsp - ctx->fp) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+}
+#endif
+
+/**
+ * @brief local@ i ( -- x ) pushes local i of the current frame
+ */
+void do_local_fetch(struct forth_ctx *ctx)
+{
+	stack_cell_t i;
+
+	operands_check(ctx);
+	i = thread_offset(ctx->ip++);
+#ifdef EMFORTH_SANDBOX
+	local_check(ctx, i);
+#endif
+	stack_push(ctx, (stack_cell_t)ctx->rstack[ctx->fp + i]);
+}
+
+/**
+ * @brief local! i ( x -- ) stores into local i of the current frame
+ */
+void do_local_store(struct forth_ctx *ctx)
+{
+	stack_cell_t i;
+
+	operands_check(ctx);
+	i = thread_offset(ctx->ip++);
+#ifdef EMFORTH_SANDBOX
+	local_check(ctx, i);
+#endif
+	ctx->rstack[ctx->fp + i] = (thread_t *)stack_pop(ctx);
+}
+
+/* reports a malformed declaration and abandons the definition */
+static void locals_error(struct forth_ctx *ctx, const char *msg)
+{
+	ctx->plat.puts("{: ");
+	ctx->plat.puts(msg);
+	ctx->plat.puts("\n");
+	forth_throw(ctx, THROW_ABORT_MESSAGE);
+}
+
+/**
+ * @brief {: a b | c -- comment :} declares locals a and b, initialized
+ * from the stack (b from the top), and c, initialized to 0. Inside the
+ * definition a name pushes its value and 'to name' stores into it.
+ */
+void do_locals_open(struct forth_ctx *ctx)
+{
+	struct interpreter_data *id = &ctx->intrp_data;
+	char name[MAX_INPUT_LEN + 1];
+	stack_cell_t nargs = 0;
+	bool initialized = true;
+	bool comment = false;
+	int len;
+
+	if (id->mode != MODE_COMPILE) {
+		forth_throw(ctx, THROW_COMPILE_ONLY);
+	}
+	if (id->locals_count > 0) {
+		locals_error(ctx, "locals already declared");
+	}
+
+	while ((len = read_token(ctx, name, MAX_INPUT_LEN)) >= 0) {
+		if (len == 2 && memcmp(name, ":}", 2) == 0) {
+			break;
+		} else if (len == 0 || comment) {
+			continue;
+		} else if (len == 2 && memcmp(name, "--", 2) == 0) {
+			comment = true;
+		} else if (len == 1 && name[0] == '|') {
+			initialized = false;
+		} else if (id->locals_count == LOCALS_MAX) {
+			locals_error(ctx, "too many locals");
+		} else if (len > WORD_NAME_MAX_LEN) {
+			locals_error(ctx, "name too long");
+		} else {
+			struct local_name *l = &id->locals[id->locals_count++];
+
+			memcpy(l->name, name, len);
+			l->len = len;
+			nargs += initialized;
+		}
+	}
+	if (len < 0) {
+		locals_error(ctx, "missing :}");
+	}
+
+	compile_xt(ctx, prim_xt(do_locals_enter));
+	compile_xt(ctx, nargs);
+	compile_xt(ctx, id->locals_count);
+}
+
+/**
+ * @brief to name ( x -- ) stores x into the local or value name
+ */
+void do_to(struct forth_ctx *ctx)
+{
+	char name[MAX_INPUT_LEN + 1];
+	int len = read_token(ctx, name, MAX_INPUT_LEN);
+	bool compiling = ctx->intrp_data.mode == MODE_COMPILE;
+	int local = len > 0 && compiling ? find_local(ctx, name, len) : -1;
+	dict_header_t *header;
+	stack_cell_t *body;
+
+	if (local >= 0) {
+		compile_xt(ctx, prim_xt(do_local_store));
+		compile_xt(ctx, local);
+		return;
+	}
+
+	header = len > 0 ? find_word_header(ctx, name, len) : NULL;
+	if (header == NULL) {
+		forth_throw(ctx, THROW_UNDEFINED_WORD);
+	}
+	if (*dict_header_cfa(header) != do_val) {
+		forth_throw(ctx, THROW_INVALID_NAME);
+	}
+	body = (stack_cell_t *)(dict_header_cfa(header) + 1);
+	if (compiling) {
+		compile_literal_cell(ctx, (stack_cell_t)body);
+		compile_xt(ctx, prim_xt(do_store));
+	} else {
+		*body = stack_pop(ctx);
+	}
+}
+
+void do_branch(struct forth_ctx *ctx)
+{
+	stack_cell_t offset;
+
+	operands_check(ctx);
+	offset = thread_offset(ctx->ip);
+	/* The offset is in bytes, relative to the current IP.
+	 * We convert the offset to cells and adjust IP. */
+	ctx->ip += (offset / (stack_cell_t)sizeof(thread_t));
+}
+
+void do_0branch(struct forth_ctx *ctx)
+{
+	stack_cell_t offset, flag;
+
+	operands_check(ctx);
+	offset = thread_offset(ctx->ip);
+	flag = stack_pop(ctx);
+
+	if (flag == 0) {
+		/* The offset is in bytes, relative to the current IP.
+		 * We convert the offset to cells and adjust IP. */
+		ctx->ip += (offset / (stack_cell_t)sizeof(thread_t));
+	} else {
+		ctx->ip = ctx->ip + 1; /* Skip the offset parameter */
+	}
+}
+
+/**
+ * @brief (of) offset ( x1 x2 -- x1 | ) compiled by of: drops both when
+ * they are equal and goes on, else drops x2 and branches like branch
+ */
+void do_of(struct forth_ctx *ctx)
+{
+	stack_cell_t x2 = stack_pop(ctx);
+	stack_cell_t x1 = stack_pop(ctx);
+
+	operands_check(ctx);
+	if (x1 == x2) {
+		ctx->ip++;
+		return;
+	}
+	stack_push(ctx, x1);
+	ctx->ip += thread_offset(ctx->ip) / (stack_cell_t)sizeof(thread_t);
+}
+
+/**
+ * @brief (jumptable) min n default offset[n] ( x -- x | ) compiled by
+ * endcase: when x - min is below n and offset[x - min] is not 0, drops x
+ * and branches by it, else keeps x and branches by default. Offsets are
+ * relative to where they are stored, like those of branch.
+ */
+void do_jumptable(struct forth_ctx *ctx)
+{
+	thread_t *ip = ctx->ip;
+	stack_cell_t x = stack_pop(ctx);
+	uintptr_t i;
+	stack_cell_t n;
+
+	operands_check(ctx);
+	i = (uintptr_t)x - (uintptr_t)thread_literal(ip);
+
+	ip += LITERAL_THREAD_CELLS;
+	n = thread_offset(ip++);
+#ifdef EMFORTH_SANDBOX
+	if (n < 0 || !code_addr_valid(ctx, ip + n)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+	if (i < (uintptr_t)n && thread_offset(ip + 1 + i) != 0) {
+		ip += 1 + i;
+	} else {
+		stack_push(ctx, x);
+	}
+	ctx->ip = ip + thread_offset(ip) / (stack_cell_t)sizeof(thread_t);
+}
+
+/* == case == */
+
+/*
+ * case ... of ... endof ... endcase is compiled as a chain of clauses,
+ * "value (of) next body branch end", then the default code and drop.
+ * While it is compiled the data stack holds the start of the chain, a 0,
+ * and for each endof the address of its branch offset.
+ *
+ * When every value is a literal, there are at least CASE_TABLE_MIN of them
+ * and they span at most twice as many numbers, endcase rebuilds the chain
+ * as one (jumptable) followed by the bodies, so that the dispatch is one
+ * step however many cases there are. Other chains stay as they are.
+ */
+#define CASE_TABLE_MIN 3
+
+struct case_clause {
+	stack_cell_t value;
+	thread_t *body; /* after (of) and its offset */
+	thread_t *end;	/* the branch compiled by endof */
+};
+
+static void case_compiling(struct forth_ctx *ctx)
+{
+	if (ctx->intrp_data.mode != MODE_COMPILE) {
+		forth_throw(ctx, THROW_COMPILE_ONLY);
 	}
 }
 
-/**
- * @brief compares top two items on stack (n1 n2 -- flag), flag is true if n1 >
- * n2.
+/*
+ * Decodes the clause at p, which ends with the endof offset at orig, into
+ * c. False unless its value is a single literal.
  */
-void do_greater_than(struct forth_ctx *ctx)
+static bool case_clause_decode(thread_t *p, thread_t *orig,
+			       struct case_clause *c)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t n1 = stack_pop(ctx);
-		stack_cell_t n2 = stack_pop(ctx);
-		stack_push(ctx, n2 > n1 ? 1 : 0);
+	thread_t *of;
+
+	if ((stack_cell_t)*p == prim_xt(do_lit)) {
+		c->value = thread_literal(p + 1);
+		of = p + 1 + LITERAL_THREAD_CELLS;
+#ifdef EMFORTH_TOKEN_THREADED
+	} else if ((stack_cell_t)*p == prim_xt(do_lit16)) {
+		c->value = (int16_t)p[1];
+		of = p + 2;
+#endif
 	} else {
-		stack_push(ctx, 0);
+		return false;
+	}
+	if (of + 2 > orig || (stack_cell_t)*of != prim_xt(do_of) ||
+	    of + 1 + thread_offset(of + 1) / (stack_cell_t)sizeof(thread_t) !=
+		orig + 1) {
+		return false;
 	}
+	c->body = of + 2;
+	c->end = orig - 1;
+	return true;
 }
 
-/**
- * @brief tests if top stack item equals zero.
+/* appends n thread cells at src to the code being built at *dst */
+static void case_copy(thread_t **dst, const thread_t *src, size_t n)
+{
+	memcpy(*dst, src, n * sizeof(thread_t));
+	*dst += n;
+}
+
+/* appends a branch to be resolved later, returns its offset cell */
+static thread_t *case_branch(thread_t **dst)
+{
+	thread_t *offset;
+
+	*(*dst)++ = (thread_t)prim_xt(do_branch);
+	offset = (*dst)++;
+	return offset;
+}
+
+/*
+ * Rebuilds the n clauses in c, starting at start, and the default code
+ * after them as a (jumptable) over values min to max. The new code is put
+ * together after here and then moved over the chain. Branches inside the
+ * bodies are relative, so they survive the move.
  */
-void do_zero_equal(struct forth_ctx *ctx)
+static void case_build_table(struct forth_ctx *ctx, thread_t *start,
+			     struct case_clause *c, size_t n,
+			     stack_cell_t min, size_t range)
 {
-	if (ctx->sp >= 1) {
-		stack_cell_t n = stack_pop(ctx);
-		stack_push(ctx, n == 0 ? 1 : 0);
-	} else {
-		stack_push(ctx, 0);
+	thread_t *dflt = c[n - 1].end + 2;
+	size_t dflt_cells = (thread_t *)ctx->dict.here - dflt;
+	size_t cells = 3 + LITERAL_THREAD_CELLS + range + dflt_cells + 1;
+	thread_t *table, *bodies[n], *ends[n], *p;
+
+	for (size_t i = 0; i < n; i++) {
+		cells += c[i].end - c[i].body + 2;
+	}
+	if (!dict_reserve(ctx, cells * sizeof(thread_t))) {
+		/* dict_reserve printed why */
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+
+	p = (thread_t *)ctx->dict.here;
+	*p++ = (thread_t)prim_xt(do_jumptable);
+	memcpy(p, &min, sizeof(min));
+	p += LITERAL_THREAD_CELLS;
+	thread_set_offset(p++, range);
+	table = p;
+	p += 1 + range;
+
+	for (size_t i = 0; i < n; i++) {
+		bodies[i] = p;
+		case_copy(&p, c[i].body, c[i].end - c[i].body);
+		ends[i] = case_branch(&p);
+	}
+	thread_set_offset(table, (p - table) * sizeof(thread_t));
+	case_copy(&p, dflt, dflt_cells);
+	*p++ = (thread_t)prim_xt(do_drop);
+
+	/* values without a clause keep 0, which means default */
+	for (size_t i = 0; i < range; i++) {
+		thread_set_offset(&table[1 + i], 0);
+	}
+	for (size_t i = 0; i < n; i++) {
+		thread_t *slot = &table[1 + (uintptr_t)c[i].value - min];
+
+		/* the first of equal values wins, as in the chain */
+		if (thread_offset(slot) == 0) {
+			thread_set_offset(slot, (bodies[i] - slot) *
+						    sizeof(thread_t));
+		}
+		thread_set_offset(ends[i], (p - ends[i]) * sizeof(thread_t));
 	}
+
+	memmove(start, ctx->dict.here, cells * sizeof(thread_t));
+	ctx->dict.here = (unsigned char *)(start + cells);
 }
 
 /**
- * @brief fetches a 32-bit value from memory at given address.
+ * @brief case ( -- ) starts a case structure, see endcase
  */
-void do_fetch(struct forth_ctx *ctx)
+void do_case(struct forth_ctx *ctx)
 {
-	if (ctx->sp > 0) {
-		stack_cell_t addr = stack_pop(ctx);
-		/* Check if address is within dictionary bounds */
-		if ((void *)addr >= (void *)ctx->dict.mem &&
-		    ((void *)addr + sizeof(stack_cell_t)) <=
-			(void *)(ctx->dict.mem + DICTIONARY_MEMORY_SIZE)) {
-			/* Use raw address directly */
-			stack_cell_t value = *(stack_cell_t *)addr;
-			stack_push(ctx, value);
-		} else {
-			ctx->plat.puts(__func__);
-			ctx->plat.puts(
-			    ": error - accessing outside dictionary bounds\n");
-			stack_push(ctx, 0); /* Push a default value on error */
-		}
-	} else {
-		stack_push(ctx, 0);
-	}
+	case_compiling(ctx);
+	fold_barrier(ctx);
+	stack_push(ctx, (stack_cell_t)ctx->dict.here);
+	stack_push(ctx, 0);
 }
 
 /**
- * @brief stores a 32-bit value to memory at given address.
+ * @brief of ( -- ) at run time ( x1 x2 -- x1 | ), runs the code up to
+ * endof when x1 equals x2, else skips it
  */
-void do_store(struct forth_ctx *ctx)
+void do_of_compile(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t addr = stack_pop(ctx);
-		stack_cell_t value = stack_pop(ctx);
-		/* Check if address is within dictionary bounds */
-		if ((void *)addr >= (void *)ctx->dict.mem &&
-		    ((void *)addr + sizeof(stack_cell_t)) <=
-			(void *)(ctx->dict.mem + DICTIONARY_MEMORY_SIZE)) {
-			/* Use raw address directly */
-			*(stack_cell_t *)addr = value;
-		} else {
-			ctx->plat.puts(__func__);
-			ctx->plat.puts(
-			    ": error - accessing outside dictionary bounds\n");
-		}
-	}
+	case_compiling(ctx);
+	compile_xt(ctx, prim_xt(do_of));
+	do_mark_forward(ctx);
 }
 
 /**
- * @brief fetches a single byte from memory at given address.
+ * @brief endof ( -- ) ends the code run for one value of a case structure
  */
-void do_cfetch(struct forth_ctx *ctx)
+void do_endof(struct forth_ctx *ctx)
 {
-	if (ctx->sp > 0) {
-		stack_cell_t addr = stack_pop(ctx);
-		/* Check if address is within dictionary bounds and warn if not
-		 */
-		if ((void *)addr >= (void *)ctx->dict.mem &&
-		    (void *)addr <
-			(void *)(ctx->dict.mem + DICTIONARY_MEMORY_SIZE)) {
-			/* Address is within dictionary */
-		} else {
-			ctx->plat.puts(__func__);
-			ctx->plat.puts(": warning - accessing outside "
-				       "dictionary bounds\n");
-		}
-		/* Use raw address directly */
-		unsigned char value = *(unsigned char *)addr;
-		stack_push(ctx, value);
-	} else {
-		ctx->plat.puts(__func__);
-		ctx->plat.puts(" stack underflow\n");
-		stack_push(ctx, 0);
-	}
+	stack_cell_t of = stack_pop(ctx);
+
+	case_compiling(ctx);
+	compile_xt(ctx, prim_xt(do_branch));
+	do_mark_forward(ctx);
+	stack_push(ctx, of);
+	do_resolve_forward(ctx);
 }
 
 /**
- * @brief stores a single byte to memory at given address.
+ * @brief endcase ( -- ) at run time ( x -- ), ends a case structure. The
+ * code after the last endof runs with x on the stack when no value
+ * matched, and x is dropped.
+ *
+ * Dense sets of literal values are compiled into a jump table, so that
+ * finding the code for x does not take a comparison per value.
  */
-void do_cstore(struct forth_ctx *ctx)
+void do_endcase(struct forth_ctx *ctx)
 {
-	if (ctx->sp >= 2) {
-		stack_cell_t addr = stack_pop(ctx);
-		stack_cell_t value = stack_pop(ctx);
-		/* Check if address is within dictionary bounds and warn if not
-		 */
-		if ((void *)addr >= (void *)ctx->dict.mem &&
-		    (void *)addr <
-			(void *)(ctx->dict.mem + DICTIONARY_MEMORY_SIZE)) {
-			/* Address is within dictionary */
-		} else {
-			ctx->plat.puts(__func__);
-			ctx->plat.puts(": warning - accessing outside "
-				       "dictionary bounds\n");
+	stack_cell_t mark = ctx->sp;
+	size_t n;
+	thread_t *start;
+	bool table = true;
+
+	case_compiling(ctx);
+	while (mark > 0 && ctx->stack[mark - 1] != 0) {
+		mark--;
+	}
+	if (mark < 2) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
+	n = ctx->sp - mark;
+	start = (thread_t *)ctx->stack[mark - 2];
+#ifdef EMFORTH_SANDBOX
+	/* what case and endof left must be code of this definition, in
+	 * order, the clauses are decoded from it */
+	if (!code_addr_valid(ctx, start)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	for (stack_cell_t i = mark; i < ctx->sp; i++) {
+		thread_t *p = (thread_t *)ctx->stack[i];
+		thread_t *prev =
+		    i > mark ? (thread_t *)ctx->stack[i - 1] : start;
+
+		if (!code_addr_valid(ctx, p) || p <= prev) {
+			forth_throw(ctx, THROW_INVALID_ADDRESS);
+		}
+	}
+#endif
+
+	if (n >= CASE_TABLE_MIN) {
+		struct case_clause c[n];
+		stack_cell_t min = 0, max = 0;
+		thread_t *p = start;
+
+		for (size_t i = 0; table && i < n; i++) {
+			thread_t *orig = (thread_t *)ctx->stack[mark + i];
+
+			table = case_clause_decode(p, orig, &c[i]);
+			if (i == 0 || c[i].value < min) {
+				min = c[i].value;
+			}
+			if (i == 0 || c[i].value > max) {
+				max = c[i].value;
+			}
+			p = orig + 1;
+		}
+		if (table && (uintptr_t)max - (uintptr_t)min < 2 * n) {
+			case_build_table(ctx, start, c, n, min,
+					 (uintptr_t)max - (uintptr_t)min + 1);
+			ctx->sp = mark - 2;
+			return;
 		}
-		/* Use raw address directly */
-		*(unsigned char *)addr = (unsigned char)(value & 0xFF);
 	}
+
+	compile_xt(ctx, prim_xt(do_drop));
+	while (ctx->sp > mark) {
+		do_resolve_forward(ctx);
+	}
+	ctx->sp = mark - 2;
 }
 
 /**
- * @brief convert pointer to word in dictionary to the code field address.
- * stack_pop(ctx) -> dictionary word pointer
- * ----
- * stack_push(ctx, address)
+ * @brief output a single character from top of stack
  */
-void do_2cfa(struct forth_ctx *ctx)
+void do_emit(struct forth_ctx *ctx)
 {
-	dict_header_t *w_h = (dict_header_t *)stack_pop(ctx);
-	stack_push(ctx, (stack_cell_t)(w_h + 1));
+	char str[2];
+
+	str[0] = stack_pop(ctx);
+	str[1] = '\0';
+	ctx->plat.puts(str);
 }
 
 /**
- * @brief this one gives the same address as would be compiled for a word
- * which is included in the definition of a forth word. We also call it xt
- * or execution token.
- *
- * stack_pop(ctx) -> dictionary word pointer
- * ----
- * stack_push(ctx, address)
+ * @bief print the definition of a word (len, then string popped from stack)
  */
-void do_2dfa(struct forth_ctx *ctx)
+void do_see(struct forth_ctx *ctx)
 {
-	dict_header_t *w_h = (dict_header_t *)stack_pop(ctx);
-	char *word_name = (char *)(w_h + 1);
-	word_t *codeword_addr =
-	    (word_t *)(word_name + ALIGN_UP_WORD_T(w_h->flags.f.length));
-	word_t codeword = *codeword_addr;
-
-	if (codeword == do_docol) {
-		/* For a colon word, the xt is the address of its definition
-		 * (the CFA). */
-		stack_push(ctx, (stack_cell_t)codeword_addr);
-	} else {
-		/* For a primitive, the xt is the function pointer itself (the
-		 * code). */
-		stack_push(ctx, (stack_cell_t)codeword);
+	do_word(ctx);
+	stack_cell_t len = stack_pop(ctx);
+	size_t num_cells = ALIGN_UP_WORD_T(len) / sizeof(word_t);
+	char *name = (char *)&ctx->stack[ctx->sp - num_cells];
+	stack_sub(ctx, num_cells);
+
+	dict_header_t *header = find_word_header(ctx, name, len);
+	if (!header) {
+		ctx->plat.puts("see: word not found\n");
+		return;
 	}
+
+	stack_push(ctx, (stack_cell_t)header);
+
+	print_word_def(ctx);
 }
 
 /**
- * @brief switch to immediatemode
+ * @brief prints the words in the first wordlist of the search order
  */
-void do_lbrac(struct forth_ctx *ctx)
+void do_wordslist(struct forth_ctx *ctx)
 {
-	ctx->intrp_data.mode = MODE_IMMEDIATE;
+	dict_header_t *cur = ctx->dict.order[0]->latest;
+
+	while (cur != DICT_NULL) {
+		stack_push(ctx, (stack_cell_t)cur);
+		print_word_def(ctx);
+		cur = cur->link;
+	}
 }
 
-/**
- * @brief switch to compile mode
+/*
+ * end of the code and data of a word, which is where the next word of any
+ * wordlist starts, or here.
  */
-void do_rbrac(struct forth_ctx *ctx)
+static unsigned char *word_end(struct forth_ctx *ctx, dict_header_t *header)
 {
-	ctx->intrp_data.mode = MODE_COMPILE;
+	unsigned char *cfa = (unsigned char *)dict_header_cfa(header);
+	unsigned char *end = ctx->dict.here;
+
+	for (wordlist_t *wl = ctx->dict.wordlists; wl != NULL; wl = wl->prev) {
+		/* newest first, so the words after cfa come first */
+		for (dict_header_t *cur = wl->latest;
+		     cur != DICT_NULL && dict_word_start(cur) > cfa; cur = cur->link) {
+			if (dict_word_start(cur) < end) {
+				end = dict_word_start(cur);
+			}
+		}
+	}
+	return end;
 }
 
-/**
- * @brief puts value of ctx->dict.latest on the stack
- **/
-void do_latest_fetch(struct forth_ctx *ctx)
+/* prints a name and pads it to a column */
+static void print_name_column(struct forth_ctx *ctx, dict_header_t *header)
 {
-	stack_push(ctx, (stack_cell_t)ctx->dict.latest);
+	char pad[WORD_NAME_MAX_LEN + 2];
+	size_t len = header->flags.f.length;
+
+	print_word_name(ctx, header);
+	memset(pad, ' ', sizeof(pad) - 1 - len);
+	pad[sizeof(pad) - 1 - len] = 0;
+	ctx->plat.puts(pad);
+}
+
+/* prints "label: used of size unit" */
+void print_usage(struct forth_ctx *ctx, const char *label, stack_cell_t used,
+		 stack_cell_t size, const char *unit)
+{
+	ctx->plat.puts(label);
+	print_number(ctx, used, false, 0, true);
+	ctx->plat.puts("of ");
+	print_number(ctx, size, false, 0, true);
+	ctx->plat.puts(unit);
 }
 
 /**
- * @brief pushes current ctx->dict.here pointer to stack
+ * @brief ( -- ) prints the code and header bytes of every word defined
+ * after emforth_init, newest first, and how much of the dictionary is in
+ * use. With EMFORTH_STATS it also prints the most the dictionary and the
+ * stacks ever held. Code bytes include data allotted after a word.
  */
-void do_here(struct forth_ctx *ctx)
+void do_dot_mem(struct forth_ctx *ctx)
 {
-	stack_push(ctx, (stack_cell_t)ctx->dict.here);
+	stack_cell_t count = 0, code_total = 0, header_total = 0;
+
+	ctx->plat.puts("word                            code header\n");
+	for (wordlist_t *wl = ctx->dict.wordlists; wl != NULL; wl = wl->prev) {
+		for (dict_header_t *cur = wl->latest;
+		     cur != DICT_NULL && dict_word_start(cur) >= ctx->dict.fence;
+		     cur = cur->link) {
+			unsigned char *cfa = (unsigned char *)dict_header_cfa(cur);
+			stack_cell_t code = word_end(ctx, cur) - cfa;
+#ifdef EMFORTH_SPLIT_DICT
+			stack_cell_t header =
+			    (unsigned char *)dict_header_end(cur) -
+			    (unsigned char *)cur;
+#else
+			stack_cell_t header = cfa - (unsigned char *)cur;
+#endif
+
+			count++;
+			code_total += code;
+			header_total += header;
+			if (cur->flags.f.hidden) {
+				continue;
+			}
+			print_name_column(ctx, cur);
+			print_number(ctx, code, false, 4, true);
+			print_number(ctx, header, false, 6, false);
+			ctx->plat.puts("\n");
+		}
+	}
+	print_number(ctx, count, false, 0, true);
+	ctx->plat.puts("words, ");
+	print_number(ctx, code_total, false, 0, true);
+	ctx->plat.puts("code bytes, ");
+	print_number(ctx, header_total, false, 0, true);
+	ctx->plat.puts("header bytes\n");
+
+	print_usage(ctx, "dictionary: ", ctx->dict.here - ctx->dict.mem,
+		    ctx->dict.end - ctx->dict.mem, "bytes, ");
+	print_number(ctx, ctx->dict.fence - ctx->dict.mem, false, 0, true);
+	ctx->plat.puts("by builtins\n");
+#ifdef EMFORTH_SPLIT_DICT
+	print_usage(ctx, "name space: ",
+		    ctx->dict.names_here - ctx->dict.names,
+		    ctx->dict.names_end - ctx->dict.names, "bytes\n");
+#endif
+
+#ifdef EMFORTH_STATS
+	struct emforth_stats stats;
+
+	emforth_stats(ctx, &stats);
+	print_usage(ctx, "dictionary peak: ", stats.here_max,
+		    ctx->dict.end - ctx->dict.mem, "bytes\n");
+#ifdef EMFORTH_SPLIT_DICT
+	print_usage(ctx, "name space peak: ", stats.names_here_max,
+		    ctx->dict.names_end - ctx->dict.names, "bytes\n");
+#endif
+	print_usage(ctx, "data stack peak: ", stats.sp_max, STACK_SIZE_MAX,
+		    "cells\n");
+	print_usage(ctx, "return stack peak: ", stats.rsp_max,
+		    RSTACK_SIZE_MAX, "cells\n");
+#endif
 }
 
+/* == wordlists and search order == */
+
 /**
- * @brief Pops link pointer to word, and toggles the hidden flag.
+ * @brief ( -- wid ) creates a new empty wordlist
  */
-void do_hidden(struct forth_ctx *ctx)
+void do_wordlist(struct forth_ctx *ctx)
 {
-	dict_header_t *w_h = (dict_header_t *)stack_pop(ctx);
-	w_h -= 1;
-	w_h->flags.f.hidden ^= 1;
+	wordlist_t *wl = wordlist_create(ctx);
+
+	if (wl != NULL) {
+		stack_push(ctx, (stack_cell_t)wl);
+	}
 }
 
 /**
- * @brief toggles immediate mode of latest word
+ * @brief ( wid -- ) runtime of a vocabulary, replaces the first wordlist
+ * in the search order with wid.
  */
-void do_immediate(struct forth_ctx *ctx)
+void do_vocabulary_restore(struct forth_ctx *ctx)
 {
-	ctx->dict.latest->flags.f.immediate ^= 1;
+	wordlist_t *wl = (wordlist_t *)stack_pop(ctx);
+
+#ifdef EMFORTH_SANDBOX
+	wordlist_check(ctx, wl);
+#endif
+	ctx->dict.order[0] = wl;
+	if (ctx->dict.order_len == 0) {
+		ctx->dict.order_len = 1;
+	}
 }
 
 /**
- * @brief reads a token and pushes to stack (string and length on top)
+ * @brief creates a named wordlist, compiled as
+ * "lit <wid> (vocabulary) exit" followed by the wordlist itself.
  */
-void do_word(struct forth_ctx *ctx)
+void do_vocabulary(struct forth_ctx *ctx)
 {
-	char token[MAX_INPUT_LEN + 1];
-	char input_byte;
-	stack_cell_t input_len = 0;
+	dict_header_t *old_latest = ctx->dict.latest;
+	wordlist_t *wl;
 
-	do {
-		input_byte = ctx->plat.getchar();
+	do_word(ctx);
+	do_create_word(ctx);
+	if (ctx->dict.latest == old_latest) {
+		return;
+	}
 
-		if (input_len > (MAX_INPUT_LEN - 1)) {
-			input_len = 0;
-		}
+	compile_word(ctx, (stack_cell_t)do_docol);
+	compile_literal_cell(ctx, 0);
+	unsigned char *wid_p = ctx->dict.here - sizeof(stack_cell_t);
+	compile_xt(ctx, prim_xt(do_vocabulary_restore));
+	compile_xt(ctx, prim_xt(do_exit));
 
-		if (isspace(input_byte)) {
-			if (input_len > 0) {
-				memcpy(&ctx->stack[ctx->sp], token, input_len);
-				stack_push_wordname(ctx, token, input_len);
-				break;
-			}
-		}
+	wl = wordlist_create(ctx);
+	memcpy(wid_p, &wl, sizeof(wl));
+}
 
-		token[input_len++] = input_byte;
-		token[input_len] = 0;
-	} while (1);
+void do_forth_wordlist(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)ctx->dict.forth_wordlist);
 }
 
 /**
- * @brief reads an input character to top of stack
+ * @brief replaces the first wordlist in the search order with forth
  */
-void do_key(struct forth_ctx *ctx)
+void do_forth(struct forth_ctx *ctx)
 {
-	ctx->stack[ctx->sp++] = (ctx->plat.getchar());
+	ctx->dict.order[0] = ctx->dict.forth_wordlist;
+	if (ctx->dict.order_len == 0) {
+		ctx->dict.order_len = 1;
+	}
 }
 
 /**
- * @brief the ':' compilation word. Reads token, creates dictionary header
- * marks it hidden until ';' unhides it, switches to compilation mode to
- * begin compilation of the word. The first word (codeword) will be do_docol.
+ * @brief new definitions go to the first wordlist in the search order
  */
-void do_colon(struct forth_ctx *ctx)
+void do_definitions(struct forth_ctx *ctx)
 {
-	/* Read next word and create dictionary entry */
-	do_word(ctx);
-	do_create_word(ctx);
+	if (ctx->dict.order_len == 0) {
+		forth_throw(ctx, THROW_ORDER_UNDERFLOW);
+	}
+	ctx->dict.current = ctx->dict.order[0];
+}
 
-	/* Hide the word until definition is complete */
-	ctx->dict.latest->flags.f.hidden = 1;
+void do_get_current(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)ctx->dict.current);
+}
 
-	/* Compile DOCOL as the codeword for this definition */
-	word_t w = do_docol;
-	compile_word(ctx, (stack_cell_t)w);
+void do_set_current(struct forth_ctx *ctx)
+{
+	wordlist_t *wl = (wordlist_t *)stack_pop(ctx);
 
-	/* Switch to compile mode */
-	ctx->intrp_data.mode = MODE_COMPILE;
+#ifdef EMFORTH_SANDBOX
+	wordlist_check(ctx, wl);
+#endif
+	ctx->dict.current = wl;
 }
 
 /**
- * @brief finishes compilation of currently being defined word by
- * compiling do_exit as the last word, unhides it, switches back to
- * immediate mode.
+ * @brief duplicates the first wordlist in the search order
  */
-void do_semicolon(struct forth_ctx *ctx)
+void do_also(struct forth_ctx *ctx)
 {
-	word_t w;
-
-	/* Compile EXIT to end definition */
-	w = do_exit;
-	compile_word(ctx, (stack_cell_t)w);
-
-	/* Unhide the word */
-	ctx->dict.latest->flags.f.hidden = 0;
-
-	/* Switch back to immediate mode */
-	ctx->intrp_data.mode = MODE_IMMEDIATE;
+	if (ctx->dict.order_len == 0) {
+		forth_throw(ctx, THROW_ORDER_UNDERFLOW);
+	}
+	if (ctx->dict.order_len >= SEARCH_ORDER_MAX) {
+		forth_throw(ctx, THROW_ORDER_OVERFLOW);
+	}
+	memmove(&ctx->dict.order[1], &ctx->dict.order[0],
+		ctx->dict.order_len * sizeof(ctx->dict.order[0]));
+	ctx->dict.order_len++;
 }
 
-void do_branch(struct forth_ctx *ctx)
+/**
+ * @brief removes the first wordlist from the search order
+ */
+void do_previous(struct forth_ctx *ctx)
 {
-	stack_cell_t offset = *(stack_cell_t *)(ctx->ip);
-	/* The offset is in bytes, relative to the current IP.
-	 * We convert the offset to cells and adjust IP. */
-	ctx->ip += (offset / sizeof(word_t));
+	if (ctx->dict.order_len <= 1) {
+		forth_throw(ctx, THROW_ORDER_UNDERFLOW);
+	}
+	ctx->dict.order_len--;
+	memmove(&ctx->dict.order[0], &ctx->dict.order[1],
+		ctx->dict.order_len * sizeof(ctx->dict.order[0]));
 }
 
-void do_0branch(struct forth_ctx *ctx)
+/**
+ * @brief sets the search order to just the forth wordlist
+ */
+void do_only(struct forth_ctx *ctx)
 {
-	stack_cell_t offset = *(stack_cell_t *)(ctx->ip);
-	stack_cell_t flag = stack_pop(ctx);
-
-	if (flag == 0) {
-		/* The offset is in bytes, relative to the current IP.
-		 * We convert the offset to cells and adjust IP. */
-		ctx->ip += (offset / sizeof(word_t));
-	} else {
-		ctx->ip = ctx->ip + 1; /* Skip the offset parameter */
-	}
+	ctx->dict.order[0] = ctx->dict.forth_wordlist;
+	ctx->dict.order_len = 1;
 }
 
 /**
- * @brief output a single character from top of stack
+ * @brief ( -- widn .. wid1 n ) wid1 is searched first
  */
-void do_emit(struct forth_ctx *ctx)
+void do_get_order(struct forth_ctx *ctx)
 {
-	char str[2];
-
-	str[0] = stack_pop(ctx);
-	str[1] = '\0';
-	ctx->plat.puts(str);
+	for (stack_cell_t i = ctx->dict.order_len; i > 0; i--) {
+		stack_push(ctx, (stack_cell_t)ctx->dict.order[i - 1]);
+	}
+	stack_push(ctx, ctx->dict.order_len);
 }
 
 /**
- * @bief print the definition of a word (len, then string popped from stack)
+ * @brief ( widn .. wid1 n -- ) wid1 is searched first, n of -1 is the
+ * same as only and n of 0 leaves nothing to search.
  */
-void do_see(struct forth_ctx *ctx)
+void do_set_order(struct forth_ctx *ctx)
 {
-	do_word(ctx);
-	stack_cell_t len = stack_pop(ctx);
-	size_t num_cells = ALIGN_UP_WORD_T(len) / sizeof(word_t);
-	char *name = (char *)&ctx->stack[ctx->sp - num_cells];
-	stack_sub(ctx, num_cells);
+	stack_cell_t n = stack_pop(ctx);
 
-	dict_header_t *header = find_word_header(ctx, name, len);
-	if (!header) {
-		ctx->plat.puts("see: word not found\n");
+	if (n == -1) {
+		do_only(ctx);
 		return;
 	}
+	if (n < 0) {
+		forth_throw(ctx, THROW_INVALID_ARGUMENT);
+	}
+	if (n > SEARCH_ORDER_MAX) {
+		forth_throw(ctx, THROW_ORDER_OVERFLOW);
+	}
+	if (n > ctx->sp) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
+	}
 
-	stack_push(ctx, (stack_cell_t)header);
-
-	print_word_def(ctx);
-}
-
-void do_wordslist(struct forth_ctx *ctx)
-{
-	dict_header_t *cur = ctx->dict.latest;
-
-	while (cur != DICT_NULL) {
-		stack_push(ctx, (stack_cell_t)cur);
-		print_word_def(ctx);
-		cur = cur->link;
+	for (stack_cell_t i = 1; i <= n; i++) {
+		wordlist_check(ctx, (wordlist_t *)ctx->stack[ctx->sp - i]);
+	}
+	for (stack_cell_t i = 0; i < n; i++) {
+		ctx->dict.order[i] = (wordlist_t *)stack_pop(ctx);
 	}
+	ctx->dict.order_len = n;
 }
 
 /**
  * This contains the primitive words defined in this forth.
  */
 
-struct bultin_entry {
-	char word[WORD_NAME_MAX_LEN];
-	word_t c_func;
-	flag_t flags;
-};
-
 struct bultin_entry builtin_table[] = {
     {.word = "docol", .c_func = do_docol, .flags = {.f.hidden = 1}},
     {.word = "lit", .c_func = do_lit, .flags = {}},
+#ifdef EMFORTH_TOKEN_THREADED
+    {.word = "lit16", .c_func = do_lit16, .flags = {}},
+#endif
     {.word = "exit", .c_func = do_exit, .flags = {}},
-    {.word = "create", .c_func = do_create_word, .flags = {}},
+    {.word = "doconst", .c_func = do_const, .flags = {.f.hidden = 1}},
+    {.word = "doval", .c_func = do_val, .flags = {.f.hidden = 1}},
+    {.word = "dovar", .c_func = do_var, .flags = {.f.hidden = 1}},
+    {.word = "dodoes", .c_func = do_does, .flags = {.f.hidden = 1}},
+    {.word = "(create)", .c_func = do_create_word, .flags = {}},
+    {.word = "create", .c_func = do_create, .flags = {}},
+    {.word = "constant", .c_func = do_constant, .flags = {}},
+    {.word = "variable", .c_func = do_variable, .flags = {}},
+    {.word = "value", .c_func = do_value, .flags = {}},
+    {.word = "does>", .c_func = do_does_compile, .flags = {.f.immediate = 1}},
+    {.word = "(does>)", .c_func = do_does_set, .flags = {.f.hidden = 1}},
+    {.word = ">body", .c_func = do_to_body, .flags = {}},
+    {.word = "(memo)", .c_func = do_memo_run, .flags = {.f.hidden = 1}},
+    {.word = "memoize", .c_func = do_memoize, .flags = {}},
+    {.word = "memo-stats", .c_func = do_memo_stats, .flags = {}},
+    {.word = "memo-clear", .c_func = do_memo_clear, .flags = {}},
     {.word = ":", .c_func = do_colon, .flags = {}},
     {.word = ";", .c_func = do_semicolon, .flags = {.f.immediate = 1}},
     {.word = ",", .c_func = do_comma, .flags = {}},
+    {.word = "allot", .c_func = do_allot, .flags = {}},
+    {.word = "unused", .c_func = do_unused, .flags = {}},
     {.word = "+", .c_func = do_plus, .flags = {}},
     {.word = "-", .c_func = do_minus, .flags = {}},
     {.word = "/", .c_func = do_divide, .flags = {}},
@@ -764,13 +2641,36 @@ struct bultin_entry builtin_table[] = {
     {.word = "find", .c_func = do_find, .flags = {}},
     {.word = ".s", .c_func = do_printstack, .flags = {}},
     {.word = ".", .c_func = do_dot, .flags = {}},
+    {.word = "u.", .c_func = do_udot, .flags = {}},
+    {.word = ".r", .c_func = do_dot_r, .flags = {}},
+    {.word = "hex", .c_func = do_hex, .flags = {}},
+    {.word = "decimal", .c_func = do_decimal, .flags = {}},
+    {.word = "type", .c_func = do_type, .flags = {}},
+    {.word = "<#", .c_func = do_less_number_sign, .flags = {}},
+    {.word = "hold", .c_func = do_hold, .flags = {}},
+    {.word = "#", .c_func = do_number_sign, .flags = {}},
+    {.word = "#s", .c_func = do_number_sign_s, .flags = {}},
+    {.word = "sign", .c_func = do_sign, .flags = {}},
+    {.word = "#>", .c_func = do_number_sign_greater, .flags = {}},
     {.word = "]", .c_func = do_rbrac, .flags = {}},
     {.word = "[", .c_func = do_lbrac, .flags = {.f.immediate = 1}},
     {.word = "latest_f", .c_func = do_latest_fetch, .flags = {}},
     {.word = "here", .c_func = do_here, .flags = {}},
+    {.word = "base", .c_func = do_base, .flags = {}},
     {.word = "hidden", .c_func = do_hidden, .flags = {}},
     {.word = "word", .c_func = do_word, .flags = {}},
     {.word = "key", .c_func = do_key, .flags = {}},
+    {.word = "evaluate", .c_func = do_evaluate, .flags = {}},
+    {.word = "execute", .c_func = do_execute, .flags = {}},
+    {.word = "catch", .c_func = do_catch, .flags = {}},
+    {.word = "throw", .c_func = do_throw, .flags = {}},
+    {.word = "abort", .c_func = do_abort, .flags = {}},
+    {.word = "(locals)", .c_func = do_locals_enter, .flags = {}},
+    {.word = "(unlocals)", .c_func = do_locals_leave, .flags = {}},
+    {.word = "local@", .c_func = do_local_fetch, .flags = {}},
+    {.word = "local!", .c_func = do_local_store, .flags = {}},
+    {.word = "{:", .c_func = do_locals_open, .flags = {.f.immediate = 1}},
+    {.word = "to", .c_func = do_to, .flags = {.f.immediate = 1}},
     {.word = "drop", .c_func = do_drop, .flags = {}},
     {.word = "dup", .c_func = do_dup, .flags = {}},
     {.word = "swap", .c_func = do_swap, .flags = {}},
@@ -793,27 +2693,59 @@ struct bultin_entry builtin_table[] = {
     {.word = "2cfa", .c_func = do_2cfa, .flags = {}},
     {.word = "2dfa", .c_func = do_2dfa, .flags = {}},
     {.word = "'", .c_func = do_tick, .flags = {}},
+    {.word = "compile,", .c_func = do_compile_comma, .flags = {}},
+    {.word = ">mark", .c_func = do_mark_forward, .flags = {}},
+    {.word = ">resolve", .c_func = do_resolve_forward, .flags = {}},
+    {.word = "case", .c_func = do_case, .flags = {.f.immediate = 1}},
+    {.word = "of", .c_func = do_of_compile, .flags = {.f.immediate = 1}},
+    {.word = "endof", .c_func = do_endof, .flags = {.f.immediate = 1}},
+    {.word = "endcase", .c_func = do_endcase, .flags = {.f.immediate = 1}},
+    {.word = "(of)", .c_func = do_of, .flags = {.f.hidden = 1}},
+    {.word = "(jumptable)", .c_func = do_jumptable, .flags = {.f.hidden = 1}},
     {.word = "emit", .c_func = do_emit, .flags = {}},
     {.word = "see", .c_func = do_see, .flags = {}},
     {.word = "words", .c_func = do_wordslist, .flags = {}},
+    {.word = ".mem", .c_func = do_dot_mem, .flags = {}},
+    {.word = "marker", .c_func = do_marker, .flags = {}},
+    {.word = "(marker)", .c_func = do_marker_restore, .flags = {.f.hidden = 1}},
+    {.word = "forget", .c_func = do_forget, .flags = {}},
+    {.word = "wordlist", .c_func = do_wordlist, .flags = {}},
+    {.word = "vocabulary", .c_func = do_vocabulary, .flags = {}},
+    {.word = "(vocabulary)", .c_func = do_vocabulary_restore, .flags = {.f.hidden = 1}},
+    {.word = "forth-wordlist", .c_func = do_forth_wordlist, .flags = {}},
+    {.word = "forth", .c_func = do_forth, .flags = {}},
+    {.word = "definitions", .c_func = do_definitions, .flags = {}},
+    {.word = "get-current", .c_func = do_get_current, .flags = {}},
+    {.word = "set-current", .c_func = do_set_current, .flags = {}},
+    {.word = "also", .c_func = do_also, .flags = {}},
+    {.word = "previous", .c_func = do_previous, .flags = {}},
+    {.word = "only", .c_func = do_only, .flags = {}},
+    {.word = "get-order", .c_func = do_get_order, .flags = {}},
+    {.word = "set-order", .c_func = do_set_order, .flags = {}},
 };
 
-int builtins_init(struct forth_ctx *ctx)
+int builtins_register(struct forth_ctx *ctx, const struct bultin_entry *table,
+		      size_t n)
 {
 	word_t w;
 	int len;
 	dict_header_t *w_h;
 
-	for (size_t i = 0; i < ARRAY_SIZE(builtin_table); i++) {
+	for (size_t i = 0; i < n; i++) {
+		if (ctx->dict.headerless) {
+			/* only numbered, for a turnkey image to refer to */
+			prim_register(table[i].c_func);
+			continue;
+		}
 		/* we push a string, and the length of the string on the stack
 		 */
-		len = stack_push_wordname(ctx, builtin_table[i].word,
-					  strlen(builtin_table[i].word));
+		len = stack_push_wordname(ctx, table[i].word,
+					  strlen(table[i].word));
 		/* create_word consumes the length and the string to create a
 		 * new dictionary entry */
 		do_create_word(ctx);
 		w_h = ctx->dict.latest;
-		w_h->flags = builtin_table[i].flags;
+		w_h->flags = table[i].flags;
 		w_h->flags.f.length = len;
 
 		/**
@@ -824,9 +2756,15 @@ int builtins_init(struct forth_ctx *ctx)
 		 * Additionally compiled words will contain do_exit as the last
 		 * word in their definition.
 		 */
-		w = builtin_table[i].c_func;
+		w = table[i].c_func;
 		compile_word(ctx, (stack_cell_t)w);
+		prim_register(w);
 	}
 
 	return 0;
 }
+
+int builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, builtin_table, ARRAY_SIZE(builtin_table));
+}
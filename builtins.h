@@ -7,6 +7,31 @@
 
 #include "emforth.h"
 
+struct bultin_entry {
+	char word[WORD_NAME_MAX_LEN];
+	word_t c_func;
+	flag_t flags;
+};
+
+/**
+ * @brief adds a table of primitives to the current wordlist, used for the
+ * core words and by optional feature files for their own tables.
+ */
+int builtins_register(struct forth_ctx *ctx, const struct bultin_entry *table,
+		      size_t n);
 int builtins_init(struct forth_ctx *ctx);
 
+/**
+ * @brief prints n in the current base, right aligned in width columns and
+ * followed by a space when trailing_space is set.
+ */
+void print_number(struct forth_ctx *ctx, stack_cell_t n, bool is_signed,
+		  stack_cell_t width, bool trailing_space);
+
+/**
+ * @brief prints "label: used of size unit", for the memory reports.
+ */
+void print_usage(struct forth_ctx *ctx, const char *label, stack_cell_t used,
+		 stack_cell_t size, const char *unit);
+
 #endif /* __BUILTINS_H__ */
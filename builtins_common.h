@@ -10,62 +10,656 @@
 #define __BUILTINS_COMMON_H
 
 #include "emforth.h"
+#include <setjmp.h>
 #include <string.h>
 
 /* primitive function pointers used by outer_interpreter.c as well */
 void do_docol(struct forth_ctx *ctx);
+void do_const(struct forth_ctx *ctx);
+void do_val(struct forth_ctx *ctx);
+void do_var(struct forth_ctx *ctx);
+void do_does(struct forth_ctx *ctx);
 void do_exit(struct forth_ctx *ctx);
 void do_lit(struct forth_ctx *ctx);
+void do_local_fetch(struct forth_ctx *ctx);
+void do_locals_leave(struct forth_ctx *ctx);
+#ifdef EMFORTH_TOKEN_THREADED
+void do_lit16(struct forth_ctx *ctx);
+#endif
+
+/* primitives save_c.c expands to C or translates the operands of */
+void do_tick(struct forth_ctx *ctx);
+void do_branch(struct forth_ctx *ctx);
+void do_0branch(struct forth_ctx *ctx);
+void do_of(struct forth_ctx *ctx);
+void do_jumptable(struct forth_ctx *ctx);
+void do_locals_enter(struct forth_ctx *ctx);
+void do_local_store(struct forth_ctx *ctx);
+void do_plus(struct forth_ctx *ctx);
+void do_minus(struct forth_ctx *ctx);
+void do_multiply(struct forth_ctx *ctx);
+void do_incr(struct forth_ctx *ctx);
+void do_decr(struct forth_ctx *ctx);
+void do_equal(struct forth_ctx *ctx);
+void do_less_than(struct forth_ctx *ctx);
+void do_greater_than(struct forth_ctx *ctx);
+void do_zero_equal(struct forth_ctx *ctx);
+void do_dup(struct forth_ctx *ctx);
+void do_drop(struct forth_ctx *ctx);
+void do_swap(struct forth_ctx *ctx);
+void do_over(struct forth_ctx *ctx);
+
+/* index (token) to primitive function, filled in as builtins register */
+extern word_t prim_table[PRIM_TABLE_MAX];
+extern unsigned int prim_count;
+unsigned int prim_index(word_t fn);
 
 /* functions in outer_interpreter also used by primitives in builtins.c */
 dict_header_t *find_word_header(struct forth_ctx *ctx, const char *name,
 				size_t len);
+int read_token(struct forth_ctx *ctx, char *token, size_t max_len);
+int input_getchar(struct forth_ctx *ctx);
+int evaluate_buffer(struct forth_ctx *ctx, const char *buf, size_t len);
+int find_local(struct forth_ctx *ctx, const char *name, size_t len);
+void execute_xt(struct forth_ctx *ctx, stack_cell_t xt);
+
+/*
+ * Compile-time constant folding, in builtins.c. fold_literal compiles a
+ * literal the next words may fold, fold_xt folds xt into the literals
+ * before it when it is a pure primitive and returns whether it did, and
+ * fold_barrier forgets them, for words that take 'here' as a branch target.
+ * fold_mark is the part of >mark that removes 0branch on a known flag.
+ */
+void fold_literal(struct forth_ctx *ctx, stack_cell_t n);
+bool fold_xt(struct forth_ctx *ctx, stack_cell_t xt);
+void fold_barrier(struct forth_ctx *ctx);
+bool fold_mark(struct forth_ctx *ctx);
+
+#ifdef EMFORTH_HOSTED
+/* functions in par.c */
+void par_task_check(struct forth_ctx *ctx);
+#endif
+
+/* functions in emforth.c */
+bool dict_grow(struct forth_ctx *ctx, size_t n);
+bool dict_rollback(struct forth_ctx *ctx, unsigned char *new_here,
+		   unsigned char *names_here);
+#ifdef EMFORTH_SPLIT_DICT
+bool dict_names_grow(struct forth_ctx *ctx, size_t n);
+
+static inline bool dict_names_reserve(struct forth_ctx *ctx, size_t n)
+{
+#ifdef EMFORTH_HOSTED
+	par_task_check(ctx);
+#endif
+	if ((size_t)(ctx->dict.names_limit - ctx->dict.names_here) < n &&
+	    !dict_names_grow(ctx, n)) {
+		return false;
+	}
+#ifdef EMFORTH_STATS
+	if ((size_t)(ctx->dict.names_here - ctx->dict.names) + n >
+	    ctx->stats.names_here_max) {
+		ctx->stats.names_here_max =
+		    (size_t)(ctx->dict.names_here - ctx->dict.names) + n;
+	}
+#endif
+	return true;
+}
+#endif
+
+wordlist_t *wordlist_create(struct forth_ctx *ctx);
+
+/**
+ * @brief FNV-1a hash of a word name, reduced to a wordlist bucket index
+ */
+static inline unsigned int name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return h & (WORDLIST_HASH_BUCKETS - 1);
+}
+
+static inline char *dict_header_name(dict_header_t *header)
+{
+	return (char *)(header + 1);
+}
+
+/* first byte after the padded name of a header */
+static inline void *dict_header_end(dict_header_t *header)
+{
+	return dict_header_name(header) +
+	       ALIGN_UP_WORD_T(header->flags.f.length);
+}
+
+/**
+ * @brief codeword address (CFA) of a word
+ */
+static inline word_t *dict_header_cfa(dict_header_t *header)
+{
+#ifdef EMFORTH_SPLIT_DICT
+	return header->cfa;
+#else
+	return (word_t *)dict_header_end(header);
+#endif
+}
+
+/* start of what a word takes in the region its code is in */
+static inline unsigned char *dict_word_start(dict_header_t *header)
+{
+#ifdef EMFORTH_SPLIT_DICT
+	return (unsigned char *)header->cfa;
+#else
+	return (unsigned char *)header;
+#endif
+}
+
+/* qsort() order of an array of headers by dict_word_start() */
+static inline int dict_header_compare(const void *a, const void *b)
+{
+	unsigned char *wa = dict_word_start(*(dict_header_t *const *)a);
+	unsigned char *wb = dict_word_start(*(dict_header_t *const *)b);
+
+	return (wa > wb) - (wa < wb);
+}
+
+/*
+ * Sandbox builds keep some memory after here, so that the operands of a
+ * primitive in the last cell of code can be read whatever they are.
+ */
+#ifdef EMFORTH_SANDBOX
+#define DICT_SLACK (4 * sizeof(stack_cell_t))
+#else
+#define DICT_SLACK 0
+#endif
+
+/**
+ * @brief checks there are n free bytes at 'here', growing the dictionary
+ * if possible. Prints "Dictionary full" and returns false otherwise.
+ * Throws inside a par.c task.
+ */
+static inline bool dict_reserve(struct forth_ctx *ctx, size_t n)
+{
+#ifdef EMFORTH_HOSTED
+	/* here is shared with tasks, which must not move it */
+	par_task_check(ctx);
+#endif
+	if ((size_t)(ctx->dict.limit - ctx->dict.here) < n + DICT_SLACK &&
+	    !dict_grow(ctx, n + DICT_SLACK)) {
+		return false;
+	}
+#ifdef EMFORTH_STATS
+	if ((size_t)(ctx->dict.here - ctx->dict.mem) + n >
+	    ctx->stats.here_max) {
+		ctx->stats.here_max = (size_t)(ctx->dict.here - ctx->dict.mem) + n;
+	}
+#endif
+	return true;
+}
+
+static inline void compile_bytes(struct forth_ctx *ctx, const void *p,
+				 size_t n)
+{
+	if (!dict_reserve(ctx, n)) {
+		return;
+	}
+	memcpy(ctx->dict.here, p, n);
+	ctx->dict.here += n;
+}
 
 static inline void compile_word(struct forth_ctx *ctx, stack_cell_t word_p)
 {
-	memcpy(ctx->dict.here, &word_p, sizeof(word_t));
-	ctx->dict.here += sizeof(word_t);
+	compile_bytes(ctx, &word_p, sizeof(word_t));
+}
+
+/* == threaded code helpers, see thread_t in emforth.h == */
+
+/* number of thread cells a full literal cell occupies */
+#define LITERAL_THREAD_CELLS (sizeof(stack_cell_t) / sizeof(thread_t))
+
+/**
+ * @brief xt of a primitive from its function pointer
+ */
+static inline stack_cell_t prim_xt(word_t fn)
+{
+#ifdef EMFORTH_TOKEN_THREADED
+	return prim_index(fn);
+#else
+	return (stack_cell_t)fn;
+#endif
+}
+
+/**
+ * @brief whether fn is the codeword of words that have a body, which are
+ * referred to by their codeword address rather than by fn.
+ */
+static inline bool is_codeword(word_t fn)
+{
+	return fn == do_docol || fn == do_const || fn == do_val ||
+	       fn == do_var || fn == do_does;
+}
+
+/**
+ * @brief xt of a word from its codeword address, for colon definitions
+ * and other words with a body that is the codeword address itself, for
+ * primitives the function.
+ */
+static inline stack_cell_t cfa_to_xt(struct forth_ctx *ctx, word_t *cfa)
+{
+	if (!is_codeword(*cfa)) {
+		return prim_xt(*cfa);
+	}
+#ifdef EMFORTH_TOKEN_THREADED
+	return PRIM_TABLE_MAX +
+	       ((unsigned char *)cfa - ctx->dict.mem) / sizeof(word_t);
+#else
+	(void)ctx;
+	return (stack_cell_t)cfa;
+#endif
+}
+
+#ifdef EMFORTH_TOKEN_THREADED
+static inline word_t *token_cfa(struct forth_ctx *ctx, thread_t token)
+{
+	return (word_t *)(ctx->dict.mem +
+			  (size_t)(token - PRIM_TABLE_MAX) * sizeof(word_t));
+}
+#endif
+
+/**
+ * @brief whether p is a cell of compiled code: below here in the
+ * dictionary, and aligned like a thread cell
+ */
+static inline bool code_addr_valid(struct forth_ctx *ctx, const void *p)
+{
+	uintptr_t offset = (uintptr_t)p - (uintptr_t)ctx->dict.mem;
+
+	return offset < (uintptr_t)(ctx->dict.here - ctx->dict.mem) &&
+	       offset % sizeof(thread_t) == 0;
+}
+
+#ifdef EMFORTH_SANDBOX
+/* whether fn is a registered primitive, in builtins.c */
+bool prim_known(word_t fn);
+
+/*
+ * Sandbox builds run nothing but registered primitives and codewords in
+ * the dictionary, whatever a program stored into its code or passes to
+ * execute.
+ */
+static inline bool cfa_valid(struct forth_ctx *ctx, word_t *cfa)
+{
+	return code_addr_valid(ctx, cfa) &&
+	       (uintptr_t)cfa % sizeof(word_t) == 0 && is_codeword(*cfa);
+}
+
+static inline bool xt_valid(struct forth_ctx *ctx, stack_cell_t xt)
+{
+#ifdef EMFORTH_TOKEN_THREADED
+	if ((uintptr_t)xt < PRIM_TABLE_MAX) {
+		return (uintptr_t)xt < prim_count;
+	}
+	return (uintptr_t)xt == (thread_t)xt &&
+	       cfa_valid(ctx, token_cfa(ctx, xt));
+#else
+	return prim_known((word_t)xt) || cfa_valid(ctx, (word_t *)xt);
+#endif
+}
+#endif
+
+/**
+ * @brief codeword address of the word xt refers to, NULL for primitives,
+ * and in sandbox builds for anything that is not an xt
+ */
+static inline word_t *xt_to_cfa(struct forth_ctx *ctx, stack_cell_t xt)
+{
+#ifdef EMFORTH_SANDBOX
+	if (!xt_valid(ctx, xt)) {
+		return NULL;
+	}
+#endif
+#ifdef EMFORTH_TOKEN_THREADED
+	return (thread_t)xt < PRIM_TABLE_MAX ? NULL : token_cfa(ctx, xt);
+#else
+	(void)ctx;
+	return is_codeword(*(word_t *)xt) ? (word_t *)xt : NULL;
+#endif
+}
+
+/**
+ * @brief appends an xt to the definition being compiled
+ */
+static inline void compile_xt(struct forth_ctx *ctx, stack_cell_t xt)
+{
+	thread_t cell = (thread_t)xt;
+	compile_bytes(ctx, &cell, sizeof(cell));
+}
+
+/**
+ * @brief compiles code that pushes n as a full cell, which always ends
+ * just before 'here' so that it can be patched later.
+ */
+static inline void compile_literal_cell(struct forth_ctx *ctx,
+					stack_cell_t n)
+{
+	compile_xt(ctx, prim_xt(do_lit));
+	compile_bytes(ctx, &n, sizeof(n));
+}
+
+/**
+ * @brief compiles code that pushes n, lit16 is used when it fits
+ */
+static inline void compile_literal(struct forth_ctx *ctx, stack_cell_t n)
+{
+#ifdef EMFORTH_TOKEN_THREADED
+	if (n >= INT16_MIN && n <= INT16_MAX) {
+		compile_xt(ctx, prim_xt(do_lit16));
+		compile_xt(ctx, (uint16_t)n);
+		return;
+	}
+#endif
+	compile_literal_cell(ctx, n);
+}
+
+/**
+ * @brief literal cell stored inline at ip (may be unaligned for tokens)
+ */
+static inline stack_cell_t thread_literal(const thread_t *ip)
+{
+	stack_cell_t n;
+	memcpy(&n, ip, sizeof(n));
+	return n;
+}
+
+/**
+ * @brief branch offset stored at ip, in bytes relative to ip
+ */
+static inline stack_cell_t thread_offset(const thread_t *ip)
+{
+#ifdef EMFORTH_TOKEN_THREADED
+	return (int16_t)*ip;
+#else
+	return *(const stack_cell_t *)ip;
+#endif
+}
+
+static inline void thread_set_offset(thread_t *ip, stack_cell_t offset)
+{
+#ifdef EMFORTH_TOKEN_THREADED
+	*ip = (uint16_t)(int16_t)offset;
+#else
+	*(stack_cell_t *)ip = offset;
+#endif
+}
+
+/* == exceptions == */
+
+/* throw codes, with the values the standard assigns them */
+enum {
+	THROW_ABORT = -1,
+	THROW_ABORT_MESSAGE = -2, /* the message was already printed */
+	THROW_STACK_OVERFLOW = -3,
+	THROW_STACK_UNDERFLOW = -4,
+	THROW_RSTACK_OVERFLOW = -5,
+	THROW_INVALID_ADDRESS = -9,
+	THROW_DIVISION_BY_ZERO = -10,
+	THROW_UNDEFINED_WORD = -13,
+	THROW_COMPILE_ONLY = -14,
+	THROW_PICTURED_OVERFLOW = -17,
+	THROW_UNSUPPORTED = -21,
+	THROW_INVALID_ARGUMENT = -24,
+	THROW_INTERRUPT = -28, /* emforth_step ran out of budget */
+	THROW_NOT_CREATED = -31,
+	THROW_INVALID_NAME = -32,
+	THROW_BLOCK_READ = -33,
+	THROW_BLOCK_WRITE = -34,
+	THROW_INVALID_BLOCK = -35,
+	THROW_ORDER_OVERFLOW = -49,
+	THROW_ORDER_UNDERFLOW = -50,
+	THROW_ALLOCATE = -59,
+	THROW_FREE = -60,
+	THROW_RESIZE = -61,
+};
+
+/**
+ * A catch frame lives in the C stack frame of whatever catches, and
+ * records the depth of both stacks at the time. Install it with
+ * catch_enter() immediately followed by if (setjmp(frame.env) == 0), and
+ * remove it with catch_leave() on the normal path. A throw unwinds to the
+ * innermost frame with the stacks cut back to the recorded depths.
+ */
+struct catch_frame {
+	jmp_buf env;
+	struct catch_frame *prev;
+	stack_cell_t code; /* what was thrown, 0 until then */
+	stack_cell_t sp;
+	stack_cell_t rsp;
+	stack_cell_t fp;
+	thread_t *ip;
+	int source_depth;
+	bool in_comment;
+};
+
+/* kept out of line and off the hot path of every caller */
+__attribute__((noreturn, cold)) void forth_throw(struct forth_ctx *ctx,
+						 stack_cell_t code);
+void print_throw(struct forth_ctx *ctx, stack_cell_t code);
+
+static inline void catch_enter(struct forth_ctx *ctx, struct catch_frame *f)
+{
+	f->prev = ctx->catch_frame;
+	f->code = 0;
+	f->sp = ctx->sp;
+	f->rsp = ctx->rsp;
+	f->fp = ctx->fp;
+	f->ip = ctx->ip;
+	f->source_depth = ctx->intrp_data.source_depth;
+	f->in_comment = ctx->intrp_data.in_comment;
+	ctx->catch_frame = f;
+}
+
+static inline void catch_leave(struct forth_ctx *ctx, struct catch_frame *f)
+{
+	ctx->catch_frame = f->prev;
+}
+
+/* after a throw reached f, puts the machine back as it was at catch_enter */
+static inline void catch_unwind(struct forth_ctx *ctx, struct catch_frame *f)
+{
+	ctx->sp = f->sp;
+	ctx->rsp = f->rsp;
+	ctx->fp = f->fp;
+	ctx->ip = f->ip;
+	ctx->intrp_data.source_depth = f->source_depth;
+	ctx->intrp_data.in_comment = f->in_comment;
+	ctx->catch_frame = f->prev;
+}
+
+/* == stack helpers, errors throw == */
+
+/**
+ * @brief with EMFORTH_STATS, records how deep the stacks got. Called
+ * after they grow.
+ */
+static inline void stats_depth(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_STATS
+	if (ctx->sp > ctx->stats.sp_max) {
+		ctx->stats.sp_max = ctx->sp;
+	}
+	if (ctx->rsp > ctx->stats.rsp_max) {
+		ctx->stats.rsp_max = ctx->rsp;
+	}
+#else
+	(void)ctx;
+#endif
 }
 
 static inline void stack_push(struct forth_ctx *ctx, stack_cell_t value)
 {
 	if (ctx->sp >= STACK_SIZE_MAX) {
-		ctx->plat.puts("Stack overflow\n");
-		ctx->sp = STACK_SIZE_MAX - 1;
-	} else {
-		ctx->stack[ctx->sp++] = value;
+		forth_throw(ctx, THROW_STACK_OVERFLOW);
 	}
+	ctx->stack[ctx->sp++] = value;
+	stats_depth(ctx);
 }
 
 static inline stack_cell_t stack_pop(struct forth_ctx *ctx)
 {
 	if (ctx->sp == 0) {
-		ctx->plat.puts("Stack underflow\n");
-		return 0;
-	} else {
-		return ctx->stack[--ctx->sp];
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
 	}
+	return ctx->stack[--ctx->sp];
 }
 
 static inline void stack_sub(struct forth_ctx *ctx, stack_cell_t num)
 {
-	if (num > ctx->sp) {
-		ctx->sp = 0;
-		ctx->plat.puts(__func__);
-		ctx->plat.puts(" stack underflow\n");
-	} else {
-		ctx->sp -= num;
+	/* unsigned, so that a negative count fails too */
+	if ((uintptr_t)num > (uintptr_t)ctx->sp) {
+		forth_throw(ctx, THROW_STACK_UNDERFLOW);
 	}
+	ctx->sp -= num;
 }
 
 static inline void stack_add(struct forth_ctx *ctx, stack_cell_t num)
 {
+	if ((uintptr_t)num > (uintptr_t)(STACK_SIZE_MAX - ctx->sp)) {
+		forth_throw(ctx, THROW_STACK_OVERFLOW);
+	}
 	ctx->sp += num;
-	if (ctx->sp >= STACK_SIZE_MAX) {
-		ctx->plat.puts(__func__);
-		ctx->plat.puts(" stack overflow\n");
-		ctx->sp = STACK_SIZE_MAX - 1;
+	stats_depth(ctx);
+}
+
+/**
+ * @brief whether n bytes at addr may be accessed by @ ! c@ c! and friends
+ */
+static inline bool region_valid(const void *start, size_t size,
+				stack_cell_t addr, size_t n)
+{
+	/* below start the offset wraps around and is too large */
+	uintptr_t offset = (uintptr_t)addr - (uintptr_t)start;
+
+	return offset <= size && n <= size - offset;
+}
+
+/*
+ * whether n bytes at addr are outside the dictionary, but in memory a
+ * program may access: the heap, or the buffers of block.c
+ */
+static inline bool other_addr_valid(struct forth_ctx *ctx, stack_cell_t addr,
+				    size_t n)
+{
+#ifdef EMFORTH_HEAP
+	if (ctx->dict.heap != NULL &&
+	    region_valid(ctx->dict.heap->mem, HEAP_SIZE, addr, n)) {
+		return true;
+	}
+#endif
+#ifdef EMFORTH_HOSTED
+	/* the buffers come first in struct block_cache */
+	if (ctx->dict.blocks != NULL &&
+	    region_valid(ctx->dict.blocks, BLOCK_BUFFERS * BLOCK_SIZE, addr,
+			 n)) {
+		return true;
+	}
+#endif
+#if !defined(EMFORTH_HEAP) && !defined(EMFORTH_HOSTED)
+	(void)ctx;
+	(void)addr;
+	(void)n;
+#endif
+	return false;
+}
+
+static inline bool addr_valid(struct forth_ctx *ctx, stack_cell_t addr,
+			      size_t n)
+{
+	return region_valid(ctx->dict.mem, ctx->dict.limit - ctx->dict.mem,
+			    addr, n) ||
+	       other_addr_valid(ctx, addr, n);
+}
+
+/**
+ * @brief host pointer for a memory access of n bytes, n a power of two.
+ * Checked against the dictionary, or masked into it in sandbox builds.
+ */
+static inline void *access_ptr(struct forth_ctx *ctx, stack_cell_t addr,
+			       size_t n)
+{
+#ifdef EMFORTH_SANDBOX
+	uintptr_t offset = ((uintptr_t)addr - (uintptr_t)ctx->dict.mem) &
+			   ctx->dict.mask & ~(uintptr_t)(n - 1);
+
+	if (other_addr_valid(ctx, addr, n)) {
+		return (void *)addr;
+	}
+	return ctx->dict.mem + offset;
+#else
+	if (!addr_valid(ctx, addr, n)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	return (void *)addr;
+#endif
+}
+
+/**
+ * @brief like access_ptr(), for a store. Sandbox builds also keep stores
+ * out of what emforth_init defined, except for base.
+ */
+static inline void *store_ptr(struct forth_ctx *ctx, stack_cell_t addr,
+			      size_t n)
+{
+	unsigned char *p = access_ptr(ctx, addr, n);
+
+#ifdef EMFORTH_SANDBOX
+	if (p >= ctx->dict.mem && p < ctx->dict.fence &&
+	    p != (unsigned char *)ctx->intrp_data.base) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+	return p;
+}
+
+/* whether n bytes at addr may be written, see store_ptr() */
+static inline bool store_valid(struct forth_ctx *ctx, stack_cell_t addr,
+			       size_t n)
+{
+#ifdef EMFORTH_SANDBOX
+	if (region_valid(ctx->dict.mem, ctx->dict.fence - ctx->dict.mem, addr,
+			 1)) {
+		return false;
+	}
+#endif
+	return addr_valid(ctx, addr, n);
+}
+
+/**
+ * @brief for primitives that read operands after them in code, which the
+ * interpreter can run outside of code too. Only checked in sandbox builds.
+ */
+static inline void operands_check(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_SANDBOX
+	if (!code_addr_valid(ctx, ctx->ip)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#else
+	(void)ctx;
+#endif
+}
+
+#ifdef EMFORTH_SANDBOX
+/**
+ * @brief throws unless xt is something the inner interpreter may run
+ */
+static inline void xt_check(struct forth_ctx *ctx, stack_cell_t xt)
+{
+	if (!xt_valid(ctx, xt)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
 	}
 }
+#endif
 
 #endif /* __BUILTINS_COMMON_H */
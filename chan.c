@@ -0,0 +1,301 @@
+/**
+ * @file chan.c
+ *
+ * @brief Channels, single producer single consumer rings of cells for
+ * passing data between contexts running on different threads.
+ *
+ * A channel lives in the dictionary, so every context sharing it (see
+ * par.c) can use it by address. One thread puts cells in, one other thread
+ * takes them out, and neither takes a lock: the producer only writes head
+ * and the consumer only writes tail, each on a cache line of its own. Each
+ * side also keeps a copy of the other side's index on its own line and
+ * only reloads the real one when the copy says the ring is full or empty.
+ *
+ * A blocking word spins for a while and then yields the CPU until the
+ * other side catches up, so the two ends must run on different threads,
+ * e.g. one of them spawned.
+ */
+#define _DEFAULT_SOURCE
+
+#include <sched.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "chan.h"
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define CHAN_CACHE_LINE 64
+#define CHAN_MAGIC ((size_t)0x6368616e) /* "chan" */
+
+/* largest capacity, a power of two whose ring size cannot overflow */
+#define CHAN_CAP_MAX                                                           \
+	(((size_t)1 << (sizeof(size_t) * 8 - 4)) / sizeof(stack_cell_t))
+
+/* busy polls before a blocked word starts yielding the CPU */
+#define CHAN_SPINS 1024
+
+struct chan {
+	/* written by the producer */
+	size_t head;	    /* cells put in so far */
+	size_t tail_cache; /* last tail the producer saw */
+	char pad_head[CHAN_CACHE_LINE - 2 * sizeof(size_t)];
+	/* written by the consumer */
+	size_t tail;	    /* cells taken out so far */
+	size_t head_cache; /* last head the consumer saw */
+	char pad_tail[CHAN_CACHE_LINE - 2 * sizeof(size_t)];
+	/* read only after channel */
+	size_t magic;
+	size_t mask; /* capacity - 1, capacity a power of two */
+	char pad_ring[CHAN_CACHE_LINE - 2 * sizeof(size_t)];
+	stack_cell_t ring[];
+};
+
+static void chan_wait(unsigned int *spins)
+{
+	if (++*spins > CHAN_SPINS) {
+		sched_yield();
+	}
+}
+
+/* the channel at addr, throws unless channel made one there */
+static struct chan *chan_get(struct forth_ctx *ctx, stack_cell_t addr)
+{
+	struct chan *ch = (struct chan *)addr;
+	size_t cap;
+
+	if (addr % CHAN_CACHE_LINE != 0 ||
+	    !store_valid(ctx, addr, sizeof(struct chan)) ||
+	    ch->magic != CHAN_MAGIC) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	/* the mask is in memory a program can write, so is checked as well */
+	cap = ch->mask + 1;
+	if (cap == 0 || (cap & (cap - 1)) != 0 || cap > CHAN_CAP_MAX ||
+	    !store_valid(ctx, addr,
+			 sizeof(struct chan) + cap * sizeof(stack_cell_t))) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	return ch;
+}
+
+/* the cell buffer of n cells at addr, for the batch words */
+static stack_cell_t *chan_buffer(struct forth_ctx *ctx, stack_cell_t addr,
+				 stack_cell_t n)
+{
+	if (n < 0 || (size_t)n > SIZE_MAX / sizeof(stack_cell_t) ||
+	    !store_valid(ctx, addr, n * sizeof(stack_cell_t))) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	return (stack_cell_t *)addr;
+}
+
+/* == producer side == */
+
+/* free slots, at most want, reloading tail only if the cache has too few */
+static size_t chan_space(struct chan *ch, size_t want)
+{
+	size_t cap = ch->mask + 1;
+	size_t space = cap - (ch->head - ch->tail_cache);
+
+	if (space < want) {
+		ch->tail_cache = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+		space = cap - (ch->head - ch->tail_cache);
+	}
+	return space < want ? space : want;
+}
+
+/* puts n cells, blocking until all are in */
+static void chan_put(struct chan *ch, const stack_cell_t *src, size_t n)
+{
+	unsigned int spins = 0;
+
+	while (n > 0) {
+		size_t k = chan_space(ch, n);
+		size_t at = ch->head & ch->mask;
+		size_t first = ch->mask + 1 - at;
+
+		if (k == 0) {
+			chan_wait(&spins);
+			continue;
+		}
+		if (first > k) {
+			first = k;
+		}
+		memcpy(&ch->ring[at], src, first * sizeof(*src));
+		memcpy(&ch->ring[0], src + first, (k - first) * sizeof(*src));
+		__atomic_store_n(&ch->head, ch->head + k, __ATOMIC_RELEASE);
+		src += k;
+		n -= k;
+		spins = 0;
+	}
+}
+
+/* == consumer side == */
+
+/* queued cells, at most want, reloading head only if the cache has too few */
+static size_t chan_avail(struct chan *ch, size_t want)
+{
+	size_t avail = ch->head_cache - ch->tail;
+
+	if (avail < want) {
+		ch->head_cache = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+		avail = ch->head_cache - ch->tail;
+	}
+	return avail < want ? avail : want;
+}
+
+/* takes up to n cells without waiting, returns how many */
+static size_t chan_take(struct chan *ch, stack_cell_t *dst, size_t n)
+{
+	size_t k = chan_avail(ch, n);
+	size_t at = ch->tail & ch->mask;
+	size_t first = ch->mask + 1 - at;
+
+	if (first > k) {
+		first = k;
+	}
+	memcpy(dst, &ch->ring[at], first * sizeof(*dst));
+	memcpy(dst + first, &ch->ring[0], (k - first) * sizeof(*dst));
+	__atomic_store_n(&ch->tail, ch->tail + k, __ATOMIC_RELEASE);
+	return k;
+}
+
+/* takes n cells, blocking until all are out */
+static void chan_get_n(struct chan *ch, stack_cell_t *dst, size_t n)
+{
+	unsigned int spins = 0;
+
+	while (n > 0) {
+		size_t k = chan_take(ch, dst, n);
+
+		if (k == 0) {
+			chan_wait(&spins);
+			continue;
+		}
+		dst += k;
+		n -= k;
+		spins = 0;
+	}
+}
+
+/* == words == */
+
+/**
+ * @brief ( u -- chan ) allots an empty channel for at least u cells in the
+ * dictionary. The capacity is rounded up to a power of two.
+ */
+void do_channel(struct forth_ctx *ctx)
+{
+	stack_cell_t u = stack_pop(ctx);
+	size_t cap = 1;
+	uintptr_t pad;
+	struct chan *ch;
+
+	if (u < 0 || (size_t)u > CHAN_CAP_MAX) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	while (cap < (size_t)u) {
+		cap <<= 1;
+	}
+
+	pad = -(uintptr_t)ctx->dict.here & (CHAN_CACHE_LINE - 1);
+	if (!dict_reserve(ctx, pad + sizeof(*ch) + cap * sizeof(stack_cell_t))) {
+		/* dict_reserve printed why */
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+	ch = (struct chan *)(ctx->dict.here + pad);
+	memset(ch, 0, sizeof(*ch));
+	ch->magic = CHAN_MAGIC;
+	ch->mask = cap - 1;
+	ctx->dict.here += pad + sizeof(*ch) + cap * sizeof(stack_cell_t);
+	stack_push(ctx, (stack_cell_t)ch);
+}
+
+/**
+ * @brief ( x chan -- ) puts x into chan, waiting while it is full.
+ */
+void do_to_chan(struct forth_ctx *ctx)
+{
+	struct chan *ch = chan_get(ctx, stack_pop(ctx));
+	stack_cell_t x = stack_pop(ctx);
+
+	chan_put(ch, &x, 1);
+}
+
+/**
+ * @brief ( chan -- x ) takes the oldest cell out of chan, waiting while it
+ * is empty.
+ */
+void do_chan_from(struct forth_ctx *ctx)
+{
+	struct chan *ch = chan_get(ctx, stack_pop(ctx));
+	stack_cell_t x;
+
+	chan_get_n(ch, &x, 1);
+	stack_push(ctx, x);
+}
+
+/**
+ * @brief ( chan -- x 1 | 0 ) takes the oldest cell out of chan if
+ * there is one, without waiting.
+ */
+void do_chan_try_from(struct forth_ctx *ctx)
+{
+	struct chan *ch = chan_get(ctx, stack_pop(ctx));
+	stack_cell_t x;
+
+	if (chan_take(ch, &x, 1) == 0) {
+		stack_push(ctx, 0);
+		return;
+	}
+	stack_push(ctx, x);
+	stack_push(ctx, 1);
+}
+
+/**
+ * @brief ( addr n chan -- ) puts the n cells at addr into chan, in order,
+ * waiting for room as needed.
+ */
+void do_to_chan_n(struct forth_ctx *ctx)
+{
+	struct chan *ch = chan_get(ctx, stack_pop(ctx));
+	stack_cell_t n = stack_pop(ctx);
+	stack_cell_t *src = chan_buffer(ctx, stack_pop(ctx), n);
+
+	chan_put(ch, src, n);
+}
+
+/**
+ * @brief ( addr n chan -- ) takes n cells out of chan into addr, waiting
+ * until all of them have arrived.
+ */
+void do_chan_from_n(struct forth_ctx *ctx)
+{
+	struct chan *ch = chan_get(ctx, stack_pop(ctx));
+	stack_cell_t n = stack_pop(ctx);
+	stack_cell_t *dst = chan_buffer(ctx, stack_pop(ctx), n);
+
+	chan_get_n(ch, dst, n);
+}
+
+static const struct bultin_entry chan_builtin_table[] = {
+    {.word = "channel", .c_func = do_channel, .flags = {}},
+    {.word = ">chan", .c_func = do_to_chan, .flags = {}},
+    {.word = "chan>", .c_func = do_chan_from, .flags = {}},
+    {.word = "?chan>", .c_func = do_chan_try_from, .flags = {}},
+    {.word = ">chan-n", .c_func = do_to_chan_n, .flags = {}},
+    {.word = "chan-n>", .c_func = do_chan_from_n, .flags = {}},
+};
+
+int chan_builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, chan_builtin_table,
+				 ARRAY_SIZE(chan_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
@@ -0,0 +1,16 @@
+/**
+ * @file chan.h
+ *
+ * @brief Channels that pass cells between contexts on different threads.
+ */
+
+#ifndef __CHAN_H__
+#define __CHAN_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+int chan_builtins_init(struct forth_ctx *ctx);
+#endif
+
+#endif /* __CHAN_H__ */
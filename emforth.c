@@ -6,41 +6,512 @@
  * @copyright Copyright (c) 2025
  *
  */
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS */
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "block.h"
 #include "builtins.h"
+#include "builtins_common.h"
+#include "chan.h"
 #include "emforth.h"
+#include "heap.h"
+#include "image.h"
 #include "interpreter.h"
+#include "module.h"
+#include "par.h"
+#include "prof.h"
+#include "save_c.h"
+#include "turnkey.h"
 
-int emforth_init(struct forth_ctx *ctx)
+#ifdef EMFORTH_GROWABLE_DICT
+#include <sys/mman.h>
+#endif
+
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((size_t)(a) - 1))
+
+#ifdef EMFORTH_SANDBOX
+/* fails to compile unless DICTIONARY_MEMORY_SIZE is a power of two */
+typedef char sandbox_size_check
+    [(DICTIONARY_MEMORY_SIZE & (DICTIONARY_MEMORY_SIZE - 1)) == 0 ? 1 : -1];
+
+/* smallest power of two that is at least n */
+static size_t pow2_up(size_t n)
+{
+	size_t p = 1;
+
+	while (p < n) {
+		p <<= 1;
+	}
+	return p;
+}
+#endif
+
+#ifdef EMFORTH_GROWABLE_DICT
+/* only reserve address space here, region_grow() commits it */
+static unsigned char *region_reserve(size_t size)
 {
-	if (ctx == NULL || ctx->plat.puts == NULL ||
-	    ctx->plat.getchar == NULL) {
+	void *mem = mmap(NULL, size, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return mem == MAP_FAILED ? NULL : mem;
+}
+#endif
+
+/**
+ * @brief commits memory so that n bytes after here are below *limit.
+ */
+static bool region_grow(unsigned char *here, unsigned char **limit,
+			unsigned char *end, size_t n)
+{
+#ifdef EMFORTH_GROWABLE_DICT
+	if (n <= (size_t)(end - here)) {
+		size_t needed = (size_t)(here + n - *limit);
+		size_t grow = ALIGN_UP(needed, DICTIONARY_SEGMENT_SIZE);
+
+		if (grow > (size_t)(end - *limit)) {
+			grow = end - *limit;
+		}
+
+		if (mprotect(*limit, grow, PROT_READ | PROT_WRITE) == 0) {
+			*limit += grow;
+			return true;
+		}
+	}
+#else
+	(void)here;
+	(void)limit;
+	(void)end;
+	(void)n;
+#endif
+
+	return false;
+}
+
+/**
+ * @brief gives back memory beyond the segment after here, keeping one
+ * segment committed so that a reload cycle does not commit and decommit
+ * every time, and so a running marker can finish.
+ */
+static void region_trim(unsigned char *mem, unsigned char *here,
+			unsigned char **limit)
+{
+#ifdef EMFORTH_GROWABLE_DICT
+	unsigned char *keep =
+	    mem + ALIGN_UP((size_t)(here - mem), DICTIONARY_SEGMENT_SIZE) +
+	    DICTIONARY_SEGMENT_SIZE;
+
+	if (keep < *limit) {
+		madvise(keep, *limit - keep, MADV_DONTNEED);
+		mprotect(keep, *limit - keep, PROT_NONE);
+		*limit = keep;
+	}
+#else
+	(void)mem;
+	(void)here;
+	(void)limit;
+#endif
+}
+
+static int dict_mem_init(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_GROWABLE_DICT
+	ctx->dict.mem = region_reserve(DICTIONARY_RESERVE_SIZE);
+	if (ctx->dict.mem == NULL) {
+		return -1;
+	}
+	ctx->dict.limit = ctx->dict.mem;
+	ctx->dict.end = ctx->dict.mem + DICTIONARY_RESERVE_SIZE;
+#ifdef EMFORTH_SPLIT_DICT
+	ctx->dict.names = region_reserve(NAME_SPACE_RESERVE_SIZE);
+	if (ctx->dict.names == NULL) {
+		munmap(ctx->dict.mem, DICTIONARY_RESERVE_SIZE);
 		return -1;
 	}
+	ctx->dict.names_limit = ctx->dict.names;
+	ctx->dict.names_end = ctx->dict.names + NAME_SPACE_RESERVE_SIZE;
+#endif
+#else
+	memset(ctx->dict.storage, 0, sizeof(ctx->dict.storage));
+	ctx->dict.mem = ctx->dict.storage;
+	ctx->dict.limit = ctx->dict.mem + DICTIONARY_MEMORY_SIZE;
+	ctx->dict.end = ctx->dict.limit;
+#ifdef EMFORTH_SANDBOX
+	ctx->dict.mask = DICTIONARY_MEMORY_SIZE - 1;
+#endif
+#ifdef EMFORTH_SPLIT_DICT
+	memset(ctx->dict.names_storage, 0, sizeof(ctx->dict.names_storage));
+	ctx->dict.names = ctx->dict.names_storage;
+	ctx->dict.names_limit = ctx->dict.names + NAME_SPACE_SIZE;
+	ctx->dict.names_end = ctx->dict.names_limit;
+#endif
+#endif
+
+#ifdef EMFORTH_SPLIT_DICT
+	ctx->dict.names_here = ctx->dict.names;
+#endif
+
+	return 0;
+}
+
+#ifdef EMFORTH_SANDBOX
+/*
+ * commits the dictionary up to the power of two at or above size, the
+ * mask has to cover exactly the memory below limit
+ */
+static bool sandbox_resize(struct forth_ctx *ctx, size_t size)
+{
+	unsigned char *new_limit = ctx->dict.mem + pow2_up(size);
+
+	if (new_limit > ctx->dict.end) {
+		return false;
+	}
+	if (new_limit > ctx->dict.limit &&
+	    !region_grow(ctx->dict.limit, &ctx->dict.limit, ctx->dict.end,
+			 new_limit - ctx->dict.limit)) {
+		return false;
+	}
+	ctx->dict.mask = (uintptr_t)(ctx->dict.limit - ctx->dict.mem) - 1;
+	return true;
+}
+#endif
+
+/**
+ * @brief called when there are less than n bytes left after 'here'.
+ * Commits more of the reserved space where possible.
+ * @returns true if there is now room for n bytes.
+ */
+bool dict_grow(struct forth_ctx *ctx, size_t n)
+{
+#ifdef EMFORTH_SANDBOX
+	if (sandbox_resize(ctx, (size_t)(ctx->dict.here - ctx->dict.mem) + n)) {
+		return true;
+	}
+#else
+	if (region_grow(ctx->dict.here, &ctx->dict.limit, ctx->dict.end, n)) {
+		return true;
+	}
+#endif
+
+	ctx->plat.puts("Dictionary full\n");
+	return false;
+}
+
+#ifdef EMFORTH_SPLIT_DICT
+/**
+ * @brief same as dict_grow() for the name space region.
+ */
+bool dict_names_grow(struct forth_ctx *ctx, size_t n)
+{
+	if (region_grow(ctx->dict.names_here, &ctx->dict.names_limit,
+			ctx->dict.names_end, n)) {
+		return true;
+	}
+
+	ctx->plat.puts("Name space full\n");
+	return false;
+}
+#endif
+
+/**
+ * @brief allocates an empty wordlist in the dictionary, in name space in
+ * split builds
+ * @returns NULL if the dictionary is full
+ */
+wordlist_t *wordlist_create(struct forth_ctx *ctx)
+{
+	wordlist_t *wl;
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char **wl_here = &ctx->dict.names_here;
+
+	*wl_here = (unsigned char *)ALIGN_UP_WORD_T(*wl_here);
+	if (!dict_names_reserve(ctx, sizeof(wordlist_t))) {
+		return NULL;
+	}
+#else
+	unsigned char **wl_here = &ctx->dict.here;
+
+	*wl_here = (unsigned char *)ALIGN_UP_WORD_T(*wl_here);
+	if (!dict_reserve(ctx, sizeof(wordlist_t))) {
+		return NULL;
+	}
+#endif
+
+	wl = (wordlist_t *)*wl_here;
+	*wl_here += sizeof(wordlist_t);
+
+	memset(wl, 0, sizeof(*wl));
+	wl->prev = ctx->dict.wordlists;
+	ctx->dict.wordlists = wl;
+
+	return wl;
+}
+
+/* drops headers at or above boundary from a newest first chain */
+static dict_header_t *chain_trim(dict_header_t *header, void *boundary,
+				 bool hash_chain)
+{
+	while (header != DICT_NULL && (void *)header >= boundary) {
+		header = hash_chain ? header->hlink : header->link;
+	}
+	return header;
+}
+
+#ifdef EMFORTH_SANDBOX
+/*
+ * whether names_here, which a program may have made up, is the end of an
+ * allocation in name space: a header or wordlist across it would be
+ * overwritten by what comes after it
+ */
+static bool names_cut_valid(struct forth_ctx *ctx, unsigned char *names_here)
+{
+	for (wordlist_t *wl = ctx->dict.wordlists; wl != NULL; wl = wl->prev) {
+		dict_header_t *h = chain_trim(wl->latest, names_here, false);
+
+		if ((unsigned char *)wl < names_here &&
+		    (unsigned char *)(wl + 1) > names_here) {
+			return false;
+		}
+		if (h != DICT_NULL &&
+		    (unsigned char *)dict_header_end(h) > names_here) {
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+/**
+ * @brief removes everything defined at or above new_here, and headers at
+ * or above names_here in split builds, where it is the matching cut in
+ * name space. Used by forget and markers. latest becomes the newest word
+ * left in any wordlist. Anything derived from dictionary contents (lookup
+ * state, cached code) must be dropped here too. Throws while tasks of the
+ * worker pool are queued or running.
+ * @returns false if that would remove words defined by emforth_init.
+ */
+bool dict_rollback(struct forth_ctx *ctx, unsigned char *new_here,
+		   unsigned char *names_here)
+{
+	if (new_here < ctx->dict.fence || new_here > ctx->dict.here) {
+		return false;
+	}
+#ifdef EMFORTH_HOSTED
+	/* tasks in the worker pool may be running the words removed here */
+	if (par_busy()) {
+		ctx->plat.puts("Tasks still running\n");
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+#endif
+
+#ifdef EMFORTH_SPLIT_DICT
+	if (names_here < ctx->dict.names_fence ||
+	    names_here > ctx->dict.names_here) {
+		return false;
+	}
+#ifdef EMFORTH_SANDBOX
+	if (!names_cut_valid(ctx, names_here)) {
+		return false;
+	}
+#endif
+
+	ctx->dict.names_here = names_here;
+	region_trim(ctx->dict.names, names_here, &ctx->dict.names_limit);
+#else
+	names_here = new_here;
+#endif
+
+	/* wordlists allocated in the removed part go away entirely */
+	while ((unsigned char *)ctx->dict.wordlists >= names_here) {
+		ctx->dict.wordlists = ctx->dict.wordlists->prev;
+	}
+
+	stack_cell_t kept = 0;
+	for (stack_cell_t i = 0; i < ctx->dict.order_len; i++) {
+		if ((unsigned char *)ctx->dict.order[i] < names_here) {
+			ctx->dict.order[kept++] = ctx->dict.order[i];
+		}
+	}
+	/* an order set empty on purpose stays empty */
+	if (kept == 0 && ctx->dict.order_len > 0) {
+		ctx->dict.order[kept++] = ctx->dict.forth_wordlist;
+	}
+	ctx->dict.order_len = kept;
+	if ((unsigned char *)ctx->dict.current >= names_here) {
+		ctx->dict.current = ctx->dict.forth_wordlist;
+	}
+
+	/* the rest lose the words defined after the cut, the newest word
+	 * left in any of them is the latest again */
+	ctx->dict.latest = DICT_NULL;
+	for (wordlist_t *wl = ctx->dict.wordlists; wl != NULL; wl = wl->prev) {
+		wl->latest = chain_trim(wl->latest, names_here, false);
+		for (unsigned int i = 0; i < WORDLIST_HASH_BUCKETS; i++) {
+			wl->buckets[i] =
+			    chain_trim(wl->buckets[i], names_here, true);
+		}
+		if ((uintptr_t)wl->latest > (uintptr_t)ctx->dict.latest) {
+			ctx->dict.latest = wl->latest;
+		}
+	}
+
+	ctx->dict.here = new_here;
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_TOKEN_THREADED)
+	module_refs_trim(ctx, new_here);
+#endif
+#ifndef EMFORTH_SANDBOX
+	/* sandbox builds keep it committed, a word that forgets itself may
+	 * still be read or written by the C code that runs it */
+	region_trim(ctx->dict.mem, new_here, &ctx->dict.limit);
+#endif
+
+	return true;
+}
+
+/* what emforth_init and emforth_boot share, builtins get headers unless
+ * headerless is set */
+static int ctx_init(struct forth_ctx *ctx, bool headerless)
+{
+	/* getchar may be NULL, input then comes from emforth_feed */
+	if (ctx == NULL || ctx->plat.puts == NULL) {
+		return -1;
+	}
+
+#ifdef EMFORTH_STATS
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
 
 	/* initialize dictionary */
-	memset(ctx->dict.mem, 0, sizeof(ctx->dict.mem));
+	if (dict_mem_init(ctx) != 0) {
+		return -1;
+	}
 	ctx->dict.here = &ctx->dict.mem[0];
 	ctx->dict.latest = DICT_NULL;
+	ctx->dict.headerless = headerless;
+
+	/* every word defined from here on goes to the forth wordlist */
+	ctx->dict.wordlists = NULL;
+	ctx->dict.forth_wordlist = wordlist_create(ctx);
+	ctx->dict.current = ctx->dict.forth_wordlist;
+	ctx->dict.order[0] = ctx->dict.forth_wordlist;
+	ctx->dict.order_len = 1;
 
 	/* intiialize stacks */
 	ctx->sp = 0;
 	ctx->rsp = 0;
+	ctx->fp = 0;
 
 	/* Initialize threading registers */
 	ctx->ip = NULL;
 	ctx->w = NULL;
 
 	builtins_init(ctx);
+#ifdef EMFORTH_HEAP
+	heap_builtins_init(ctx);
+#endif
+#ifdef EMFORTH_HOSTED
+	image_builtins_init(ctx);
+	save_c_builtins_init(ctx);
+	par_builtins_init(ctx);
+	chan_builtins_init(ctx);
+	prof_builtins_init(ctx);
+	block_builtins_init(ctx);
+#endif
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_TOKEN_THREADED)
+	module_builtins_init(ctx);
+	turnkey_builtins_init(ctx);
+#endif
 
 	/* Initialize interpreter */
 	interpreter_init(ctx);
 
+	return 0;
+}
+
+/* nothing below here can be removed by forget or a marker */
+static void ctx_fence(struct forth_ctx *ctx)
+{
+	ctx->dict.fence = ctx->dict.here;
+#ifdef EMFORTH_SPLIT_DICT
+	ctx->dict.names_fence = ctx->dict.names_here;
+#endif
+}
+
+int emforth_init(struct forth_ctx *ctx)
+{
+	if (ctx_init(ctx, false) != 0) {
+		return -1;
+	}
+	ctx_fence(ctx);
+
 	ctx->plat.puts("emForth initialized\n");
 
 	return 0;
 }
+
+#ifndef EMFORTH_TOKEN_THREADED
+int emforth_boot(struct forth_ctx *ctx, const void *image, size_t len)
+{
+	struct catch_frame frame;
+	stack_cell_t entry;
+
+	if (ctx_init(ctx, true) != 0) {
+		return -1;
+	}
+	if (!turnkey_load(ctx, image, len, &entry)) {
+		ctx->plat.puts("Invalid turnkey image\n");
+		return -1;
+	}
+	ctx_fence(ctx);
+
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		execute_xt(ctx, entry);
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+		print_throw(ctx, frame.code);
+	}
+	return frame.code;
+}
+#endif
+
+void emforth_deinit(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_HOSTED
+	block_cache_free(ctx);
+#endif
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_TOKEN_THREADED)
+	module_refs_free(ctx);
+#endif
+#ifdef EMFORTH_GROWABLE_DICT
+	munmap(ctx->dict.mem, DICTIONARY_RESERVE_SIZE);
+#ifdef EMFORTH_SPLIT_DICT
+	munmap(ctx->dict.names, NAME_SPACE_RESERVE_SIZE);
+#endif
+#endif
+	ctx->dict.mem = NULL;
+	ctx->dict.here = NULL;
+	ctx->dict.limit = NULL;
+	ctx->dict.end = NULL;
+}
+
+#ifdef EMFORTH_STATS
+void emforth_stats(struct forth_ctx *ctx, struct emforth_stats *stats)
+{
+	*stats = ctx->stats;
+	/* in case here was moved without dict_reserve */
+	if ((size_t)(ctx->dict.here - ctx->dict.mem) > stats->here_max) {
+		stats->here_max = ctx->dict.here - ctx->dict.mem;
+	}
+#ifdef EMFORTH_SPLIT_DICT
+	if ((size_t)(ctx->dict.names_here - ctx->dict.names) >
+	    stats->names_here_max) {
+		stats->names_here_max = ctx->dict.names_here - ctx->dict.names;
+	}
+#endif
+}
+#endif
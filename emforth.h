@@ -10,8 +10,27 @@
 #define __FORTH_EMFORTH_HEADER__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/**
+ * Hosted builds run on top of an operating system with files, mmap and the
+ * C library, and get the words that need them (include and friends). Define
+ * EMFORTH_FREESTANDING to build only the core on such a system.
+ */
+#if !defined(EMFORTH_FREESTANDING) && !defined(__EMSCRIPTEN__) &&              \
+    (defined(__unix__) || defined(__APPLE__))
+#define EMFORTH_HOSTED
+#endif
+
+/*
+ * Sandbox builds keep headers and wordlists in name space, out of reach of
+ * the stores a program makes, see dict_t.
+ */
+#if defined(EMFORTH_SANDBOX) && !defined(EMFORTH_SPLIT_DICT)
+#error "EMFORTH_SANDBOX needs EMFORTH_SPLIT_DICT"
+#endif
+
 /**
  * Dictionary:
  *
@@ -56,6 +75,13 @@
  *
  * NOTE: start of header and start of definition are sizeof(word_t) aligned.
  *
+ * NOTE: with EMFORTH_SPLIT_DICT defined, headers (link, flags and name) are
+ * allocated in a separate name space region and carry a pointer to their
+ * codeword, while definitions and data are allocated at 'here' in the code
+ * region. Wordlists are allocated in name space too. Dictionary searches
+ * then only touch name space cache lines, and threaded code is not
+ * interleaved with names and links.
+ *
  * NOTE: words here can be of two types, which are described in word_t
  * type definition. If it is a forth word, it starts with docol, and ends with
  * exit. If it is a c function, it contains the NEXT() macro as last line.
@@ -78,6 +104,34 @@ struct forth_ctx;
  */
 typedef void (*word_t)(struct forth_ctx *ctx);
 
+/**
+ * Threaded code:
+ *
+ * By default the body of a colon definition is a list of word_t cells,
+ * each either the function pointer of a primitive or the address of the
+ * codeword of another colon definition. On small targets that is several
+ * times more than needed, so with EMFORTH_TOKEN_THREADED defined each cell
+ * is a 16 bit token instead. Tokens below PRIM_TABLE_MAX index prim_table,
+ * the rest are offsets in word_t units from the start of the dictionary to
+ * the codeword of a colon definition. Literals that fit in 16 bits are
+ * compiled as lit16 followed by one token and branch offsets take one
+ * token. Codewords themselves are always a full word_t.
+ *
+ * Either way the value stored in a cell is the execution token (xt) that
+ * ' and 2dfa push and compile, appends.
+ */
+
+/*
+ * Primitives are numbered in registration order in prim_table, which gives
+ * tokens their meaning and lets saved code refer to primitives by index.
+ */
+#define PRIM_TABLE_MAX 512u
+#ifdef EMFORTH_TOKEN_THREADED
+typedef uint16_t thread_t;
+#else
+typedef word_t thread_t;
+#endif
+
 typedef union {
 	struct {
 		unsigned char immediate : 1;
@@ -96,12 +150,35 @@ typedef union {
  * definition through a pointer.
  */
 typedef struct dict_header_s {
-	struct dict_header_s *link;
+	struct dict_header_s *link;  /* previous word in the same wordlist */
+	struct dict_header_s *hlink; /* next word in the same hash bucket */
+#ifdef EMFORTH_SPLIT_DICT
+	word_t *cfa; /* codeword, kept in the code region */
+#endif
 	flag_t flags;
 } dict_header_t;
 
 #define DICT_NULL ((dict_header_t *)NULL)
 
+/**
+ * Wordlists:
+ *
+ * Every header belongs to one wordlist, and is linked both to the previous
+ * word of that wordlist (link) and to the next word in its hash bucket
+ * (hlink). Lookups only hash the name once and walk one bucket of each
+ * wordlist in the search order, so their cost does not depend on how many
+ * words other wordlists hold. Wordlists are allocated in the dictionary,
+ * the forth wordlist first of all.
+ */
+#define WORDLIST_HASH_BUCKETS 32u /* must be a power of 2 */
+#define SEARCH_ORDER_MAX 8
+
+typedef struct wordlist_s {
+	dict_header_t *latest; /* newest word, older ones follow link */
+	dict_header_t *buckets[WORDLIST_HASH_BUCKETS];
+	struct wordlist_s *prev; /* previously created wordlist */
+} wordlist_t;
+
 /*
  * Dictionary definition words are sizeof(word_t) aligned as
  * mentioned above. Use the following utility macro.
@@ -122,17 +199,181 @@ typedef struct dict_header_s {
 #define DICTIONARY_MEMORY_SIZE (stack_cell_t)(8192u)
 typedef intptr_t stack_cell_t;
 
+/**
+ * Dictionary memory:
+ *
+ * On hosts with mmap the dictionary reserves DICTIONARY_RESERVE_SIZE bytes
+ * of address space and commits it DICTIONARY_SEGMENT_SIZE bytes at a time
+ * as 'here' advances, so it stays contiguous while growing. Elsewhere, or
+ * when EMFORTH_FIXED_DICT is defined, it is a DICTIONARY_MEMORY_SIZE array
+ * inside struct forth_ctx. Either way running out of space is reported as
+ * "Dictionary full" instead of writing past the end.
+ */
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_FIXED_DICT)
+#define EMFORTH_GROWABLE_DICT
+#define DICTIONARY_SEGMENT_SIZE (64u * 1024u)
+#ifdef EMFORTH_TOKEN_THREADED
+/* codeword addresses must stay reachable by a 16 bit token */
+#define DICTIONARY_RESERVE_SIZE                                                \
+	(((0x10000u - PRIM_TABLE_MAX) * sizeof(word_t)) &                       \
+	 ~(DICTIONARY_SEGMENT_SIZE - 1))
+#else
+#define DICTIONARY_RESERVE_SIZE (64u * 1024u * 1024u)
+#endif
+#define NAME_SPACE_RESERVE_SIZE (16u * 1024u * 1024u)
+#endif
+
+/*
+ * Hosted builds keep up to BLOCK_BUFFERS blocks of BLOCK_SIZE bytes of the
+ * block file in memory, see block.c.
+ */
+#define BLOCK_SIZE 1024u
+#define BLOCK_BUFFERS 8u
+struct block_cache;
+
+/*
+ * Heap:
+ *
+ * With EMFORTH_HEAP defined, allocate, free and resize work on an arena of
+ * HEAP_SIZE bytes in struct forth_ctx, see heap.c. Requests of up to
+ * HEAP_SMALL_MAX bytes come from slabs of HEAP_PAGE_SIZE bytes, each
+ * holding objects of one size class, larger ones from a list of free
+ * chunks that are merged with their free neighbours when freed. Slabs are
+ * chunks too.
+ *
+ * Hosted builds define EMFORTH_HEAP unless EMFORTH_NO_HEAP is defined,
+ * other builds only when asked to. Sandbox builds cannot have it: chunk
+ * sizes and free lists are kept in the arena, where a program may store.
+ * HEAP_SIZE may be defined on the command line, as a multiple of
+ * HEAP_PAGE_SIZE.
+ */
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_SANDBOX) &&                   \
+    !defined(EMFORTH_NO_HEAP) && !defined(EMFORTH_HEAP)
+#define EMFORTH_HEAP
+#endif
+#if defined(EMFORTH_HEAP) && defined(EMFORTH_SANDBOX)
+#error "EMFORTH_SANDBOX cannot have EMFORTH_HEAP"
+#endif
+
+#ifdef EMFORTH_HEAP
+#ifndef HEAP_SIZE
+#ifdef EMFORTH_HOSTED
+#define HEAP_SIZE (64u * 1024u)
+#else
+#define HEAP_SIZE 4096u
+#endif
+#endif
+#define HEAP_PAGE_SIZE 512u
+#define HEAP_PAGES (HEAP_SIZE / HEAP_PAGE_SIZE)
+#define HEAP_CLASSES 4 /* objects of 16, 32, 64 and 128 bytes */
+#define HEAP_SMALL_MAX 128u
+
+struct heap_chunk;
+
+struct forth_heap {
+	stack_cell_t mem[HEAP_SIZE / sizeof(stack_cell_t)];
+
+	/* free chunks, in no particular order */
+	struct heap_chunk *free_chunks;
+
+	/* slabs, indexed by the page they start */
+	unsigned char page_class[HEAP_PAGES]; /* size class + 1, 0 if none */
+	unsigned char page_used[HEAP_PAGES];  /* objects allocated */
+	uint32_t page_live[HEAP_PAGES];	      /* bit per allocated object */
+	void *page_free[HEAP_PAGES];	      /* first free object */
+	short page_next[HEAP_PAGES];	      /* in partial, -1 ends */
+	short page_prev[HEAP_PAGES];
+
+	/* slabs of each class that have free objects, -1 if none */
+	short partial[HEAP_CLASSES];
+};
+#endif /* EMFORTH_HEAP */
+
+/*
+ * size of the fixed name space with EMFORTH_SPLIT_DICT, headers are mostly
+ * pointers so it scales with their size
+ */
+#define NAME_SPACE_SIZE (stack_cell_t)(1024u * sizeof(void *))
+
 typedef struct {
-	unsigned char mem[DICTIONARY_MEMORY_SIZE];
+#ifndef EMFORTH_GROWABLE_DICT
+	unsigned char storage[DICTIONARY_MEMORY_SIZE];
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char names_storage[NAME_SPACE_SIZE];
+#endif
+#endif
+
+	/* start of dictionary memory */
+	unsigned char *mem;
+
+	/* end of memory that can be accessed (committed) */
+	unsigned char *limit;
+
+	/* end of memory the dictionary may ever grow to */
+	unsigned char *end;
+
+#ifdef EMFORTH_SANDBOX
+	/*
+	 * @ ! c@ and c! do not check addresses, they mask their offset from
+	 * mem with this instead, so whatever a program computes they stay
+	 * inside the dictionary. limit - mem is kept a power of two for that,
+	 * DICTIONARY_MEMORY_SIZE must be one too. Cell accesses are aligned
+	 * down, and stores below fence throw, see store_ptr().
+	 */
+	uintptr_t mask;
+#endif
 
 	/* points to latest defined word header in dictionary */
 	dict_header_t *latest;
 
+	/* all wordlists, newest first, and the one new words are added to */
+	wordlist_t *wordlists;
+	wordlist_t *current;
+	wordlist_t *forth_wordlist;
+
+	/* search order, order[0] is searched first */
+	wordlist_t *order[SEARCH_ORDER_MAX];
+	stack_cell_t order_len;
+
 	/* points to next free byte in the dictionary */
 	unsigned char *here;
+
+	/* everything below this was defined by emforth_init, and cannot be
+	 * removed by forget or a marker */
+	unsigned char *fence;
+
+#ifdef EMFORTH_HEAP
+	/* heap of the context, which @ ! and friends may access as well */
+	struct forth_heap *heap;
+#endif
+
+	/* booted from a turnkey image, builtins get no headers */
+	bool headerless;
+
+#ifdef EMFORTH_HOSTED
+	/* buffers of block.c, which @ ! and friends may access as well */
+	struct block_cache *blocks;
+#endif
+
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_TOKEN_THREADED)
+	/* calls of loaded modules to words not defined yet, see module.c */
+	struct module_ref *module_refs;
+#endif
+
+#ifdef EMFORTH_SPLIT_DICT
+	/* name space region for headers, same meaning as the fields above */
+	unsigned char *names;
+	unsigned char *names_limit;
+	unsigned char *names_end;
+	unsigned char *names_here;
+	unsigned char *names_fence;
+#endif
 } dict_t;
 
-/* platform dependent interface that application must provide */
+/*
+ * platform dependent interface that application must provide, getchar may
+ * be NULL when input is passed to emforth_feed instead.
+ */
 struct platform_s {
 	int (*puts)(const char *); /* print string */
 	int (*getchar)();	   /* get input key */
@@ -149,30 +390,112 @@ typedef enum { MODE_IMMEDIATE = 0, MODE_COMPILE = 1 } mode_e;
 
 #define MAX_INPUT_LEN (WORD_NAME_MAX_LEN * 10)
 
+/* pictured numeric output buffer, fits a cell in binary and a sign */
+#define HOLD_BUFFER_SIZE (sizeof(stack_cell_t) * 8 + sizeof(stack_cell_t))
+
+/* a buffer being interpreted by include or evaluate */
+struct input_source {
+	const char *buf;
+	size_t len;
+	size_t pos;
+};
+
+#define INPUT_SOURCE_MAX 8
+
+/* locals of the definition being compiled, declared with {: */
+#define LOCALS_MAX 16
+
+struct local_name {
+	char name[WORD_NAME_MAX_LEN + 1];
+	unsigned char len;
+};
+
+/* literals the compiler keeps track of for folding, see fold_xt */
+#define FOLD_LITS_MAX 8
+
+/* input buffered by emforth_feed, at least one line must fit */
+#define INPUT_FEED_SIZE 1024
+
 struct interpreter_data {
 	mode_e mode;	 /* interpreter or compiler mode*/
 	bool in_comment; /* true when processing backslash comment until newline
 			  */
+	stack_cell_t *base; /* number conversion radix, a dictionary cell */
+	char *hold_end;	    /* end of the pictured output buffer */
+	char *hld;	    /* first character of pictured output so far */
+
+	/* nested input sources, input comes from plat.getchar when 0 */
+	struct input_source sources[INPUT_SOURCE_MAX];
+	int source_depth;
+	int last_char; /* last read from plat.getchar or the feed */
+	size_t budget; /* cells emforth_step may still run, else SIZE_MAX */
+
+	struct local_name locals[LOCALS_MAX];
+	int locals_count;
+
+	/* literals compiled last, stale unless here is still fold_end */
+	thread_t *fold_lits[FOLD_LITS_MAX];
+	int fold_count;
+	unsigned char *fold_end;
+	bool fold_0branch; /* a 0branch follows them, see >mark */
+	thread_t fold_dead; /* what >resolve fills in for removed branches */
+
+	/* input handed over by emforth_feed, used when plat.getchar is NULL */
+	char feed[INPUT_FEED_SIZE];
+	size_t feed_len;   /* bytes in feed */
+	size_t feed_pos;   /* next byte to read */
+	size_t feed_avail; /* end of the last complete line */
+	bool feed_end;	   /* the host will not feed more input */
 };
 
+/*
+ * With EMFORTH_STATS defined, contexts record the most their stacks and
+ * dictionary ever held, to size STACK_SIZE_MAX, RSTACK_SIZE_MAX and
+ * DICTIONARY_MEMORY_SIZE by. Hosts read them with emforth_stats, .mem
+ * prints them along with what each word takes.
+ */
+#ifdef EMFORTH_STATS
+struct emforth_stats {
+	stack_cell_t sp_max;  /* data stack cells */
+	stack_cell_t rsp_max; /* return stack cells, locals included */
+	size_t here_max;      /* dictionary bytes from mem */
+#ifdef EMFORTH_SPLIT_DICT
+	size_t names_here_max; /* name space bytes from names */
+#endif
+};
+#endif
+
 struct forth_ctx {
 	/* dictionary related state */
 	dict_t dict;
 
 	/* stacks */
 	stack_cell_t stack[STACK_SIZE_MAX];
-	word_t *rstack[RSTACK_SIZE_MAX];
+	thread_t *rstack[RSTACK_SIZE_MAX];
 	stack_cell_t sp;  /* stack pointer - current insert position */
 	stack_cell_t rsp; /* return stack pointer - current insert position*/
+	stack_cell_t fp;  /* rstack index of the innermost locals frame */
+
+	thread_t *ip; /* this is pointing to a cell in the definition */
+	word_t *w;    /* codeword of the current word being executed */
+
+	/* innermost catch, see struct catch_frame in builtins_common.h */
+	struct catch_frame *catch_frame;
 
-	word_t *ip; /* this is pointing to a word_t in the definition */
-	word_t *w;  /* current word being executed */
+#ifdef EMFORTH_HEAP
+	/* memory for allocate, see dict.heap */
+	struct forth_heap heap;
+#endif
 
 	/* interpreter data */
 	struct interpreter_data intrp_data;
 
 	/* platform specific data */
 	struct platform_s plat;
+
+#ifdef EMFORTH_STATS
+	struct emforth_stats stats;
+#endif
 };
 
 /**
@@ -182,6 +505,31 @@ struct forth_ctx {
  */
 int emforth_init(struct forth_ctx *ctx);
 
+#ifndef EMFORTH_TOKEN_THREADED
+/**
+ * @brief Initialize state without headers, load a turnkey image made by
+ * the turnkey word and run its entry word.
+ * @param ctx valid pointer to struct forth_ctx.
+ * @param image the image, which need not be aligned.
+ * @returns 0 when the entry word returned, what it threw if it threw, or
+ * -1 when the image cannot be loaded.
+ */
+int emforth_boot(struct forth_ctx *ctx, const void *image, size_t len);
+#endif
+
+/**
+ * @brief Release memory held by a context initialized with emforth_init.
+ * @param ctx valid pointer to struct forth_ctx.
+ */
+void emforth_deinit(struct forth_ctx *ctx);
+
+#ifdef EMFORTH_STATS
+/**
+ * @brief Copy the high-water marks of a context to stats.
+ */
+void emforth_stats(struct forth_ctx *ctx, struct emforth_stats *stats);
+#endif
+
 /**
  * @brief The interpreter loop
  *
@@ -191,4 +539,38 @@ int emforth_init(struct forth_ctx *ctx);
  */
 int outer_interpreter(struct forth_ctx *ctx);
 
+/**
+ * Non-blocking embedding:
+ *
+ * Hosts with their own event loop set plat.getchar to NULL, hand input
+ * over with emforth_feed and call emforth_step to interpret it. Each step
+ * runs at most 'budget' instructions (tokens interpreted and threaded
+ * cells executed) and then returns, leaving a running colon definition
+ * suspended in ip and the return stack to be continued by the next step.
+ * What execute and catch run cannot be suspended, it throws -28 when it
+ * uses up the budget. Input is interpreted a complete line at a time.
+ */
+typedef enum {
+	EMFORTH_NEEDS_INPUT = 0,     /* all complete lines were interpreted */
+	EMFORTH_BUDGET_EXHAUSTED, /* call emforth_step again */
+	EMFORTH_DONE,		     /* input ended with emforth_feed_end */
+} emforth_status_e;
+
+/**
+ * @brief Buffer input for emforth_step.
+ * @return number of bytes accepted, less than len when the buffer is full.
+ */
+size_t emforth_feed(struct forth_ctx *ctx, const char *buf, size_t len);
+
+/**
+ * @brief Mark the end of input, a last line without newline is then
+ * interpreted too.
+ */
+void emforth_feed_end(struct forth_ctx *ctx);
+
+/**
+ * @brief Interpret fed input for at most budget instructions.
+ */
+emforth_status_e emforth_step(struct forth_ctx *ctx, size_t budget);
+
 #endif /* __FORTH_EMFORTH_HEADER__ */
@@ -0,0 +1,571 @@
+/**
+ * @file heap.c
+ *
+ * @brief The memory allocation word set: allocate, free and resize, on an
+ * arena of HEAP_SIZE bytes in struct forth_ctx, in EMFORTH_HEAP builds. No
+ * libc malloc is used, so this works in freestanding builds as well.
+ *
+ * The arena is split into chunks, each starting and ending with a cell
+ * holding its size, with the low bit set while it is allocated. Free
+ * chunks are kept on a list and allocated first fit, splitting off what is
+ * not needed. Thanks to the size at both ends a freed chunk is merged with
+ * free neighbours on either side in constant time.
+ *
+ * Requests of up to HEAP_SMALL_MAX bytes are rounded up to a size class
+ * and served from slabs: chunks of exactly one page of HEAP_PAGE_SIZE
+ * bytes, aligned to the page, holding objects of one class on a free list
+ * of their own. The page of an address finds its slab, so allocating and
+ * freeing a small object is constant time. An empty slab goes back to the
+ * chunks unless it is the last one of its class with free objects.
+ *
+ * @ ! and friends accept addresses in the heap, see addr_valid. The heap is
+ * not locked, so the heap words throw inside par.c tasks.
+ */
+#include <string.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+#include "heap.h"
+
+#ifdef EMFORTH_HEAP
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define HEAP_CELL sizeof(stack_cell_t)
+#define CHUNK_USED ((size_t)1)
+/* size, next, prev and the size again */
+#define CHUNK_MIN (4 * HEAP_CELL)
+
+struct heap_chunk {
+	size_t size; /* in bytes, including both size cells, | CHUNK_USED */
+	/* only while free */
+	struct heap_chunk *next;
+	struct heap_chunk *prev;
+};
+
+/* what .heap reports */
+struct heap_stats {
+	size_t used;	     /* bytes handed out */
+	size_t free;	     /* bytes in free chunks */
+	size_t largest;	     /* largest free chunk */
+	size_t free_chunks;
+	size_t large;	     /* chunks handed out */
+	size_t slabs[HEAP_CLASSES];
+	size_t objects[HEAP_CLASSES]; /* handed out */
+	size_t capacity[HEAP_CLASSES];
+};
+
+static unsigned char *heap_start(struct forth_heap *h)
+{
+	return (unsigned char *)h->mem;
+}
+
+static unsigned char *heap_end(struct forth_heap *h)
+{
+	return (unsigned char *)h->mem + HEAP_SIZE;
+}
+
+static size_t class_size(int cls)
+{
+	return (size_t)16 << cls;
+}
+
+static size_t class_objects(int cls)
+{
+	return (HEAP_PAGE_SIZE - 2 * HEAP_CELL) / class_size(cls);
+}
+
+/* == chunks == */
+
+static size_t chunk_size(struct heap_chunk *c)
+{
+	return c->size & ~CHUNK_USED;
+}
+
+static void chunk_set(struct heap_chunk *c, size_t size, size_t used)
+{
+	c->size = size | used;
+	*(size_t *)((unsigned char *)c + size - HEAP_CELL) = size | used;
+}
+
+static void chunk_link(struct forth_heap *h, struct heap_chunk *c)
+{
+	c->prev = NULL;
+	c->next = h->free_chunks;
+	if (c->next != NULL) {
+		c->next->prev = c;
+	}
+	h->free_chunks = c;
+}
+
+static void chunk_unlink(struct forth_heap *h, struct heap_chunk *c)
+{
+	if (c->prev != NULL) {
+		c->prev->next = c->next;
+	} else {
+		h->free_chunks = c->next;
+	}
+	if (c->next != NULL) {
+		c->next->prev = c->prev;
+	}
+}
+
+/*
+ * Frees size bytes at p, merged with the free chunks next to them. The
+ * sizes where they meet are cleared, so that freeing the same address
+ * twice is noticed.
+ */
+static void chunk_release(struct forth_heap *h, unsigned char *p, size_t size)
+{
+	if (p + size < heap_end(h)) {
+		struct heap_chunk *next = (struct heap_chunk *)(p + size);
+
+		if ((next->size & CHUNK_USED) == 0) {
+			chunk_unlink(h, next);
+			size += next->size;
+			next->size = 0;
+		}
+	}
+	if (p > heap_start(h)) {
+		size_t prev = *(size_t *)(p - HEAP_CELL);
+
+		if ((prev & CHUNK_USED) == 0) {
+			*(size_t *)(p - HEAP_CELL) = 0;
+			((struct heap_chunk *)p)->size = 0;
+			p -= prev;
+			chunk_unlink(h, (struct heap_chunk *)p);
+			size += prev;
+		}
+	}
+	chunk_set((struct heap_chunk *)p, size, 0);
+	chunk_link(h, (struct heap_chunk *)p);
+}
+
+/* chunk size for n bytes of payload, 0 if it cannot fit */
+static size_t chunk_need(size_t n)
+{
+	if (n > HEAP_SIZE) {
+		return 0;
+	}
+	n = (n + 2 * HEAP_CELL + HEAP_CELL - 1) & ~(HEAP_CELL - 1);
+	return n < CHUNK_MIN ? CHUNK_MIN : n;
+}
+
+/* makes c an allocated chunk of need bytes, freeing the rest of size */
+static void chunk_trim(struct forth_heap *h, struct heap_chunk *c,
+		       size_t size, size_t need)
+{
+	if (size - need >= CHUNK_MIN) {
+		chunk_set(c, need, CHUNK_USED);
+		chunk_release(h, (unsigned char *)c + need, size - need);
+	} else {
+		chunk_set(c, size, CHUNK_USED);
+	}
+}
+
+static void *chunk_alloc(struct forth_heap *h, size_t n)
+{
+	size_t need = chunk_need(n);
+
+	if (need == 0) {
+		return NULL;
+	}
+	for (struct heap_chunk *c = h->free_chunks; c != NULL; c = c->next) {
+		if (c->size >= need) {
+			chunk_unlink(h, c);
+			chunk_trim(h, c, c->size, need);
+			return (unsigned char *)c + HEAP_CELL;
+		}
+	}
+	return NULL;
+}
+
+/* == slabs == */
+
+static unsigned char *page_addr(struct forth_heap *h, int pg)
+{
+	return heap_start(h) + (size_t)pg * HEAP_PAGE_SIZE;
+}
+
+static void partial_push(struct forth_heap *h, int cls, int pg)
+{
+	h->page_prev[pg] = -1;
+	h->page_next[pg] = h->partial[cls];
+	if (h->partial[cls] >= 0) {
+		h->page_prev[h->partial[cls]] = pg;
+	}
+	h->partial[cls] = pg;
+}
+
+static void partial_remove(struct forth_heap *h, int cls, int pg)
+{
+	if (h->page_prev[pg] >= 0) {
+		h->page_next[h->page_prev[pg]] = h->page_next[pg];
+	} else {
+		h->partial[cls] = h->page_next[pg];
+	}
+	if (h->page_next[pg] >= 0) {
+		h->page_prev[h->page_next[pg]] = h->page_prev[pg];
+	}
+}
+
+/*
+ * Carves a page out of a free chunk for a new slab of class cls, leaving
+ * no gap before or after it that is too small to be a chunk. Returns the
+ * page, or -1 when no free chunk has room.
+ */
+static int slab_new(struct forth_heap *h, int cls)
+{
+	size_t sz = class_size(cls), count = class_objects(cls);
+
+	for (struct heap_chunk *c = h->free_chunks; c != NULL; c = c->next) {
+		unsigned char *s = (unsigned char *)c, *e = s + c->size;
+		size_t off = s - heap_start(h);
+		unsigned char *p = heap_start(h) +
+				   ((off + HEAP_PAGE_SIZE - 1) &
+				    ~(size_t)(HEAP_PAGE_SIZE - 1));
+
+		for (; p + HEAP_PAGE_SIZE <= e; p += HEAP_PAGE_SIZE) {
+			size_t lead = p - s, trail = e - (p + HEAP_PAGE_SIZE);
+			unsigned char *obj = p + HEAP_CELL;
+			int pg = (p - heap_start(h)) / HEAP_PAGE_SIZE;
+
+			if ((lead != 0 && lead < CHUNK_MIN) ||
+			    (trail != 0 && trail < CHUNK_MIN)) {
+				continue;
+			}
+
+			chunk_unlink(h, c);
+			if (lead != 0) {
+				chunk_set(c, lead, 0);
+				chunk_link(h, c);
+			}
+			if (trail != 0) {
+				chunk_set((struct heap_chunk *)(e - trail), trail,
+					  0);
+				chunk_link(h, (struct heap_chunk *)(e - trail));
+			}
+			chunk_set((struct heap_chunk *)p, HEAP_PAGE_SIZE,
+				  CHUNK_USED);
+
+			for (size_t i = 0; i < count; i++) {
+				*(void **)(obj + i * sz) =
+				    i + 1 < count ? obj + (i + 1) * sz : NULL;
+			}
+			h->page_class[pg] = cls + 1;
+			h->page_used[pg] = 0;
+			h->page_live[pg] = 0;
+			h->page_free[pg] = obj;
+			partial_push(h, cls, pg);
+			return pg;
+		}
+	}
+	return -1;
+}
+
+static void *slab_alloc(struct forth_heap *h, int cls)
+{
+	int pg = h->partial[cls];
+	unsigned char *obj;
+
+	if (pg < 0 && (pg = slab_new(h, cls)) < 0) {
+		return NULL;
+	}
+	obj = h->page_free[pg];
+	h->page_free[pg] = *(void **)obj;
+	h->page_live[pg] |= (uint32_t)1
+			    << ((obj - page_addr(h, pg) - HEAP_CELL) /
+				class_size(cls));
+	h->page_used[pg]++;
+	if (h->page_free[pg] == NULL) {
+		partial_remove(h, cls, pg);
+	}
+	return obj;
+}
+
+static void slab_free(struct forth_heap *h, int pg, unsigned char *obj)
+{
+	int cls = h->page_class[pg] - 1;
+
+	h->page_live[pg] &= ~((uint32_t)1
+			      << ((obj - page_addr(h, pg) - HEAP_CELL) /
+				  class_size(cls)));
+	if (h->page_free[pg] == NULL) {
+		partial_push(h, cls, pg);
+	}
+	*(void **)obj = h->page_free[pg];
+	h->page_free[pg] = obj;
+	h->page_used[pg]--;
+
+	/* keep one slab with free objects around, to not thrash */
+	if (h->page_used[pg] == 0 &&
+	    (h->partial[cls] != pg || h->page_next[pg] >= 0)) {
+		partial_remove(h, cls, pg);
+		h->page_class[pg] = 0;
+		chunk_release(h, page_addr(h, pg), HEAP_PAGE_SIZE);
+	}
+}
+
+/* == allocator == */
+
+static void heap_init(struct forth_heap *h)
+{
+	memset(h->page_class, 0, sizeof(h->page_class));
+	for (int i = 0; i < HEAP_CLASSES; i++) {
+		h->partial[i] = -1;
+	}
+	h->free_chunks = NULL;
+	chunk_set((struct heap_chunk *)h->mem, HEAP_SIZE, 0);
+	chunk_link(h, (struct heap_chunk *)h->mem);
+}
+
+static void *heap_alloc(struct forth_heap *h, size_t n)
+{
+	if (n <= HEAP_SMALL_MAX) {
+		int cls = 0;
+		void *p;
+
+		while (class_size(cls) < n) {
+			cls++;
+		}
+		p = slab_alloc(h, cls);
+		if (p != NULL) {
+			return p;
+		}
+	}
+	return chunk_alloc(h, n);
+}
+
+/*
+ * Bytes usable at p if allocate handed it out and it was not freed since,
+ * 0 otherwise. Sets *pg to the page of its slab, or -1 if it is a chunk.
+ */
+static size_t heap_block(struct forth_heap *h, unsigned char *p, int *pg)
+{
+	struct heap_chunk *c = (struct heap_chunk *)(p - HEAP_CELL);
+	size_t off = p - heap_start(h), size;
+
+	if (p < heap_start(h) + HEAP_CELL || p >= heap_end(h) ||
+	    off % HEAP_CELL != 0) {
+		return 0;
+	}
+
+	*pg = off / HEAP_PAGE_SIZE;
+	if (h->page_class[*pg] != 0) {
+		int cls = h->page_class[*pg] - 1;
+		size_t at = off - (size_t)*pg * HEAP_PAGE_SIZE - HEAP_CELL;
+
+		if (at % class_size(cls) != 0 ||
+		    at / class_size(cls) >= class_objects(cls) ||
+		    (h->page_live[*pg] &
+		     ((uint32_t)1 << (at / class_size(cls)))) == 0) {
+			return 0;
+		}
+		return class_size(cls);
+	}
+
+	*pg = -1;
+	size = chunk_size(c);
+	if ((c->size & CHUNK_USED) == 0 || size < CHUNK_MIN ||
+	    size % HEAP_CELL != 0 ||
+	    size > (size_t)(heap_end(h) - (unsigned char *)c) ||
+	    *(size_t *)((unsigned char *)c + size - HEAP_CELL) != c->size) {
+		return 0;
+	}
+	return size - 2 * HEAP_CELL;
+}
+
+static bool heap_free(struct forth_heap *h, unsigned char *p)
+{
+	int pg;
+
+	if (heap_block(h, p, &pg) == 0) {
+		return false;
+	}
+	if (pg >= 0) {
+		slab_free(h, pg, p);
+	} else {
+		chunk_release(h, p - HEAP_CELL,
+			      chunk_size((struct heap_chunk *)(p - HEAP_CELL)));
+	}
+	return true;
+}
+
+/*
+ * Resizes the block at p to n bytes, in place if it can, else by moving
+ * it. Returns the block, or NULL if p is not a block or there is no room,
+ * in which case p is left as it was.
+ */
+static void *heap_resize(struct forth_heap *h, unsigned char *p, size_t n)
+{
+	int pg;
+	size_t cap = heap_block(h, p, &pg);
+	unsigned char *q;
+
+	if (cap == 0) {
+		return NULL;
+	}
+	if (pg >= 0 && n <= cap) {
+		return p;
+	}
+	if (pg < 0) {
+		struct heap_chunk *c = (struct heap_chunk *)(p - HEAP_CELL);
+		struct heap_chunk *next =
+		    (struct heap_chunk *)((unsigned char *)c + chunk_size(c));
+		size_t size = chunk_size(c), need = chunk_need(n);
+
+		if (need == 0) {
+			return NULL;
+		}
+		if (need <= size) {
+			chunk_trim(h, c, size, need);
+			return p;
+		}
+		if ((unsigned char *)next < heap_end(h) &&
+		    (next->size & CHUNK_USED) == 0 &&
+		    size + next->size >= need) {
+			chunk_unlink(h, next);
+			chunk_trim(h, c, size + next->size, need);
+			return p;
+		}
+	}
+
+	q = heap_alloc(h, n);
+	if (q == NULL) {
+		return NULL;
+	}
+	memcpy(q, p, n < cap ? n : cap);
+	heap_free(h, p);
+	return q;
+}
+
+static void heap_stats(struct forth_heap *h, struct heap_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (unsigned char *p = heap_start(h); p < heap_end(h);) {
+		struct heap_chunk *c = (struct heap_chunk *)p;
+		size_t size = chunk_size(c);
+		int pg = (p - heap_start(h)) / HEAP_PAGE_SIZE;
+
+		if ((c->size & CHUNK_USED) == 0) {
+			st->free += size;
+			st->free_chunks++;
+			if (size > st->largest) {
+				st->largest = size;
+			}
+		} else if (h->page_class[pg] != 0) {
+			int cls = h->page_class[pg] - 1;
+
+			st->slabs[cls]++;
+			st->objects[cls] += h->page_used[pg];
+			st->capacity[cls] += class_objects(cls);
+			st->used += h->page_used[pg] * class_size(cls);
+		} else {
+			st->large++;
+			st->used += size - 2 * HEAP_CELL;
+		}
+		p += size;
+	}
+}
+
+/* == words == */
+
+static struct forth_heap *heap_get(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_HOSTED
+	/* the heap is shared with tasks, and not locked */
+	par_task_check(ctx);
+#endif
+	if (ctx->dict.heap == NULL) {
+		forth_throw(ctx, THROW_ALLOCATE);
+	}
+	return ctx->dict.heap;
+}
+
+/**
+ * @brief ( u -- a-addr ior ) allocates u bytes of heap, ior is 0 on success
+ */
+void do_allocate(struct forth_ctx *ctx)
+{
+	stack_cell_t u = stack_pop(ctx);
+	void *p = u < 0 ? NULL : heap_alloc(heap_get(ctx), u);
+
+	stack_push(ctx, (stack_cell_t)p);
+	stack_push(ctx, p != NULL ? 0 : THROW_ALLOCATE);
+}
+
+/**
+ * @brief ( a-addr -- ior ) returns the bytes at a-addr, which allocate or
+ * resize handed out, to the heap
+ */
+void do_free(struct forth_ctx *ctx)
+{
+	unsigned char *p = (unsigned char *)stack_pop(ctx);
+
+	stack_push(ctx, heap_free(heap_get(ctx), p) ? 0 : THROW_FREE);
+}
+
+/**
+ * @brief ( a-addr1 u -- a-addr2 ior ) changes the size of the heap block at
+ * a-addr1 to u bytes, moving it when it cannot grow in place. On failure
+ * a-addr2 is a-addr1, which is left as it was.
+ */
+void do_resize(struct forth_ctx *ctx)
+{
+	stack_cell_t u = stack_pop(ctx);
+	unsigned char *p = (unsigned char *)stack_pop(ctx);
+	void *q = u < 0 ? NULL : heap_resize(heap_get(ctx), p, u);
+
+	stack_push(ctx, q != NULL ? (stack_cell_t)q : (stack_cell_t)p);
+	stack_push(ctx, q != NULL ? 0 : THROW_RESIZE);
+}
+
+/**
+ * @brief ( -- ) prints how much of the heap is in use, how much is free
+ * and in how many pieces, and the slabs of each size class
+ */
+void do_dot_heap(struct forth_ctx *ctx)
+{
+	struct heap_stats st;
+
+	heap_stats(heap_get(ctx), &st);
+	print_usage(ctx, "heap: ", st.used, HEAP_SIZE, "bytes used, ");
+	print_number(ctx, st.large, false, 0, true);
+	ctx->plat.puts("large blocks\n");
+	print_number(ctx, st.free, false, 0, true);
+	ctx->plat.puts("bytes free in ");
+	print_number(ctx, st.free_chunks, false, 0, true);
+	ctx->plat.puts("chunks, largest ");
+	print_number(ctx, st.largest, false, 0, true);
+	ctx->plat.puts("bytes, fragmentation ");
+	print_number(ctx, st.free ? 100 - st.largest * 100 / st.free : 0,
+		     false, 0, false);
+	ctx->plat.puts("%\n");
+	ctx->plat.puts("class slabs objects\n");
+	for (int cls = 0; cls < HEAP_CLASSES; cls++) {
+		print_number(ctx, class_size(cls), false, 5, true);
+		print_number(ctx, st.slabs[cls], false, 5, true);
+		print_number(ctx, st.objects[cls], false, 7, false);
+		ctx->plat.puts("/");
+		print_number(ctx, st.capacity[cls], false, 0, false);
+		ctx->plat.puts("\n");
+	}
+}
+
+static const struct bultin_entry heap_builtin_table[] = {
+    {.word = "allocate", .c_func = do_allocate, .flags = {}},
+    {.word = "free", .c_func = do_free, .flags = {}},
+    {.word = "resize", .c_func = do_resize, .flags = {}},
+    {.word = ".heap", .c_func = do_dot_heap, .flags = {}},
+};
+
+int heap_builtins_init(struct forth_ctx *ctx)
+{
+	heap_init(&ctx->heap);
+	ctx->dict.heap = &ctx->heap;
+	return builtins_register(ctx, heap_builtin_table,
+				 ARRAY_SIZE(heap_builtin_table));
+}
+
+#endif /* EMFORTH_HEAP */
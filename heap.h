@@ -0,0 +1,19 @@
+/**
+ * @file heap.h
+ *
+ * @brief The memory allocation word set: allocate, free and resize.
+ */
+
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HEAP
+/**
+ * @brief empties the heap of ctx and registers the heap words.
+ */
+int heap_builtins_init(struct forth_ctx *ctx);
+#endif
+
+#endif /* __HEAP_H__ */
@@ -0,0 +1,755 @@
+/**
+ * @file image.c
+ *
+ * @brief include, and the compiled source cache behind it.
+ *
+ * When the EMFORTH_CACHE_DIR environment variable names a directory,
+ * include looks up the result of compiling a file there before
+ * interpreting it. The cache key is a hash of this build, the file
+ * contents and the dictionary the file is compiled on top of, so a hit
+ * can only replay a compile that would have produced the same result.
+ *
+ * An entry holds the bytes the file appended to the dictionary, plus a
+ * list of cells to patch: pointers into the dictionary, name space and
+ * primitives found in the new bytes, cells below the old 'here' that the
+ * file changed (wordlist chains, variables) and the dictionary state such
+ * as latest and the search order. Pointers are stored as region offsets
+ * or primitive indices, so an entry stays valid when the dictionary is
+ * mapped at a different address.
+ *
+ * Files are only cached when interpreting them left no trace outside the
+ * dictionary: no output, the data stack unchanged, no definition left
+ * open and the heap and block buffers as they were. Anything else, an
+ * error message for example, is interpreted every time. Only cell aligned
+ * pointers are relocated.
+ */
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "block.h"
+#include "emforth.h"
+#include "image.h"
+
+#ifdef EMFORTH_HOSTED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+/*
+ * Literal cells in token threaded code are only token aligned, pointers in
+ * them could not be found for relocation, so files are always interpreted.
+ */
+#ifndef EMFORTH_TOKEN_THREADED
+#define IMAGE_SOURCE_CACHE
+#endif
+
+#ifdef IMAGE_SOURCE_CACHE
+/* changes whenever any object is rebuilt, see the Makefile */
+static const char build_id[] = __DATE__ " " __TIME__;
+
+#define CACHE_MAGIC "EMFCACHE"
+#define CACHE_VERSION 1u
+
+#define FNV64_OFFSET 0xcbf29ce484222325ull
+#define FNV64_PRIME 0x100000001b3ull
+
+enum cache_region { REGION_CODE, REGION_NAMES, REGION_STATE };
+
+/* how a cell value is stored in an entry */
+enum cache_kind { KIND_RAW, KIND_CODE, KIND_NAMES, KIND_PRIM };
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t cell_size;
+	uint64_t key;
+	uint64_t code_start; /* offsets of the stored bytes in their region */
+	uint64_t code_len;
+	uint64_t names_start;
+	uint64_t names_len;
+	uint64_t patch_count;
+};
+
+struct cache_patch {
+	uint32_t region;
+	uint32_t kind;
+	uint64_t offset; /* byte offset in region, or state slot */
+	uint64_t value;
+};
+
+/* dictionary state saved with every entry, see state_slot() */
+#define STATE_SLOTS (4 + SEARCH_ORDER_MAX)
+
+struct cache_snapshot {
+	unsigned char *code_start;
+	unsigned char *code; /* copy of [mem, code_start) */
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char *names_start;
+	unsigned char *names; /* copy of [names, names_start) */
+#endif
+	stack_cell_t sp;
+	stack_cell_t stack[STACK_SIZE_MAX];
+#ifdef EMFORTH_HEAP
+	struct forth_heap *heap; /* copy of the heap */
+#endif
+	void *blocks; /* copy of the block cache, NULL while there is none */
+};
+
+struct patch_list {
+	struct cache_patch *p;
+	size_t n;
+	size_t cap;
+};
+
+/* bounds of primitive function addresses, to skip most prim_index calls */
+static uintptr_t prim_lo, prim_hi;
+
+/* plat.puts while a file is being compiled for the cache */
+static int (*cache_saved_puts)(const char *);
+static bool cache_output;
+static bool cache_recording;
+
+static uint64_t fnv64(uint64_t h, const void *p, size_t n)
+{
+	const unsigned char *b = p;
+
+	for (size_t i = 0; i < n; i++) {
+		h = (h ^ b[i]) * FNV64_PRIME;
+	}
+	return h;
+}
+
+static void prim_bounds(void)
+{
+	prim_lo = UINTPTR_MAX;
+	prim_hi = 0;
+	for (unsigned int i = 0; i < prim_count; i++) {
+		uintptr_t p = (uintptr_t)prim_table[i];
+
+		prim_lo = p < prim_lo ? p : prim_lo;
+		prim_hi = p > prim_hi ? p : prim_hi;
+	}
+}
+
+/* cell sized fields of dict_t that an entry restores */
+static void *state_slot(dict_t *d, unsigned int i)
+{
+	switch (i) {
+	case 0:
+		return &d->latest;
+	case 1:
+		return &d->current;
+	case 2:
+		return &d->wordlists;
+	case 3:
+		return &d->order_len;
+	default:
+		return &d->order[i - 4];
+	}
+}
+
+/**
+ * @brief classifies a cell value, storing its address independent form
+ */
+static uint32_t cache_normalize(struct forth_ctx *ctx, uintptr_t v,
+				uint64_t *out)
+{
+	dict_t *d = &ctx->dict;
+
+	if (v >= (uintptr_t)d->mem && v <= (uintptr_t)d->end) {
+		*out = v - (uintptr_t)d->mem;
+		return KIND_CODE;
+	}
+#ifdef EMFORTH_SPLIT_DICT
+	if (v >= (uintptr_t)d->names && v <= (uintptr_t)d->names_end) {
+		*out = v - (uintptr_t)d->names;
+		return KIND_NAMES;
+	}
+#endif
+	if (v >= prim_lo && v <= prim_hi) {
+		unsigned int i = prim_index((word_t)v);
+
+		if (i < prim_count) {
+			*out = i;
+			return KIND_PRIM;
+		}
+	}
+	*out = v;
+	return KIND_RAW;
+}
+
+static bool cache_denormalize(struct forth_ctx *ctx, uint32_t kind,
+			      uint64_t v, uintptr_t *out)
+{
+	dict_t *d = &ctx->dict;
+
+	switch (kind) {
+	case KIND_RAW:
+		*out = v;
+		return true;
+	case KIND_CODE:
+		*out = (uintptr_t)d->mem + v;
+		return v <= (uint64_t)(d->end - d->mem);
+#ifdef EMFORTH_SPLIT_DICT
+	case KIND_NAMES:
+		*out = (uintptr_t)d->names + v;
+		return v <= (uint64_t)(d->names_end - d->names);
+#endif
+	case KIND_PRIM:
+		*out = v < prim_count ? (uintptr_t)prim_table[v] : 0;
+		return v < prim_count;
+	}
+	return false;
+}
+
+/* the hold buffer is scratch space, its contents must not affect keys */
+static bool cache_skip(struct forth_ctx *ctx, const unsigned char *p)
+{
+	const unsigned char *end =
+	    (const unsigned char *)ctx->intrp_data.hold_end;
+
+	return p >= end - HOLD_BUFFER_SIZE && p < end;
+}
+
+static uint64_t cache_hash_region(struct forth_ctx *ctx, uint64_t h,
+				  const unsigned char *p,
+				  const unsigned char *end)
+{
+	for (; p + sizeof(uintptr_t) <= end; p += sizeof(uintptr_t)) {
+		uintptr_t v;
+		uint64_t norm;
+		uint32_t kind;
+
+		if (cache_skip(ctx, p)) {
+			continue;
+		}
+		memcpy(&v, p, sizeof(v));
+		kind = cache_normalize(ctx, v, &norm);
+		h = fnv64(h, &kind, sizeof(kind));
+		h = fnv64(h, &norm, sizeof(norm));
+	}
+	return fnv64(h, p, end - p);
+}
+
+static uint64_t cache_key(struct forth_ctx *ctx, const char *src, size_t len)
+{
+	dict_t *d = &ctx->dict;
+	uint64_t h = fnv64(FNV64_OFFSET, build_id, sizeof(build_id));
+	uint64_t offset;
+
+	h = fnv64(h, src, len);
+	h = cache_hash_region(ctx, h, d->mem, d->here);
+	offset = d->here - d->mem;
+	h = fnv64(h, &offset, sizeof(offset));
+#ifdef EMFORTH_SPLIT_DICT
+	h = cache_hash_region(ctx, h, d->names, d->names_here);
+	offset = d->names_here - d->names;
+	h = fnv64(h, &offset, sizeof(offset));
+#endif
+	for (unsigned int i = 0; i < STATE_SLOTS; i++) {
+		h = cache_hash_region(ctx, h, state_slot(d, i),
+				      (unsigned char *)state_slot(d, i) +
+					  sizeof(uintptr_t));
+	}
+	return h;
+}
+
+/* stored bytes start at the cell holding the old 'here' */
+static unsigned char *cell_floor(unsigned char *base, unsigned char *p)
+{
+	return base + ((size_t)(p - base) & ~(sizeof(uintptr_t) - 1));
+}
+
+static int patch_add(struct patch_list *l, uint32_t region, uint32_t kind,
+		     uint64_t offset, uint64_t value)
+{
+	if (l->n == l->cap) {
+		size_t cap = l->cap ? l->cap * 2 : 64;
+		struct cache_patch *p = realloc(l->p, cap * sizeof(*p));
+
+		if (p == NULL) {
+			return -1;
+		}
+		l->p = p;
+		l->cap = cap;
+	}
+	l->p[l->n++] = (struct cache_patch){region, kind, offset, value};
+	return 0;
+}
+
+/**
+ * @brief records cells of [base, start) that differ from the snapshot copy
+ * and the pointers in [start, end)
+ */
+static int cache_diff_region(struct forth_ctx *ctx, struct patch_list *l,
+			     uint32_t region, unsigned char *base,
+			     const unsigned char *copy, unsigned char *start,
+			     unsigned char *end)
+{
+	for (unsigned char *p = base; p + sizeof(uintptr_t) <= end;
+	     p += sizeof(uintptr_t)) {
+		uintptr_t v;
+		uint64_t norm;
+		uint32_t kind;
+
+		if (p < start && (cache_skip(ctx, p) ||
+				  !memcmp(p, copy + (p - base), sizeof(v)))) {
+			continue;
+		}
+		memcpy(&v, p, sizeof(v));
+		kind = cache_normalize(ctx, v, &norm);
+		if (p >= start && kind == KIND_RAW) {
+			continue;
+		}
+		if (patch_add(l, region, kind, p - base, norm) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void cache_snapshot_free(struct cache_snapshot *s)
+{
+	free(s->code);
+#ifdef EMFORTH_SPLIT_DICT
+	free(s->names);
+#endif
+#ifdef EMFORTH_HEAP
+	free(s->heap);
+#endif
+	free(s->blocks);
+	free(s);
+}
+
+static struct cache_snapshot *cache_snapshot(struct forth_ctx *ctx)
+{
+	dict_t *d = &ctx->dict;
+	struct cache_snapshot *s = calloc(1, sizeof(*s));
+
+	if (s == NULL) {
+		return NULL;
+	}
+	s->code_start = cell_floor(d->mem, d->here);
+	s->code = malloc(s->code_start - d->mem + 1);
+#ifdef EMFORTH_SPLIT_DICT
+	s->names_start = cell_floor(d->names, d->names_here);
+	s->names = malloc(s->names_start - d->names + 1);
+	if (s->names == NULL) {
+		cache_snapshot_free(s);
+		return NULL;
+	}
+	memcpy(s->names, d->names, s->names_start - d->names);
+#endif
+	if (s->code == NULL) {
+		cache_snapshot_free(s);
+		return NULL;
+	}
+	memcpy(s->code, d->mem, s->code_start - d->mem);
+	s->sp = ctx->sp;
+	memcpy(s->stack, ctx->stack, ctx->sp * sizeof(stack_cell_t));
+#ifdef EMFORTH_HEAP
+	if (d->heap != NULL) {
+		s->heap = malloc(sizeof(*s->heap));
+		if (s->heap == NULL) {
+			cache_snapshot_free(s);
+			return NULL;
+		}
+		memcpy(s->heap, d->heap, sizeof(*s->heap));
+	}
+#endif
+	if (d->blocks != NULL) {
+		s->blocks = malloc(block_cache_size());
+		if (s->blocks == NULL) {
+			cache_snapshot_free(s);
+			return NULL;
+		}
+		memcpy(s->blocks, d->blocks, block_cache_size());
+	}
+	return s;
+}
+
+/*
+ * whether the heap and the block buffers are as they were when s was
+ * taken, an entry only replays what the file did to the dictionary
+ */
+static bool cache_outside_same(struct forth_ctx *ctx,
+			       const struct cache_snapshot *s)
+{
+	dict_t *d = &ctx->dict;
+
+#ifdef EMFORTH_HEAP
+	if (d->heap != NULL && memcmp(s->heap, d->heap, sizeof(*s->heap))) {
+		return false;
+	}
+#endif
+	if (d->blocks == NULL) {
+		return s->blocks == NULL;
+	}
+	return s->blocks != NULL &&
+	       memcmp(s->blocks, d->blocks, block_cache_size()) == 0;
+}
+
+static int cache_write(const char *path, const struct cache_header *h,
+		       const void *code, const void *names,
+		       const struct patch_list *l)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	bool ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+	ok = fwrite(h, sizeof(*h), 1, f) == 1 &&
+	     fwrite(code, 1, h->code_len, f) == h->code_len &&
+	     fwrite(names, 1, h->names_len, f) == h->names_len &&
+	     fwrite(l->p, sizeof(*l->p), l->n, f) == l->n;
+	ok = fclose(f) == 0 && ok;
+
+	/* readers only ever see complete entries */
+	if (!ok || rename(tmp, path) != 0) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief stores what compiling a file did to the dictionary, if it is
+ * something that can be replayed.
+ */
+static void cache_store(struct forth_ctx *ctx, const char *path, uint64_t key,
+			const struct cache_snapshot *s)
+{
+	dict_t *d = &ctx->dict;
+	struct cache_header h = {.magic = CACHE_MAGIC,
+				 .version = CACHE_VERSION,
+				 .cell_size = sizeof(uintptr_t),
+				 .key = key};
+	struct patch_list l = {0};
+	unsigned char *names_start = NULL;
+	bool ok;
+
+	if (cache_output || ctx->intrp_data.mode != MODE_IMMEDIATE ||
+	    ctx->sp != s->sp ||
+	    memcmp(ctx->stack, s->stack, s->sp * sizeof(stack_cell_t)) ||
+	    d->here < s->code_start || !cache_outside_same(ctx, s)) {
+		return;
+	}
+	h.code_start = s->code_start - d->mem;
+	h.code_len = d->here - s->code_start;
+	ok = cache_diff_region(ctx, &l, REGION_CODE, d->mem, s->code,
+			       s->code_start, d->here) == 0;
+#ifdef EMFORTH_SPLIT_DICT
+	if (d->names_here < s->names_start) {
+		free(l.p);
+		return;
+	}
+	names_start = s->names_start;
+	h.names_start = names_start - d->names;
+	h.names_len = d->names_here - names_start;
+	ok = ok && cache_diff_region(ctx, &l, REGION_NAMES, d->names,
+				     s->names, names_start,
+				     d->names_here) == 0;
+#endif
+	for (unsigned int i = 0; ok && i < STATE_SLOTS; i++) {
+		uintptr_t v;
+		uint64_t norm;
+		uint32_t kind;
+
+		memcpy(&v, state_slot(d, i), sizeof(v));
+		kind = cache_normalize(ctx, v, &norm);
+		ok = patch_add(&l, REGION_STATE, kind, i, norm) == 0;
+	}
+	h.patch_count = l.n;
+	if (ok) {
+		cache_write(path, &h, s->code_start, names_start, &l);
+	}
+	free(l.p);
+}
+
+static bool cache_patch_valid(struct forth_ctx *ctx,
+			      const struct cache_patch *p, unsigned char *here
+#ifdef EMFORTH_SPLIT_DICT
+			      ,
+			      unsigned char *names_here
+#endif
+)
+{
+	uintptr_t v;
+
+	if (!cache_denormalize(ctx, p->kind, p->value, &v)) {
+		return false;
+	}
+	switch (p->region) {
+	case REGION_CODE:
+		return p->offset % sizeof(uintptr_t) == 0 &&
+		       p->offset + sizeof(uintptr_t) <=
+			   (uint64_t)(here - ctx->dict.mem);
+#ifdef EMFORTH_SPLIT_DICT
+	case REGION_NAMES:
+		return p->offset % sizeof(uintptr_t) == 0 &&
+		       p->offset + sizeof(uintptr_t) <=
+			   (uint64_t)(names_here - ctx->dict.names);
+#endif
+	case REGION_STATE:
+		return p->offset < STATE_SLOTS;
+	}
+	return false;
+}
+
+/**
+ * @brief replays a cache entry on top of the dictionary.
+ * @returns 0 on success, -1 when there is no usable entry, in which case
+ * the dictionary is unchanged.
+ */
+static int cache_load(struct forth_ctx *ctx, const char *path, uint64_t key)
+{
+	dict_t *d = &ctx->dict;
+	struct cache_header h;
+	struct cache_patch *patches = NULL;
+	unsigned char *code = NULL, *names = NULL;
+	unsigned char *code_start = cell_floor(d->mem, d->here);
+	unsigned char *code_end;
+	int ret = -1;
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL) {
+		return -1;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) ||
+	    h.version != CACHE_VERSION || h.cell_size != sizeof(uintptr_t) ||
+	    h.key != key || h.code_start != (uint64_t)(code_start - d->mem) ||
+	    h.code_len > (uint64_t)(d->end - code_start) ||
+	    h.patch_count > SIZE_MAX / sizeof(*patches)) {
+		goto out;
+	}
+	code = malloc(h.code_len + 1);
+	names = malloc(h.names_len + 1);
+	patches = malloc(h.patch_count * sizeof(*patches) + 1);
+	if (code == NULL || names == NULL || patches == NULL ||
+	    fread(code, 1, h.code_len, f) != h.code_len ||
+	    fread(names, 1, h.names_len, f) != h.names_len ||
+	    fread(patches, sizeof(*patches), h.patch_count, f) !=
+		h.patch_count) {
+		goto out;
+	}
+
+	code_end = code_start + h.code_len;
+	if (code_end > d->here && !dict_reserve(ctx, code_end - d->here)) {
+		goto out;
+	}
+#ifdef EMFORTH_SPLIT_DICT
+	unsigned char *names_start = cell_floor(d->names, d->names_here);
+	unsigned char *names_end = names_start + h.names_len;
+
+	if (h.names_start != (uint64_t)(names_start - d->names) ||
+	    h.names_len > (uint64_t)(d->names_end - names_start) ||
+	    (names_end > d->names_here &&
+	     !dict_names_reserve(ctx, names_end - d->names_here))) {
+		goto out;
+	}
+#else
+	if (h.names_len != 0) {
+		goto out;
+	}
+#endif
+	for (uint64_t i = 0; i < h.patch_count; i++) {
+		if (!cache_patch_valid(ctx, &patches[i], code_end
+#ifdef EMFORTH_SPLIT_DICT
+				       ,
+				       names_end
+#endif
+				       )) {
+			goto out;
+		}
+	}
+
+	/* the entry is sound, from here on it is applied completely */
+	memcpy(code_start, code, h.code_len);
+	d->here = code_end;
+#ifdef EMFORTH_SPLIT_DICT
+	memcpy(names_start, names, h.names_len);
+	d->names_here = names_end;
+#endif
+	for (uint64_t i = 0; i < h.patch_count; i++) {
+		const struct cache_patch *p = &patches[i];
+		void *dst = p->region == REGION_STATE
+				? state_slot(d, p->offset)
+				: d->mem + p->offset;
+		uintptr_t v;
+
+#ifdef EMFORTH_SPLIT_DICT
+		if (p->region == REGION_NAMES) {
+			dst = d->names + p->offset;
+		}
+#endif
+		cache_denormalize(ctx, p->kind, p->value, &v);
+		memcpy(dst, &v, sizeof(v));
+	}
+	ret = 0;
+out:
+	free(patches);
+	free(names);
+	free(code);
+	fclose(f);
+	return ret;
+}
+
+static int cache_puts(const char *s)
+{
+	cache_output = true;
+	return cache_saved_puts(s);
+}
+
+/**
+ * @brief interprets a file's contents, through the cache when enabled
+ */
+static void include_buffer(struct forth_ctx *ctx, const char *src,
+			   size_t len)
+{
+	const char *dir = getenv("EMFORTH_CACHE_DIR");
+	char path[PATH_MAX];
+	struct cache_snapshot *s;
+	struct catch_frame frame;
+	uint64_t key;
+
+	/* nested includes are part of the outermost file's entry */
+	if (cache_recording || dir == NULL || *dir == '\0') {
+		evaluate_buffer(ctx, src, len);
+		return;
+	}
+
+	prim_bounds();
+	key = cache_key(ctx, src, len);
+	snprintf(path, sizeof(path), "%s/%016llx.efc", dir,
+		 (unsigned long long)key);
+	if (cache_load(ctx, path, key) == 0) {
+		return;
+	}
+
+	s = cache_snapshot(ctx);
+	if (s == NULL) {
+		evaluate_buffer(ctx, src, len);
+		return;
+	}
+	cache_recording = true;
+	cache_output = false;
+	cache_saved_puts = ctx->plat.puts;
+	ctx->plat.puts = cache_puts;
+
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		evaluate_buffer(ctx, src, len);
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+	}
+
+	ctx->plat.puts = cache_saved_puts;
+	cache_recording = false;
+
+	if (frame.code == 0) {
+		mkdir(dir, 0777);
+		cache_store(ctx, path, key, s);
+	}
+	cache_snapshot_free(s);
+	if (frame.code != 0) {
+		forth_throw(ctx, frame.code);
+	}
+}
+#else
+static void include_buffer(struct forth_ctx *ctx, const char *src,
+			   size_t len)
+{
+	evaluate_buffer(ctx, src, len);
+}
+#endif /* IMAGE_SOURCE_CACHE */
+
+/**
+ * @brief reads a whole file into a buffer from malloc(), with room for one
+ * more byte after it.
+ * @returns the buffer, or NULL if the file cannot be read.
+ */
+char *read_file(const char *name, size_t *len)
+{
+	FILE *f = fopen(name, "rb");
+	char *buf = NULL;
+	long size;
+
+	if (f == NULL) {
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 &&
+	    fseek(f, 0, SEEK_SET) == 0) {
+		buf = malloc(size + 1);
+		if (buf != NULL && fread(buf, 1, size, f) != (size_t)size) {
+			free(buf);
+			buf = NULL;
+		}
+		*len = size;
+	}
+	fclose(f);
+	return buf;
+}
+
+/**
+ * @brief include <file>, interprets the named file
+ */
+void do_include(struct forth_ctx *ctx)
+{
+	char name[MAX_INPUT_LEN + 1];
+	int len = read_token(ctx, name, MAX_INPUT_LEN);
+	struct catch_frame frame;
+	size_t size;
+	char *src;
+
+	if (len <= 0) {
+		ctx->plat.puts("include: file name expected\n");
+		return;
+	}
+	name[len] = '\0';
+
+	src = read_file(name, &size);
+	if (src == NULL) {
+		ctx->plat.puts("include: cannot read ");
+		ctx->plat.puts(name);
+		ctx->plat.puts("\n");
+		return;
+	}
+	/* src is freed whether or not the file throws */
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		include_buffer(ctx, src, size);
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+	}
+	free(src);
+	if (frame.code != 0) {
+		forth_throw(ctx, frame.code);
+	}
+}
+
+static const struct bultin_entry image_builtin_table[] = {
+    {.word = "include", .c_func = do_include, .flags = {}},
+};
+
+int image_builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, image_builtin_table,
+				 ARRAY_SIZE(image_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
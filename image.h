@@ -0,0 +1,18 @@
+/**
+ * @file image.h
+ *
+ * @brief Words for hosted builds that load source files and keep compiled
+ * dictionary contents on disk.
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+int image_builtins_init(struct forth_ctx *ctx);
+char *read_file(const char *name, size_t *len);
+#endif
+
+#endif /* __IMAGE_H__ */
@@ -10,84 +10,300 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 /* Forward declarations */
-static int read_token(struct forth_ctx *ctx, char *token, size_t max_len);
-static int parse_number(char *token, int token_len, stack_cell_t *number_p);
+static int parse_number(const char *token, int token_len, stack_cell_t base,
+			stack_cell_t *number_p);
 
 /* The inner interpreter - this is the heart of the Forth system */
+#ifdef EMFORTH_TOKEN_THREADED
+static inline void inner_next(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_SANDBOX
+	if (!code_addr_valid(ctx, ctx->ip)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+	xt_check(ctx, *ctx->ip);
+#endif
+	thread_t token = *ctx->ip++;
+	if (token < PRIM_TABLE_MAX) {
+		/* index into the primitive table */
+		prim_table[token](ctx);
+	} else {
+		/* offset of the codeword of a colon definition */
+		ctx->w = token_cfa(ctx, token);
+		(*ctx->w)(ctx);
+	}
+}
+#else
+static inline void inner_next(struct forth_ctx *ctx)
+{
+#ifdef EMFORTH_SANDBOX
+	if (!code_addr_valid(ctx, ctx->ip)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+#endif
+	ctx->w = ctx->ip++;
+	word_t xt = *ctx->w;
+	if (xt != NULL) {
+#ifdef EMFORTH_SANDBOX
+		xt_check(ctx, (stack_cell_t)xt);
+#endif
+		/* Check if this is a compiled reference to a colon
+		 * definition */
+		word_t *word_ptr = (word_t *)xt;
+		if (*word_ptr == do_docol) {
+			/* This is a colon definition - call do_docol */
+			ctx->w = word_ptr;
+			do_docol(ctx);
+			return;
+		}
+		if (is_codeword(*word_ptr)) {
+			/* constant, variable or created word */
+			ctx->w = word_ptr;
+			(*word_ptr)(ctx);
+			return;
+		}
+		/* Otherwise it's a primitive function pointer */
+		xt(ctx);
+	}
+}
+#endif
+
+/*
+ * runs a word to its end for execute_word, charging the budget of
+ * emforth_step too: C frames cannot be suspended, so running out throws
+ */
 static void inner_interpreter(struct forth_ctx *ctx)
 {
+	size_t *budget = &ctx->intrp_data.budget;
+
 	while (ctx->ip != NULL) {
-		ctx->w = ctx->ip++;
-		word_t xt = *ctx->w;
-		if (xt != NULL) {
-			/* Check if this is a compiled reference to a colon
-			 * definition */
-			word_t *word_ptr = (word_t *)xt;
-			if (*word_ptr == do_docol) {
-				/* This is a colon definition - call do_docol */
-				ctx->w = word_ptr;
-				do_docol(ctx);
-				continue;
-			}
-			/* Otherwise it's a primitive function pointer */
-			xt(ctx);
+		if (*budget == 0) {
+			forth_throw(ctx, THROW_INTERRUPT);
 		}
+		(*budget)--;
+		inner_next(ctx);
+	}
+}
+
+/**
+ * @brief runs cells while the budget lasts, words they execute charge it
+ * too. ip is left pointing at the next cell when the budget runs out.
+ */
+static void inner_interpreter_budget(struct forth_ctx *ctx)
+{
+	size_t *budget = &ctx->intrp_data.budget;
+
+	while (ctx->ip != NULL && *budget > 0) {
+		(*budget)--;
+		inner_next(ctx);
 	}
 }
 
 /**
  * @brief Execute a word from the outer interpreter
  *
- * This sets up the initial state and runs the inner interpreter
+ * This sets up the initial state and runs the inner interpreter. Colon
+ * definitions are entered with a NULL return address, so their exit ends
+ * the inner interpreter even when called from inside another word.
  */
 static void execute_word(struct forth_ctx *ctx, word_t *codeword_addr)
 {
 	/* Save the current IP (should be NULL for top-level execution) */
-	word_t *saved_ip = ctx->ip;
+	thread_t *saved_ip = ctx->ip;
 
-	/* Check if this is a primitive or colon definition */
 	word_t codeword = *codeword_addr;
 
-	if (codeword == do_docol) {
-		/* Colon definition - set up to run inner interpreter */
-		ctx->w = codeword_addr;
-		ctx->ip = codeword_addr + 1;
-		inner_interpreter(ctx);
-	} else {
-		/* Primitive word - execute directly */
-		ctx->w = codeword_addr;
-		codeword(ctx);
+#ifdef EMFORTH_SANDBOX
+	/* the codeword cell of a word is in reach of ! */
+	if (!is_codeword(codeword) && !prim_known(codeword)) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
 	}
+#endif
+	/* a NULL ip also tells parsing words like ' they are interpreted */
+	ctx->w = codeword_addr;
+	ctx->ip = NULL;
+	codeword(ctx);
+
+	/* colon definitions and does> code left ip at their code */
+	inner_interpreter(ctx);
 
 	/* Restore IP */
 	ctx->ip = saved_ip;
 }
 
+void execute_xt(struct forth_ctx *ctx, stack_cell_t xt)
+{
+#ifdef EMFORTH_SANDBOX
+	xt_check(ctx, xt);
+#endif
+#ifdef EMFORTH_TOKEN_THREADED
+	if ((thread_t)xt < PRIM_TABLE_MAX) {
+		prim_table[xt](ctx);
+	} else {
+		execute_word(ctx, token_cfa(ctx, xt));
+	}
+#else
+	if (is_codeword(*(word_t *)xt)) {
+		execute_word(ctx, (word_t *)xt);
+	} else {
+		((word_t)xt)(ctx);
+	}
+#endif
+}
+
 /**
- * @brief This is what is usually called the outer interpreter
+ * @brief what an uncaught throw does: report it and go back to
+ * interpreting the next line with empty stacks, as QUIT does.
+ */
+static void interpreter_abort(struct forth_ctx *ctx, stack_cell_t code)
+{
+	print_throw(ctx, code);
+	ctx->sp = 0;
+	ctx->rsp = 0;
+	ctx->fp = 0;
+	ctx->ip = NULL;
+	ctx->intrp_data.mode = MODE_IMMEDIATE;
+	ctx->intrp_data.locals_count = 0;
+	ctx->intrp_data.source_depth = 0;
+	ctx->intrp_data.in_comment = false;
+	fold_barrier(ctx);
+
+	/* nothing after the error on its line is interpreted */
+	while (ctx->intrp_data.last_char != '\n' &&
+	       ctx->intrp_data.last_char != EOF) {
+		input_getchar(ctx);
+	}
+}
+
+__attribute__((noreturn, cold)) void forth_throw(struct forth_ctx *ctx,
+						 stack_cell_t code)
+{
+	struct catch_frame *f = ctx->catch_frame;
+
+	if (f == NULL) {
+		/*
+		 * outer_interpreter, emforth_step and emforth_boot always
+		 * have a handler, so the host called a word directly: report
+		 * it and reset as they would, there is nothing to go back to
+		 */
+		interpreter_abort(ctx, code);
+		abort();
+	}
+	f->code = code;
+	longjmp(f->env, 1);
+}
+
+/**
+ * @brief interprets a single token
  *
  * What it does:
- * 1. Read a token from input
- * 2. Try to parse as number
- * 3. If number: push (immediate mode) or compile literal (compile mode)
- * 4. If not number, then try to find it in the dictionary
- * 5. If found: execute (immediate mode) or compile (compile mode)
- * 6. Otherwise: error
+ * 1. Try to find it in the dictionary, locals first
+ * 2. If found: execute (immediate mode) or compile (compile mode)
+ * 3. If not found, then try to parse as number
+ * 4. If number: push (immediate mode) or compile literal (compile mode)
+ * 5. Otherwise: throw -13, the handler reports it
+ *
+ * Words come first, so a word such as "cafe" is not taken for a number
+ * in hex, and "decimal" still works whatever base is.
+ *
+ * Unless blocking is set, colon definitions are only entered and left in
+ * ip for the caller to run.
+ */
+static void interpret_token(struct forth_ctx *ctx, const char *token,
+			    int token_len, bool blocking)
+{
+	/* locals of the definition being compiled hide other words */
+	if (ctx->intrp_data.mode == MODE_COMPILE &&
+	    ctx->intrp_data.locals_count > 0) {
+		int local = find_local(ctx, token, token_len);
+
+		if (local >= 0) {
+			compile_xt(ctx, prim_xt(do_local_fetch));
+			compile_xt(ctx, local);
+			return;
+		}
+	}
+
+	/* Try to find word in dictionary */
+	dict_header_t *header = find_word_header(ctx, token, token_len);
+
+	if (header) {
+		word_t *codeword_addr = dict_header_cfa(header);
+
+		if (ctx->intrp_data.mode == MODE_IMMEDIATE ||
+		    header->flags.f.immediate) {
+			if (ctx->intrp_data.mode == MODE_IMMEDIATE) {
+				/* it may compile or mark anything */
+				fold_barrier(ctx);
+			}
+			if (!blocking && *codeword_addr == do_docol) {
+				/* only enter it, emforth_step runs it */
+				ctx->w = codeword_addr;
+				ctx->ip = (thread_t *)(codeword_addr + 1);
+				return;
+			}
+			/* Execute the word */
+			execute_word(ctx, codeword_addr);
+		} else {
+			/* Compile mode - compile the word's xt, the address
+			 * of a colon definition or the function pointer of a
+			 * primitive */
+			if (*codeword_addr == do_exit &&
+			    ctx->intrp_data.locals_count > 0) {
+				/* leaving early releases the locals too */
+				compile_xt(ctx, prim_xt(do_locals_leave));
+			}
+			if (!fold_xt(ctx, cfa_to_xt(ctx, codeword_addr))) {
+				compile_xt(ctx, cfa_to_xt(ctx, codeword_addr));
+			}
+		}
+		return;
+	}
+
+	/* try to parse as number */
+	stack_cell_t number;
+	if (parse_number(token, token_len, *ctx->intrp_data.base, &number) ==
+	    0) {
+		if (ctx->intrp_data.mode == MODE_IMMEDIATE) {
+			/* push number to stack */
+			stack_push(ctx, number);
+		} else {
+			/* compile literal, words after it may fold it */
+			fold_literal(ctx, number);
+		}
+	} else {
+		forth_throw(ctx, THROW_UNDEFINED_WORD);
+	}
+}
+
+/**
+ * @brief This is what is usually called the outer interpreter
+ *
+ * Reads tokens from input and interprets them until EOF.
  */
 int outer_interpreter(struct forth_ctx *ctx)
 {
 	char token[MAX_INPUT_LEN + 1];
 	int token_len;
+	struct catch_frame frame;
+
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) != 0) {
+		/* back here after each uncaught throw, still the handler */
+		interpreter_abort(ctx, frame.code);
+		ctx->catch_frame = &frame;
+	}
 
 	while (1) {
 		token_len = read_token(ctx, token, MAX_INPUT_LEN);
 
 		if (token_len < 0) {
 			ctx->plat.puts("Error or EOF. Exiting.\n");
+			catch_leave(ctx, &frame);
 			return -1;
 		}
 
@@ -95,87 +311,245 @@ int outer_interpreter(struct forth_ctx *ctx)
 			continue;
 		}
 
-		/* try to parse as number */
-		stack_cell_t number;
-		if (parse_number(token, token_len, &number) == 0) {
-			if (ctx->intrp_data.mode == MODE_IMMEDIATE) {
-				/* push number to stack */
-				stack_push(ctx, number);
-			} else {
-				/* compile literal */
-				compile_word(ctx, (stack_cell_t)do_lit);
-				compile_word(ctx, number);
-			}
-		} else {
+		interpret_token(ctx, token, token_len, true);
+	}
+}
 
-			/* Try to find word in dictionary */
-			dict_header_t *header =
-			    find_word_header(ctx, token, token_len);
-
-			if (header) {
-				/* Calculate codeword pointer from header */
-				char *word_name = (char *)(header + 1);
-				word_t *codeword_addr =
-				    (word_t *)(word_name +
-					       ALIGN_UP_WORD_T(
-						   header->flags.f.length));
-
-				if (ctx->intrp_data.mode == MODE_IMMEDIATE ||
-				    header->flags.f.immediate) {
-					/* Execute the word */
-					execute_word(ctx, codeword_addr);
-				} else {
-					/* Compile mode - compile the word's
-					 * address */
-					word_t codeword = *codeword_addr;
-					if (codeword == do_docol) {
-						/* Colon definition - compile
-						 * the address of the word */
-						compile_word(ctx,
-							     (stack_cell_t)
-								 codeword_addr);
-					} else {
-						/* Primitive - compile the
-						 * function pointer directly */
-						compile_word(
-						    ctx,
-						    (stack_cell_t)codeword);
-					}
-				}
-			} else {
-				ctx->plat.puts("Word not found: ");
-				ctx->plat.puts(token);
-				ctx->plat.puts("\n");
-			}
+/**
+ * @brief interprets len bytes of source at buf as if they were input,
+ * used by include and evaluate.
+ * @returns -1 if sources are nested too deep.
+ */
+int evaluate_buffer(struct forth_ctx *ctx, const char *buf, size_t len)
+{
+	struct interpreter_data *id = &ctx->intrp_data;
+	char token[MAX_INPUT_LEN + 1];
+	int token_len;
+
+	if (id->source_depth >= INPUT_SOURCE_MAX) {
+		ctx->plat.puts("Input sources nested too deep\n");
+		return -1;
+	}
+
+	struct input_source *src = &id->sources[id->source_depth++];
+	bool saved_in_comment = id->in_comment;
+
+	src->buf = buf;
+	src->len = len;
+	src->pos = 0;
+	id->in_comment = false;
+
+	while ((token_len = read_token(ctx, token, MAX_INPUT_LEN)) >= 0) {
+		if (token_len > 0) {
+			interpret_token(ctx, token, token_len, true);
 		}
 	}
+
+	id->source_depth--;
+	id->in_comment = saved_in_comment;
+
+	return 0;
 }
 
 /**
- * parsing decimal and hexadecimal is supported
+ * @brief next input character, from the innermost source being evaluated
+ * or from the platform when there is none.
  */
-static int parse_number(char *token, int token_len, stack_cell_t *number_p)
+int input_getchar(struct forth_ctx *ctx)
 {
-	long number;
+	struct interpreter_data *id = &ctx->intrp_data;
 
-	if (token_len > 2 && token[0] == '0' &&
-	    (token[1] == 'x' || token[1] == 'X')) {
-		for (int i = 2; i < token_len; i++) {
-			if (!isxdigit(token[i])) {
-				return -1;
-			}
+	if (id->source_depth > 0) {
+		struct input_source *src = &id->sources[id->source_depth - 1];
+		return src->pos < src->len ? (unsigned char)src->buf[src->pos++]
+					   : EOF;
+	}
+
+	if (ctx->plat.getchar == NULL) {
+		id->last_char = id->feed_pos < id->feed_avail
+				    ? (unsigned char)id->feed[id->feed_pos++]
+				    : EOF;
+	} else {
+		id->last_char = ctx->plat.getchar();
+	}
+
+	return id->last_char;
+}
+
+size_t emforth_feed(struct forth_ctx *ctx, const char *buf, size_t len)
+{
+	struct interpreter_data *id = &ctx->intrp_data;
+
+	/* drop what has been interpreted */
+	memmove(id->feed, id->feed + id->feed_pos,
+		id->feed_len - id->feed_pos);
+	id->feed_len -= id->feed_pos;
+	id->feed_avail -= id->feed_pos;
+	id->feed_pos = 0;
+
+	if (len > INPUT_FEED_SIZE - id->feed_len) {
+		len = INPUT_FEED_SIZE - id->feed_len;
+	}
+	memcpy(id->feed + id->feed_len, buf, len);
+	id->feed_len += len;
+
+	/* tokens never span lines, so complete lines can be interpreted */
+	for (size_t i = id->feed_len; i > id->feed_avail; i--) {
+		if (id->feed[i - 1] == '\n') {
+			id->feed_avail = i;
+			break;
 		}
-		number = strtol(token, NULL, 16);
+	}
+	/* a line longer than the buffer is cut rather than stalling */
+	if (id->feed_end || id->feed_len == INPUT_FEED_SIZE) {
+		id->feed_avail = id->feed_len;
+	}
+
+	return len;
+}
+
+void emforth_feed_end(struct forth_ctx *ctx)
+{
+	ctx->intrp_data.feed_end = true;
+	ctx->intrp_data.feed_avail = ctx->intrp_data.feed_len;
+}
+
+static emforth_status_e step_budget(struct forth_ctx *ctx)
+{
+	struct interpreter_data *id = &ctx->intrp_data;
+	char token[MAX_INPUT_LEN + 1];
+	int token_len;
+
+	while (id->budget > 0) {
+		/* continue a suspended definition before reading on */
+		if (ctx->ip != NULL) {
+			inner_interpreter_budget(ctx);
+			continue;
+		}
+
+		token_len = read_token(ctx, token, MAX_INPUT_LEN);
+		if (token_len < 0) {
+			return id->feed_end && id->feed_pos == id->feed_len
+				   ? EMFORTH_DONE
+				   : EMFORTH_NEEDS_INPUT;
+		}
+		id->budget--;
+
+		if (token_len > 0) {
+			interpret_token(ctx, token, token_len, false);
+		}
+	}
+
+	return EMFORTH_BUDGET_EXHAUSTED;
+}
+
+emforth_status_e emforth_step(struct forth_ctx *ctx, size_t budget)
+{
+	emforth_status_e status = EMFORTH_BUDGET_EXHAUSTED;
+	struct catch_frame frame;
+
+	ctx->intrp_data.budget = budget;
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		status = step_budget(ctx);
+		catch_leave(ctx, &frame);
 	} else {
-		for (int i = 0; i < token_len; i++) {
-			if (!isdigit(token[i])) {
-				return -1;
-			}
+		/* the rest of the line was dropped, the next step goes on */
+		interpreter_abort(ctx, frame.code);
+		catch_leave(ctx, &frame);
+	}
+	ctx->intrp_data.budget = SIZE_MAX;
+
+	return status;
+}
+
+/**
+ * @brief value of a digit in any base up to 36, without using locale
+ * dependent ctype functions. Returns 36 (never a valid digit) otherwise.
+ */
+static inline unsigned int digit_value(unsigned char c)
+{
+	if ((unsigned int)(c - '0') < 10u) {
+		return c - '0';
+	}
+
+	/* fold to lower case, only meaningful for letters */
+	c |= 0x20;
+	if ((unsigned int)(c - 'a') < 26u) {
+		return c - 'a' + 10;
+	}
+
+	return 36;
+}
+
+/**
+ * @brief single pass number parser, digits are folded while validating.
+ *
+ * Accepts an optional radix prefix ('#' decimal, '$' hex, '%' binary or
+ * "0x" hex), an optional '-' sign, then at least one digit in the
+ * selected base. Returns -1 on the first character that is not a digit,
+ * so most words fall through to the dictionary lookup after one compare,
+ * and on overflow of a cell.
+ */
+static int parse_number(const char *token, int token_len, stack_cell_t base,
+			stack_cell_t *number_p)
+{
+	const char *p = token;
+	const char *end = token + token_len;
+	uintptr_t number = 0;
+	bool negative = false;
+
+	switch (*p) {
+	case '#':
+		base = 10;
+		p++;
+		break;
+	case '$':
+		base = 16;
+		p++;
+		break;
+	case '%':
+		base = 2;
+		p++;
+		break;
+	case '0':
+		if (token_len > 2 && (p[1] == 'x' || p[1] == 'X')) {
+			base = 16;
+			p += 2;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (p < end && *p == '-') {
+		negative = true;
+		p++;
+	}
+
+	if (p == end || base < 2 || base > 36) {
+		return -1;
+	}
+
+	for (; p < end; p++) {
+		unsigned int digit = digit_value(*p);
+
+		if (digit >= (uintptr_t)base) {
+			return -1;
+		}
+
+		if (__builtin_mul_overflow(number, (uintptr_t)base, &number) ||
+		    __builtin_add_overflow(number, digit, &number)) {
+			return -1;
 		}
-		number = strtol(token, NULL, 10);
 	}
 
-	*number_p = number;
+	/* negative numbers must fit in a signed cell */
+	if (negative && number > (uintptr_t)INTPTR_MAX + 1) {
+		return -1;
+	}
+
+	*number_p = negative ? (stack_cell_t)(0 - number) : (stack_cell_t)number;
 
 	return 0;
 }
@@ -183,16 +557,68 @@ static int parse_number(char *token, int token_len, stack_cell_t *number_p)
 void do_docol(struct forth_ctx *ctx)
 {
 	/* Save return address on return stack */
-	if (ctx->rsp < RSTACK_SIZE_MAX) {
-		ctx->rstack[ctx->rsp++] = ctx->ip;
-	} else {
-		ctx->plat.puts("Return stack overflow\n");
-		return;
+	if (ctx->rsp >= RSTACK_SIZE_MAX) {
+		forth_throw(ctx, THROW_RSTACK_OVERFLOW);
 	}
+	ctx->rstack[ctx->rsp++] = ctx->ip;
+	stats_depth(ctx);
 
 	/* ctx->w should already point to the word being called */
 	/* Set IP to body of word (after the codeword) */
-	ctx->ip = ctx->w + 1;
+	ctx->ip = (thread_t *)(ctx->w + 1);
+}
+
+/*
+ * Codewords of words defined by constant, value, variable and create.
+ * Like do_docol they find the word through w, which points at the
+ * codeword, and their data follows it.
+ */
+
+/**
+ * @brief pushes the cell after the codeword, for constant
+ */
+void do_const(struct forth_ctx *ctx)
+{
+	stack_push(ctx, *(stack_cell_t *)(ctx->w + 1));
+}
+
+/**
+ * @brief pushes the cell after the codeword, for value. to tells a value
+ * from a constant by its codeword alone, so this needs an address of its
+ * own: a copy of do_const could be merged with it by the linker.
+ */
+void do_val(struct forth_ctx *ctx)
+{
+	do_const(ctx);
+}
+
+/**
+ * @brief pushes the address of the cell after the codeword, for variable
+ */
+void do_var(struct forth_ctx *ctx)
+{
+	stack_push(ctx, (stack_cell_t)(ctx->w + 1));
+}
+
+/**
+ * @brief for words made by create: the cell after the codeword holds the
+ * code set by does>, or NULL. Pushes the address of the data after that
+ * cell, then runs the does> code like a colon definition.
+ */
+void do_does(struct forth_ctx *ctx)
+{
+	thread_t *code = ((thread_t **)ctx->w)[1];
+
+	stack_push(ctx, (stack_cell_t)(ctx->w + 2));
+	if (code == NULL) {
+		return;
+	}
+	if (ctx->rsp >= RSTACK_SIZE_MAX) {
+		forth_throw(ctx, THROW_RSTACK_OVERFLOW);
+	}
+	ctx->rstack[ctx->rsp++] = ctx->ip;
+	stats_depth(ctx);
+	ctx->ip = code;
 }
 
 void do_exit(struct forth_ctx *ctx)
@@ -208,11 +634,24 @@ void do_exit(struct forth_ctx *ctx)
 
 void do_lit(struct forth_ctx *ctx)
 {
-	stack_cell_t number = *(stack_cell_t *)(ctx->ip);
+	operands_check(ctx);
+	stack_cell_t number = thread_literal(ctx->ip);
 	stack_push(ctx, number);
 	/* Skip over the literal value */
+	ctx->ip += LITERAL_THREAD_CELLS;
+}
+
+#ifdef EMFORTH_TOKEN_THREADED
+/**
+ * @brief pushes the sign extended 16 bit literal in the next token
+ */
+void do_lit16(struct forth_ctx *ctx)
+{
+	operands_check(ctx);
+	stack_push(ctx, (int16_t)*ctx->ip);
 	ctx->ip += 1;
 }
+#endif
 
 /**
  * @brief Initialize the outer interpreter
@@ -221,15 +660,35 @@ void interpreter_init(struct forth_ctx *ctx)
 {
 	ctx->intrp_data.mode = MODE_IMMEDIATE;
 	ctx->intrp_data.in_comment = false;
+	ctx->intrp_data.source_depth = 0;
+	ctx->intrp_data.last_char = '\n';
+	ctx->intrp_data.budget = SIZE_MAX;
+	ctx->intrp_data.locals_count = 0;
+	ctx->intrp_data.feed_len = 0;
+	ctx->intrp_data.feed_pos = 0;
+	ctx->intrp_data.feed_avail = 0;
+	ctx->intrp_data.feed_end = false;
+
+	/* base is kept in the dictionary so that @ and ! can reach it */
+	ctx->dict.here = (unsigned char *)ALIGN_UP_WORD_T(ctx->dict.here);
+	ctx->intrp_data.base = (stack_cell_t *)ctx->dict.here;
+	compile_word(ctx, 10);
+
+	/* followed by the buffer used by <# # #s hold sign #> */
+	if (dict_reserve(ctx, HOLD_BUFFER_SIZE)) {
+		ctx->dict.here += HOLD_BUFFER_SIZE;
+	}
+	ctx->intrp_data.hold_end = (char *)ctx->dict.here;
+	ctx->intrp_data.hld = ctx->intrp_data.hold_end;
 }
 
-static int read_token(struct forth_ctx *ctx, char *token, size_t max_len)
+int read_token(struct forth_ctx *ctx, char *token, size_t max_len)
 {
 	int ch;
 	size_t pos = 0;
 
 	do {
-		ch = ctx->plat.getchar();
+		ch = input_getchar(ctx);
 
 		if (ch == EOF) {
 			return -1;
@@ -246,7 +705,7 @@ static int read_token(struct forth_ctx *ctx, char *token, size_t max_len)
 
 	while (!isspace(ch) && ch != EOF && pos < max_len) {
 		token[pos++] = ch;
-		ch = ctx->plat.getchar();
+		ch = input_getchar(ctx);
 	}
 
 	/* Null-terminate */
@@ -256,33 +715,46 @@ static int read_token(struct forth_ctx *ctx, char *token, size_t max_len)
 }
 
 /**
- * returns the pointer to the first word in the definition.
+ * @brief index of a local of the definition being compiled, -1 if there
+ * is none with this name. The newest declared wins.
  */
-dict_header_t *find_word_header(struct forth_ctx *ctx, const char *name,
-				size_t len)
+int find_local(struct forth_ctx *ctx, const char *name, size_t len)
 {
-	dict_header_t *header = ctx->dict.latest;
+	struct interpreter_data *id = &ctx->intrp_data;
 
-	while (header != DICT_NULL) {
-		/* we skip hidden words */
-		if (header->flags.f.hidden) {
-			header = header->link;
-			continue;
+	for (int i = id->locals_count - 1; i >= 0; i--) {
+		if (id->locals[i].len == len &&
+		    memcmp(id->locals[i].name, name, len) == 0) {
+			return i;
 		}
+	}
+	return -1;
+}
 
-		if (header->flags.f.length != len) {
-			header = header->link;
-			continue;
-		}
+/**
+ * returns the header of the newest visible word with this name, searching
+ * each wordlist of the search order in turn.
+ */
+dict_header_t *find_word_header(struct forth_ctx *ctx, const char *name,
+				size_t len)
+{
+	unsigned int bucket = name_hash(name, len);
+
+	for (stack_cell_t i = 0; i < ctx->dict.order_len; i++) {
+		dict_header_t *header = ctx->dict.order[i]->buckets[bucket];
+
+		while (header != DICT_NULL) {
+			/* we skip hidden words, and only compare names of
+			 * the same length */
+			if (!header->flags.f.hidden &&
+			    header->flags.f.length == len &&
+			    memcmp(dict_header_name(header), name, len) == 0) {
+				return header;
+			}
 
-		char *word_name = (char *)(header + 1);
-		if (memcmp(word_name, name, len) == 0) {
-			/* Found it - return pointer to header */
-			return header;
+			/* Move to the next word in this bucket */
+			header = header->hlink;
 		}
-
-		/* Move to previous word */
-		header = header->link;
 	}
 
 	return NULL;
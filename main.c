@@ -6,6 +6,7 @@
  */
 #include "emforth.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 struct forth_ctx ctx;
@@ -15,25 +16,73 @@ int tell(const char *s)
 	return fputs(s, stdout);
 }
 
-int main()
+#if !defined(__EMSCRIPTEN__) && !defined(EMFORTH_TOKEN_THREADED)
+/* runs a turnkey image made with the turnkey word */
+static int boot(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char *image = NULL;
+	long len = -1;
+	int ret;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 &&
+	    fseek(f, 0, SEEK_SET) == 0) {
+		image = malloc(len ? len : 1);
+	}
+	if (image == NULL || fread(image, 1, len, f) != (size_t)len) {
+		perror(path);
+		fclose(f);
+		free(image);
+		return -1;
+	}
+	fclose(f);
+
+	ret = emforth_boot(&ctx, image, len);
+	emforth_deinit(&ctx);
+	free(image);
+	return ret;
+}
+#endif
+
+int main(int argc, char **argv)
 {
 	memset(&ctx, 0, sizeof(ctx));
 
 	/* set console functions */
 	ctx.plat.puts = tell;
 #ifdef __EMSCRIPTEN__
-	int emforth_web_getchar();
-	ctx.plat.getchar = emforth_web_getchar;
+	/* the page feeds input and steps the interpreter, see platform_web.c */
+	ctx.plat.getchar = NULL;
 #else
 	ctx.plat.getchar = getchar;
 #endif
 
+#if !defined(__EMSCRIPTEN__) && !defined(EMFORTH_TOKEN_THREADED)
+	if (argc > 1) {
+		return boot(argv[1]) == 0 ? 0 : 1;
+	}
+#else
+	(void)argc;
+	(void)argv;
+#endif
+
 	if (emforth_init(&ctx) != 0) {
 		ctx.plat.puts("Error initializing\n");
 		return -1;
 	}
 
+#ifdef __EMSCRIPTEN__
+	/* ctx stays alive, the page drives it from now on */
+	return 0;
+#endif
+
 	outer_interpreter(&ctx);
 
+	emforth_deinit(&ctx);
+
 	return 0;
 }
@@ -0,0 +1,890 @@
+/**
+ * @file module.c
+ *
+ * @brief Compiled modules: compile-module and load-module.
+ *
+ * 'compile-module lib.fs lib.efm' interprets lib.fs like include and writes
+ * what it appended to the dictionary to lib.efm: the code bytes, the name
+ * space bytes with EMFORTH_SPLIT_DICT, where the headers of the words it
+ * defined are, and a relocation table. 'load-module lib.efm' copies the
+ * bytes to 'here', relocates them and adds the words to the current
+ * wordlist, which is much faster than compiling lib.fs again.
+ *
+ * A relocation says how to rebuild one cell aligned pointer: an offset in
+ * the module itself, a codeword, or a symbol, which is the name of a
+ * primitive or of a word the module used from the dictionary below it,
+ * plus an offset into that word (for the data of a variable, say). Symbols
+ * are looked up by name when the module is loaded, so a module does not
+ * depend on where the dictionary is, on which words came before it, or on
+ * the order primitives were registered in.
+ *
+ * Modules can be loaded in any order. A call to a word that is not defined
+ * yet is left calling (unresolved), which throws, and is patched when a
+ * module defining the word is loaded. Other references must resolve when
+ * the module is loaded.
+ *
+ * Only what the source appends is kept: it must not create wordlists, and
+ * changes it makes to cells below the old 'here' are lost. Cells are found
+ * by value, as in the compiled source cache of image.c, so token threaded
+ * builds, whose literals are not cell aligned, have no modules.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+#include "image.h"
+#include "module.h"
+
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_TOKEN_THREADED)
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define MODULE_MAGIC "EMFMODUL"
+#define MODULE_VERSION 1u
+
+enum module_region { REGION_CODE, REGION_NAMES };
+
+enum module_reloc_kind {
+	RELOC_CODE,	/* value is an offset in the module code */
+	RELOC_NAMES,	/* value is an offset in the module name space */
+	RELOC_CODEWORD, /* value indexes codewords[] */
+	RELOC_SYMBOL,	/* value indexes the symbols, plus addend */
+};
+
+enum module_symbol_kind { SYMBOL_WORD, SYMBOL_PRIM };
+
+struct module_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t cell_size;
+	uint64_t code_len;
+	uint64_t names_len;
+	uint64_t word_count; /* header offsets, oldest first */
+	uint64_t reloc_count;
+	uint64_t symbol_count;
+};
+
+struct module_reloc {
+	uint32_t region;
+	uint32_t kind;
+	uint64_t offset; /* of the cell in its region */
+	uint64_t value;
+	int64_t addend;
+};
+
+struct module_symbol {
+	uint8_t kind;
+	uint8_t len;
+	char name[WORD_NAME_MAX_LEN + 1];
+};
+
+/* a call waiting for a module that defines the word, see dict.module_refs */
+struct module_ref {
+	struct module_ref *next;
+	uintptr_t *cell;
+	uint8_t len;
+	char name[WORD_NAME_MAX_LEN + 1];
+};
+
+static const word_t codewords[] = {do_docol, do_const, do_var, do_does,
+				   do_val};
+
+/* what compile-module collects */
+struct module_out {
+	struct module_header h;
+	unsigned char *code, *names; /* start of the module in each region */
+	dict_header_t *latest;	     /* newest word below the module */
+	dict_header_t **words;
+	struct module_reloc *relocs;
+	size_t reloc_cap;
+	struct module_symbol *symbols;
+	dict_header_t **base; /* words below the module, by address */
+	size_t base_count;
+	const char *error;
+};
+
+static bool name_equal(dict_header_t *h, const char *name, size_t len)
+{
+	return h->flags.f.length == len &&
+	       memcmp(dict_header_name(h), name, len) == 0;
+}
+
+/* the function of the primitive called name, hidden ones included */
+static word_t prim_by_name(struct forth_ctx *ctx, const char *name,
+			   size_t len)
+{
+	for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+		for (dict_header_t *h = wl->latest; h; h = h->link) {
+			word_t fn = *dict_header_cfa(h);
+
+			if (!is_codeword(fn) && name_equal(h, name, len)) {
+				return fn;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* == compile-module == */
+
+/* the headers of a region from start to end, oldest first */
+static dict_header_t **collect_headers(struct forth_ctx *ctx,
+				       unsigned char *start,
+				       unsigned char *end, bool inside,
+				       size_t *count)
+{
+	dict_header_t **v = NULL;
+	size_t n = 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		n = 0;
+		for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+			for (dict_header_t *h = wl->latest; h; h = h->link) {
+				unsigned char *p = (unsigned char *)h;
+
+				if ((p >= start && p < end) != inside) {
+					continue;
+				}
+				if (pass == 1) {
+					v[n] = h;
+				}
+				n++;
+			}
+		}
+		if (pass == 0) {
+			v = malloc((n ? n : 1) * sizeof(*v));
+			if (v == NULL) {
+				return NULL;
+			}
+		}
+	}
+	qsort(v, n, sizeof(*v), dict_header_compare);
+	*count = n;
+	return v;
+}
+
+static bool reloc_add(struct module_out *m, uint32_t region, uint32_t kind,
+		      uint64_t offset, uint64_t value, int64_t addend)
+{
+	if (m->h.reloc_count == m->reloc_cap) {
+		size_t cap = m->reloc_cap ? m->reloc_cap * 2 : 64;
+		struct module_reloc *r = realloc(m->relocs, cap * sizeof(*r));
+
+		if (r == NULL) {
+			m->error = "out of memory";
+			return false;
+		}
+		m->relocs = r;
+		m->reloc_cap = cap;
+	}
+	m->relocs[m->h.reloc_count++] =
+	    (struct module_reloc){region, kind, offset, value, addend};
+	return true;
+}
+
+static bool symbol_add(struct module_out *m, uint8_t kind, dict_header_t *h,
+		       uint64_t *index)
+{
+	const char *name = dict_header_name(h);
+	uint8_t len = h->flags.f.length;
+	struct module_symbol *s;
+
+	for (uint64_t i = 0; i < m->h.symbol_count; i++) {
+		s = &m->symbols[i];
+		if (s->kind == kind && s->len == len &&
+		    memcmp(s->name, name, len) == 0) {
+			*index = i;
+			return true;
+		}
+	}
+	s = realloc(m->symbols, (m->h.symbol_count + 1) * sizeof(*s));
+	if (s == NULL) {
+		m->error = "out of memory";
+		return false;
+	}
+	m->symbols = s;
+	s = &m->symbols[m->h.symbol_count];
+	memset(s, 0, sizeof(*s));
+	s->kind = kind;
+	s->len = len;
+	memcpy(s->name, name, len);
+	*index = m->h.symbol_count++;
+	return true;
+}
+
+/* the word below the module whose code or data holds p */
+static dict_header_t *base_word(struct module_out *m, unsigned char *p)
+{
+	size_t lo = 0, hi = m->base_count;
+
+	/* the last word starting at or before p */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (dict_word_start(m->base[mid]) <= p) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return NULL;
+	}
+	if ((unsigned char *)dict_header_cfa(m->base[lo - 1]) > p ||
+	    (lo < m->base_count && dict_word_start(m->base[lo]) <= p)) {
+		return NULL;
+	}
+	return m->base[lo - 1];
+}
+
+/* whether the cell at p is the link or hlink of a module header */
+static bool is_link_cell(struct module_out *m, unsigned char *p)
+{
+	for (uint64_t i = 0; i < m->h.word_count; i++) {
+		if (p == (unsigned char *)&m->words[i]->link ||
+		    p == (unsigned char *)&m->words[i]->hlink) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* adds a relocation for the cell at p, if it holds a pointer */
+static bool reloc_cell(struct forth_ctx *ctx, struct module_out *m,
+		       uint32_t region, uint64_t offset, unsigned char *p)
+{
+	dict_t *d = &ctx->dict;
+	uintptr_t v;
+	dict_header_t *h;
+	uint64_t index;
+
+	memcpy(&v, p, sizeof(v));
+	if (v >= (uintptr_t)m->code && v <= (uintptr_t)d->here) {
+		return reloc_add(m, region, RELOC_CODE, offset,
+				 v - (uintptr_t)m->code, 0);
+	}
+#ifdef EMFORTH_SPLIT_DICT
+	if (v >= (uintptr_t)m->names && v <= (uintptr_t)d->names_here) {
+		return reloc_add(m, region, RELOC_NAMES, offset,
+				 v - (uintptr_t)m->names, 0);
+	}
+	if (v >= (uintptr_t)d->names && v < (uintptr_t)m->names) {
+		m->error = "refers to a header below it";
+		return false;
+	}
+#endif
+	for (size_t i = 0; i < ARRAY_SIZE(codewords); i++) {
+		if (v == (uintptr_t)codewords[i]) {
+			return reloc_add(m, region, RELOC_CODEWORD, offset, i,
+					 0);
+		}
+	}
+	if (v >= (uintptr_t)d->mem && v < (uintptr_t)m->code) {
+		h = base_word(m, (unsigned char *)v);
+		if (h == NULL) {
+			m->error = "refers to dictionary memory outside words";
+			return false;
+		}
+		if (find_word_header(ctx, dict_header_name(h),
+				     h->flags.f.length) != h) {
+			m->error = "refers to a word that is hidden or redefined";
+			return false;
+		}
+		return symbol_add(m, SYMBOL_WORD, h, &index) &&
+		       reloc_add(m, region, RELOC_SYMBOL, offset, index,
+				 v - (uintptr_t)dict_header_cfa(h));
+	}
+	if (prim_index((word_t)v) < prim_count) {
+		/* the newest header of the primitive names it */
+		for (wordlist_t *wl = d->wordlists; wl; wl = wl->prev) {
+			for (h = wl->latest; h; h = h->link) {
+				if (*dict_header_cfa(h) == (word_t)v) {
+					return symbol_add(m, SYMBOL_PRIM, h,
+							  &index) &&
+					       reloc_add(m, region,
+							 RELOC_SYMBOL, offset,
+							 index, 0);
+				}
+			}
+		}
+		m->error = "calls a primitive without a name";
+		return false;
+	}
+	if (other_addr_valid(ctx, v, 1)) {
+		/* no other process has them at the same address */
+		m->error = "refers to the heap or a block buffer";
+		return false;
+	}
+	return true;
+}
+
+static bool reloc_region(struct forth_ctx *ctx, struct module_out *m,
+			 uint32_t region, unsigned char *start,
+			 unsigned char *end)
+{
+	for (unsigned char *p = start; p + sizeof(uintptr_t) <= end;
+	     p += sizeof(uintptr_t)) {
+		if (!is_link_cell(m, p) &&
+		    !reloc_cell(ctx, m, region, p - start, p)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool module_write(const char *path, struct module_out *m)
+{
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if (f == NULL) {
+		return false;
+	}
+	ok = fwrite(&m->h, sizeof(m->h), 1, f) == 1 &&
+	     fwrite(m->code, 1, m->h.code_len, f) == m->h.code_len &&
+	     (m->h.names_len == 0 ||
+	      fwrite(m->names, 1, m->h.names_len, f) == m->h.names_len);
+	for (uint64_t i = 0; ok && i < m->h.word_count; i++) {
+		unsigned char *start = m->h.names_len ? m->names : m->code;
+		uint64_t offset = (unsigned char *)m->words[i] - start;
+
+		ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+	}
+	ok = ok &&
+	     fwrite(m->relocs, sizeof(*m->relocs), m->h.reloc_count, f) ==
+		 m->h.reloc_count &&
+	     fwrite(m->symbols, sizeof(*m->symbols), m->h.symbol_count, f) ==
+		 m->h.symbol_count;
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		remove(path);
+	}
+	return ok;
+}
+
+/* whether h, if not NULL, is still in a wordlist */
+static bool header_kept(struct forth_ctx *ctx, dict_header_t *h)
+{
+	if (h == DICT_NULL) {
+		return true;
+	}
+	for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+		dict_header_t *cur = wl->latest;
+
+		/* newest first, so h would come before any older word */
+		while (cur != DICT_NULL && (uintptr_t)cur > (uintptr_t)h) {
+			cur = cur->link;
+		}
+		if (cur == h) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* builds the module of what was compiled since code and names */
+static bool module_build(struct forth_ctx *ctx, struct module_out *m)
+{
+	dict_t *d = &ctx->dict;
+	unsigned char *names_end = NULL;
+	size_t n;
+
+	if (d->here < m->code
+#ifdef EMFORTH_SPLIT_DICT
+	    || d->names_here < m->names
+#endif
+	    || !header_kept(ctx, m->latest)) {
+		m->error = "forgets below the start of the module";
+		return false;
+	}
+#ifdef EMFORTH_SPLIT_DICT
+	names_end = d->names_here;
+	m->h.names_len = names_end - m->names;
+#endif
+	m->h.code_len = d->here - m->code;
+	m->words = collect_headers(ctx, m->names ? m->names : m->code,
+				   m->names ? names_end : d->here, true, &n);
+	m->h.word_count = n;
+	m->base = collect_headers(ctx, m->names ? m->names : m->code,
+				  m->names ? names_end : d->here, false,
+				  &m->base_count);
+	if (m->words == NULL || m->base == NULL) {
+		m->error = "out of memory";
+		return false;
+	}
+	return reloc_region(ctx, m, REGION_CODE, m->code, d->here)
+#ifdef EMFORTH_SPLIT_DICT
+	       && reloc_region(ctx, m, REGION_NAMES, m->names, names_end)
+#endif
+	    ;
+}
+
+/**
+ * @brief compile-module <source> <module>, interprets source and writes
+ * the words it defined to module
+ */
+void do_compile_module(struct forth_ctx *ctx)
+{
+	char src_name[MAX_INPUT_LEN + 1], name[MAX_INPUT_LEN + 1];
+	int src_len = read_token(ctx, src_name, MAX_INPUT_LEN);
+	int len = src_len > 0 ? read_token(ctx, name, MAX_INPUT_LEN) : 0;
+	struct module_out m = {.h = {.magic = MODULE_MAGIC,
+				     .version = MODULE_VERSION,
+				     .cell_size = sizeof(uintptr_t)}};
+	wordlist_t *wordlists = ctx->dict.wordlists;
+	struct catch_frame frame;
+	size_t size;
+	char *src;
+
+	if (len <= 0) {
+		ctx->plat.puts("compile-module: source and module expected\n");
+		return;
+	}
+	src_name[src_len] = '\0';
+	name[len] = '\0';
+	src = read_file(src_name, &size);
+	if (src == NULL) {
+		ctx->plat.puts("compile-module: cannot read ");
+		ctx->plat.puts(src_name);
+		ctx->plat.puts("\n");
+		return;
+	}
+
+	/* the module starts where the first header or codeword will */
+	if (!dict_reserve(ctx, sizeof(word_t))) {
+		free(src);
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+	ctx->dict.here = (unsigned char *)ALIGN_UP_WORD_T(ctx->dict.here);
+	m.code = ctx->dict.here;
+	m.latest = ctx->dict.latest;
+#ifdef EMFORTH_SPLIT_DICT
+	m.names = ctx->dict.names_here;
+#endif
+
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		evaluate_buffer(ctx, src, size);
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+	}
+	free(src);
+	if (frame.code != 0) {
+		forth_throw(ctx, frame.code);
+	}
+
+	if (ctx->dict.wordlists != wordlists) {
+		m.error = "creates a wordlist";
+	} else if (ctx->intrp_data.mode != MODE_IMMEDIATE) {
+		m.error = "leaves a definition open";
+	} else if (module_build(ctx, &m) && !module_write(name, &m)) {
+		m.error = "cannot be written";
+	}
+	if (m.error != NULL) {
+		ctx->plat.puts("compile-module: ");
+		ctx->plat.puts(src_name);
+		ctx->plat.puts(" ");
+		ctx->plat.puts(m.error);
+		ctx->plat.puts("\n");
+	}
+	free(m.words);
+	free(m.base);
+	free(m.relocs);
+	free(m.symbols);
+	if (m.error != NULL) {
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+}
+
+/* == load-module == */
+
+/* what load-module reads */
+struct module_in {
+	struct module_header h;
+	unsigned char *code, *names;
+	uint64_t *words;
+	struct module_reloc *relocs;
+	struct module_symbol *symbols;
+	uintptr_t *resolved; /* per symbol, 0 when not defined yet */
+};
+
+static void module_in_free(struct module_in *m)
+{
+	free(m->code);
+	free(m->names);
+	free(m->words);
+	free(m->relocs);
+	free(m->symbols);
+	free(m->resolved);
+}
+
+static bool module_read(FILE *f, struct module_in *m)
+{
+	struct module_header *h = &m->h;
+
+	if (fread(h, sizeof(*h), 1, f) != 1 ||
+	    memcmp(h->magic, MODULE_MAGIC, sizeof(h->magic)) ||
+	    h->version != MODULE_VERSION || h->cell_size != sizeof(uintptr_t) ||
+	    h->code_len > SIZE_MAX / 2 || h->names_len > SIZE_MAX / 2 ||
+	    h->word_count > SIZE_MAX / sizeof(*m->words) ||
+	    h->reloc_count > SIZE_MAX / sizeof(*m->relocs) ||
+	    h->symbol_count > SIZE_MAX / sizeof(*m->symbols)) {
+		return false;
+	}
+#ifndef EMFORTH_SPLIT_DICT
+	if (h->names_len != 0) {
+		return false;
+	}
+#endif
+	m->code = malloc(h->code_len + 1);
+	m->names = malloc(h->names_len + 1);
+	m->words = malloc(h->word_count * sizeof(*m->words) + 1);
+	m->relocs = malloc(h->reloc_count * sizeof(*m->relocs) + 1);
+	m->symbols = malloc(h->symbol_count * sizeof(*m->symbols) + 1);
+	m->resolved = calloc(h->symbol_count + 1, sizeof(*m->resolved));
+	return m->code != NULL && m->names != NULL && m->words != NULL &&
+	       m->relocs != NULL && m->symbols != NULL &&
+	       m->resolved != NULL &&
+	       fread(m->code, 1, h->code_len, f) == h->code_len &&
+	       fread(m->names, 1, h->names_len, f) == h->names_len &&
+	       fread(m->words, sizeof(*m->words), h->word_count, f) ==
+		   h->word_count &&
+	       fread(m->relocs, sizeof(*m->relocs), h->reloc_count, f) ==
+		   h->reloc_count &&
+	       fread(m->symbols, sizeof(*m->symbols), h->symbol_count, f) ==
+		   h->symbol_count;
+}
+
+static uint64_t region_len(struct module_in *m, uint32_t region)
+{
+	return region == REGION_NAMES ? m->h.names_len : m->h.code_len;
+}
+
+/* checks offsets, so that applying the module cannot write outside it */
+static const char *module_check(struct module_in *m)
+{
+	uint32_t header_region = m->h.names_len ? REGION_NAMES : REGION_CODE;
+
+	for (uint64_t i = 0; i < m->h.word_count; i++) {
+		uint64_t len = region_len(m, header_region);
+		unsigned char *start =
+		    header_region == REGION_NAMES ? m->names : m->code;
+		dict_header_t h;
+
+		if (m->words[i] % sizeof(uintptr_t) != 0 ||
+		    m->words[i] + sizeof(h) > len) {
+			return "is damaged";
+		}
+		memcpy(&h, start + m->words[i], sizeof(h));
+		if (m->words[i] + sizeof(h) + ALIGN_UP_WORD_T(h.flags.f.length) >
+		    len) {
+			return "is damaged";
+		}
+	}
+	for (uint64_t i = 0; i < m->h.reloc_count; i++) {
+		struct module_reloc *r = &m->relocs[i];
+
+		if (r->region > REGION_NAMES ||
+		    r->offset % sizeof(uintptr_t) != 0 ||
+		    r->offset + sizeof(uintptr_t) > region_len(m, r->region) ||
+		    (r->kind == RELOC_CODE && r->value > m->h.code_len) ||
+		    (r->kind == RELOC_NAMES && r->value > m->h.names_len) ||
+		    (r->kind == RELOC_CODEWORD &&
+		     r->value >= ARRAY_SIZE(codewords)) ||
+		    (r->kind == RELOC_SYMBOL &&
+		     r->value >= m->h.symbol_count) ||
+		    r->kind > RELOC_SYMBOL) {
+			return "is damaged";
+		}
+	}
+	for (uint64_t i = 0; i < m->h.symbol_count; i++) {
+		if (m->symbols[i].len > WORD_NAME_MAX_LEN) {
+			return "is damaged";
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Looks the symbols up. Only calls may wait for a later module, returns
+ * the symbol that cannot, or NULL.
+ */
+static struct module_symbol *module_resolve(struct forth_ctx *ctx,
+					    struct module_in *m)
+{
+	for (uint64_t i = 0; i < m->h.symbol_count; i++) {
+		struct module_symbol *s = &m->symbols[i];
+		dict_header_t *h;
+
+		if (s->kind == SYMBOL_PRIM) {
+			m->resolved[i] = (uintptr_t)prim_by_name(ctx, s->name,
+								  s->len);
+		} else if ((h = find_word_header(ctx, s->name, s->len))) {
+			m->resolved[i] = (uintptr_t)dict_header_cfa(h);
+		}
+	}
+	for (uint64_t i = 0; i < m->h.reloc_count; i++) {
+		struct module_reloc *r = &m->relocs[i];
+
+		if (r->kind == RELOC_SYMBOL && m->resolved[r->value] == 0 &&
+		    (m->symbols[r->value].kind == SYMBOL_PRIM ||
+		     r->addend != 0)) {
+			return &m->symbols[r->value];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief (unresolved) stands in for words a loaded module calls that no
+ * module has defined yet
+ */
+void do_unresolved(struct forth_ctx *ctx)
+{
+	forth_throw(ctx, THROW_UNDEFINED_WORD);
+}
+
+/*
+ * allocates a waiting call for each unresolved symbol relocation, before
+ * anything of the module is applied
+ */
+static bool refs_alloc(struct module_in *m, struct module_ref **refs)
+{
+	*refs = NULL;
+	for (uint64_t i = 0; i < m->h.reloc_count; i++) {
+		struct module_reloc *r = &m->relocs[i];
+		struct module_ref *ref;
+
+		if (r->kind != RELOC_SYMBOL || m->resolved[r->value] != 0) {
+			continue;
+		}
+		ref = malloc(sizeof(*ref));
+		if (ref == NULL) {
+			while (*refs != NULL) {
+				ref = *refs;
+				*refs = ref->next;
+				free(ref);
+			}
+			return false;
+		}
+		ref->next = *refs;
+		*refs = ref;
+	}
+	return true;
+}
+
+/* makes one of the refs from refs_alloc wait for s at cell */
+static void ref_add(struct forth_ctx *ctx, struct module_ref **refs,
+		    uintptr_t *cell, struct module_symbol *s)
+{
+	struct module_ref *r = *refs;
+
+	*refs = r->next;
+	r->cell = cell;
+	r->len = s->len;
+	memcpy(r->name, s->name, sizeof(r->name));
+	r->next = ctx->dict.module_refs;
+	ctx->dict.module_refs = r;
+}
+
+/* patches waiting calls to words that are now defined */
+static void refs_resolve(struct forth_ctx *ctx)
+{
+	struct module_ref **p = &ctx->dict.module_refs;
+
+	while (*p != NULL) {
+		struct module_ref *r = *p;
+		dict_header_t *h = find_word_header(ctx, r->name, r->len);
+		bool stale = (unsigned char *)r->cell >= ctx->dict.here ||
+			     *r->cell != (uintptr_t)do_unresolved;
+
+		if (h == DICT_NULL && !stale) {
+			p = &r->next;
+			continue;
+		}
+		if (!stale) {
+			*r->cell = (uintptr_t)dict_header_cfa(h);
+		}
+		*p = r->next;
+		free(r);
+	}
+}
+
+/*
+ * Copies, relocates and links a checked and resolved module. Everything
+ * that can fail is done first, returns why it failed or NULL.
+ */
+static const char *module_apply(struct forth_ctx *ctx, struct module_in *m)
+{
+	dict_t *d = &ctx->dict;
+	unsigned char *code = (unsigned char *)ALIGN_UP_WORD_T(d->here);
+	unsigned char *names = code;
+	wordlist_t *wl = d->current;
+	struct module_ref *refs;
+
+	if (!dict_reserve(ctx, code - d->here + m->h.code_len)) {
+		return "does not fit";
+	}
+#ifdef EMFORTH_SPLIT_DICT
+	names = (unsigned char *)ALIGN_UP_WORD_T(d->names_here);
+	if (!dict_names_reserve(ctx, names - d->names_here + m->h.names_len)) {
+		return "does not fit";
+	}
+#endif
+	if (!refs_alloc(m, &refs)) {
+		return "out of memory";
+	}
+
+#ifdef EMFORTH_SPLIT_DICT
+	memcpy(names, m->names, m->h.names_len);
+	d->names_here = names + m->h.names_len;
+#endif
+	memcpy(code, m->code, m->h.code_len);
+	d->here = code + m->h.code_len;
+
+	for (uint64_t i = 0; i < m->h.reloc_count; i++) {
+		struct module_reloc *r = &m->relocs[i];
+		unsigned char *cell =
+		    (r->region == REGION_NAMES ? names : code) + r->offset;
+		uintptr_t v = 0;
+
+		switch (r->kind) {
+		case RELOC_CODE:
+			v = (uintptr_t)code + r->value;
+			break;
+		case RELOC_NAMES:
+			v = (uintptr_t)names + r->value;
+			break;
+		case RELOC_CODEWORD:
+			v = (uintptr_t)codewords[r->value];
+			break;
+		case RELOC_SYMBOL:
+			v = m->resolved[r->value] + r->addend;
+			if (m->resolved[r->value] == 0) {
+				v = (uintptr_t)do_unresolved;
+				ref_add(ctx, &refs, (uintptr_t *)cell,
+					&m->symbols[r->value]);
+			}
+			break;
+		}
+		memcpy(cell, &v, sizeof(v));
+	}
+
+	for (uint64_t i = 0; i < m->h.word_count; i++) {
+		dict_header_t *h =
+		    (dict_header_t *)((m->h.names_len ? names : code) +
+				      m->words[i]);
+		unsigned int bucket =
+		    name_hash(dict_header_name(h), h->flags.f.length);
+
+		h->link = wl->latest;
+		h->hlink = wl->buckets[bucket];
+		wl->latest = h;
+		wl->buckets[bucket] = h;
+		d->latest = h;
+	}
+	return NULL;
+}
+
+/**
+ * @brief load-module <module>, adds the words of a module made by
+ * compile-module to the current wordlist
+ */
+void do_load_module(struct forth_ctx *ctx)
+{
+	char name[MAX_INPUT_LEN + 1];
+	int len = read_token(ctx, name, MAX_INPUT_LEN);
+	struct module_in m = {0};
+	struct module_symbol *missing = NULL;
+	const char *error = NULL;
+	FILE *f;
+
+	if (len <= 0) {
+		ctx->plat.puts("load-module: file name expected\n");
+		return;
+	}
+	name[len] = '\0';
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		error = "cannot be read";
+	} else if (!module_read(f, &m)) {
+		error = "is not a module of this build";
+	} else if ((error = module_check(&m)) == NULL &&
+		   (missing = module_resolve(ctx, &m)) != NULL) {
+		error = "needs";
+	} else if (error == NULL) {
+		error = module_apply(ctx, &m);
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+	module_in_free(&m);
+
+	if (error == NULL) {
+		refs_resolve(ctx);
+		return;
+	}
+	ctx->plat.puts("load-module: ");
+	ctx->plat.puts(name);
+	ctx->plat.puts(" ");
+	ctx->plat.puts(error);
+	if (missing != NULL) {
+		char buf[WORD_NAME_MAX_LEN + 1];
+
+		memcpy(buf, missing->name, missing->len);
+		buf[missing->len] = 0;
+		ctx->plat.puts(" ");
+		ctx->plat.puts(buf);
+	}
+	ctx->plat.puts("\n");
+	forth_throw(ctx, THROW_ABORT_MESSAGE);
+}
+
+void module_refs_trim(struct forth_ctx *ctx, unsigned char *new_here)
+{
+	struct module_ref **p = &ctx->dict.module_refs;
+
+	while (*p != NULL) {
+		struct module_ref *r = *p;
+
+		if ((unsigned char *)r->cell < new_here) {
+			p = &r->next;
+			continue;
+		}
+		*p = r->next;
+		free(r);
+	}
+}
+
+void module_refs_free(struct forth_ctx *ctx)
+{
+	while (ctx->dict.module_refs != NULL) {
+		struct module_ref *r = ctx->dict.module_refs;
+
+		ctx->dict.module_refs = r->next;
+		free(r);
+	}
+}
+
+static const struct bultin_entry module_builtin_table[] = {
+    {.word = "compile-module", .c_func = do_compile_module, .flags = {}},
+    {.word = "load-module", .c_func = do_load_module, .flags = {}},
+    {.word = "(unresolved)", .c_func = do_unresolved, .flags = {.f.hidden = 1}},
+};
+
+int module_builtins_init(struct forth_ctx *ctx)
+{
+	ctx->dict.module_refs = NULL;
+	return builtins_register(ctx, module_builtin_table,
+				 ARRAY_SIZE(module_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED && !EMFORTH_TOKEN_THREADED */
@@ -0,0 +1,28 @@
+/**
+ * @file module.h
+ *
+ * @brief Compiled modules for hosted, direct threaded builds.
+ */
+
+#ifndef __MODULE_H__
+#define __MODULE_H__
+
+#include "emforth.h"
+
+#if defined(EMFORTH_HOSTED) && !defined(EMFORTH_TOKEN_THREADED)
+int module_builtins_init(struct forth_ctx *ctx);
+
+/**
+ * @brief forgets the waiting calls in code at or above new_here, called
+ * by dict_rollback.
+ */
+void module_refs_trim(struct forth_ctx *ctx, unsigned char *new_here);
+
+/**
+ * @brief forgets the calls loaded modules left waiting for words, called
+ * by emforth_deinit.
+ */
+void module_refs_free(struct forth_ctx *ctx);
+#endif
+
+#endif /* __MODULE_H__ */
@@ -0,0 +1,502 @@
+/**
+ * @file par.c
+ *
+ * @brief par-map, spawn and join, which run words on a pool of worker
+ * threads.
+ *
+ * Each worker has a context of its own: private stacks, catch frames and
+ * pictured output buffer, so many words can run at once. The dictionary
+ * is not copied, a worker runs a task on the dictionary of the context
+ * that queued it. While tasks run the dictionary is only read, and tasks
+ * should not store to the same memory from two tasks. There is no data
+ * area per worker, here and variables are those of the shared
+ * dictionary, so a task keeps its state on its own stacks or in cells
+ * allotted for it beforehand.
+ *
+ * Nothing else the tasks share is locked either, so what would change it
+ * throws -21 inside a task, see par_task_check(): moving here (defining
+ * words, allot, comma), the heap, blocks and memoized words. dict_rollback()
+ * throws while any task is queued or running, see par_busy().
+ *
+ * Tasks live in a fixed table, a task handle is its index plus one. A
+ * spawned task keeps its slot until it is joined, so every spawn must be
+ * joined, and only once; par-map frees its own. Every worker keeps a deque
+ * of queued tasks: it takes its own newest task first, and when it has
+ * none it steals the oldest task of another worker. A thread waiting in
+ * join or par-map runs queued tasks itself until the one it waits for is
+ * done, which also keeps workers that wait for tasks they spawned from
+ * running out of threads.
+ *
+ * The pool starts on first use with one worker per online CPU, or
+ * EMFORTH_WORKERS of them when that environment variable is set.
+ */
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+#include "par.h"
+
+#ifdef EMFORTH_HOSTED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define PAR_WORKERS_MAX 16
+#define PAR_TASKS_MAX 256u
+
+/* par-map queues about this many chunks per worker, for balance */
+#define PAR_CHUNKS_PER_WORKER 4
+
+enum task_state { TASK_FREE, TASK_QUEUED, TASK_RUNNING, TASK_DONE };
+
+/*
+ * A task replaces each of n cells with what xt leaves for it. spawn
+ * points cells at the task's own arg cell.
+ */
+struct par_task {
+	enum task_state state;
+	struct forth_ctx *parent; /* whose dictionary xt belongs to */
+	stack_cell_t xt;
+	stack_cell_t *cells;
+	stack_cell_t n;
+	stack_cell_t arg;
+	stack_cell_t code; /* what the task threw, or 0 */
+	bool joined;	   /* a join is waiting for it */
+};
+
+/* ring of task indices, the owner works at the bottom, thieves the top */
+struct par_deque {
+	unsigned int slots[PAR_TASKS_MAX];
+	unsigned int top;
+	unsigned int bottom;
+};
+
+struct par_worker {
+	pthread_t thread;
+	int index;
+	struct par_deque deque;
+	struct forth_ctx ctx;
+	struct forth_ctx *owner; /* whose dictionary ctx has now */
+	char hold[HOLD_BUFFER_SIZE];
+};
+
+static struct {
+	pthread_mutex_t lock; /* everything below */
+	pthread_cond_t work;  /* a task was queued */
+	pthread_cond_t done;  /* a task finished */
+	bool started;
+	int worker_count;
+	unsigned int next_worker; /* where threads outside the pool queue */
+	struct par_worker *workers[PAR_WORKERS_MAX];
+	struct par_task tasks[PAR_TASKS_MAX];
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* the worker running on this thread, NULL outside the pool */
+static __thread struct par_worker *self;
+
+/* tasks run_task is running on this thread, nested in each other */
+static __thread int task_depth;
+
+static void par_error(struct forth_ctx *ctx, const char *msg)
+{
+	ctx->plat.puts(msg);
+	ctx->plat.puts("\n");
+	forth_throw(ctx, THROW_ABORT_MESSAGE);
+}
+
+/* == deques, called with pool.lock held == */
+
+static void deque_push(struct par_deque *d, unsigned int task)
+{
+	d->slots[d->bottom++ % PAR_TASKS_MAX] = task;
+}
+
+static bool deque_pop(struct par_deque *d, unsigned int *task)
+{
+	if (d->top == d->bottom) {
+		return false;
+	}
+	*task = d->slots[--d->bottom % PAR_TASKS_MAX];
+	return true;
+}
+
+static bool deque_steal(struct par_deque *d, unsigned int *task)
+{
+	if (d->top == d->bottom) {
+		return false;
+	}
+	*task = d->slots[d->top++ % PAR_TASKS_MAX];
+	return true;
+}
+
+static void queue_task(unsigned int task)
+{
+	struct par_worker *w = self;
+
+	if (w == NULL) {
+		w = pool.workers[pool.next_worker++ % pool.worker_count];
+	}
+	pool.tasks[task].state = TASK_QUEUED;
+	deque_push(&w->deque, task);
+	pthread_cond_signal(&pool.work);
+}
+
+/* next task for this thread to run, its own first */
+static struct par_task *take_task(void)
+{
+	unsigned int task;
+	int start = self ? self->index : 0;
+
+	if (self != NULL && deque_pop(&self->deque, &task)) {
+		goto found;
+	}
+	for (int i = 0; i < pool.worker_count; i++) {
+		struct par_worker *w =
+		    pool.workers[(start + i) % pool.worker_count];
+
+		if (deque_steal(&w->deque, &task)) {
+			goto found;
+		}
+	}
+	return NULL;
+
+found:
+	pool.tasks[task].state = TASK_RUNNING;
+	return &pool.tasks[task];
+}
+
+/* == running tasks == */
+
+/*
+ * Runs t on ctx, which may be in the middle of running another task, so
+ * its dictionary view is put back afterwards.
+ */
+static void run_task(struct forth_ctx *ctx, struct par_task *t)
+{
+	struct catch_frame frame;
+	dict_t saved_dict = ctx->dict;
+	stack_cell_t *saved_base = ctx->intrp_data.base;
+	int (*saved_puts)(const char *) = ctx->plat.puts;
+	struct forth_ctx *saved_owner = self ? self->owner : NULL;
+
+	if (ctx != t->parent) {
+		ctx->dict = t->parent->dict;
+		ctx->intrp_data.base = t->parent->intrp_data.base;
+		ctx->plat.puts = t->parent->plat.puts;
+		if (self != NULL && ctx == &self->ctx) {
+			self->owner = t->parent;
+		}
+	}
+
+	task_depth++;
+	catch_enter(ctx, &frame);
+	if (setjmp(frame.env) == 0) {
+		for (stack_cell_t i = 0; i < t->n; i++) {
+			stack_push(ctx, t->cells[i]);
+			execute_xt(ctx, t->xt);
+			t->cells[i] = stack_pop(ctx);
+		}
+		catch_leave(ctx, &frame);
+	} else {
+		catch_unwind(ctx, &frame);
+	}
+	task_depth--;
+	t->code = frame.code;
+
+	if (ctx != t->parent) {
+		ctx->dict = saved_dict;
+		ctx->intrp_data.base = saved_base;
+		ctx->plat.puts = saved_puts;
+		if (self != NULL && ctx == &self->ctx) {
+			self->owner = saved_owner;
+		}
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct par_worker *w = arg;
+	struct par_task *t;
+
+	self = w;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		t = take_task();
+		if (t == NULL) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		run_task(&w->ctx, t);
+		pthread_mutex_lock(&pool.lock);
+		t->state = TASK_DONE;
+		pthread_cond_broadcast(&pool.done);
+	}
+	return NULL;
+}
+
+/* a context that only ever runs tasks, see run_task */
+static void worker_ctx_init(struct par_worker *w)
+{
+	struct forth_ctx *ctx = &w->ctx;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->intrp_data.mode = MODE_IMMEDIATE;
+	ctx->intrp_data.budget = SIZE_MAX;
+	ctx->intrp_data.hold_end = w->hold + sizeof(w->hold);
+	ctx->intrp_data.hld = ctx->intrp_data.hold_end;
+	/* plat.getchar stays NULL, a task reading input sees end of file */
+}
+
+/* starts the workers unless they run already, called with the lock held */
+static bool pool_start(void)
+{
+	const char *env = getenv("EMFORTH_WORKERS");
+	long n = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (pool.started) {
+		return true;
+	}
+	if (n < 1) {
+		n = 1;
+	} else if (n > PAR_WORKERS_MAX) {
+		n = PAR_WORKERS_MAX;
+	}
+
+	for (long i = 0; i < n; i++) {
+		struct par_worker *w = calloc(1, sizeof(*w));
+
+		if (w == NULL) {
+			break;
+		}
+		worker_ctx_init(w);
+		w->index = pool.worker_count;
+		pool.workers[pool.worker_count] = w;
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			free(w);
+			break;
+		}
+		pthread_detach(w->thread);
+		pool.worker_count++;
+	}
+	pool.started = pool.worker_count > 0;
+	return pool.started;
+}
+
+/* allocates and queues a task, returns its index or -1 */
+static long task_submit(struct forth_ctx *ctx, stack_cell_t xt,
+			stack_cell_t *cells, stack_cell_t n, stack_cell_t arg)
+{
+	if (!pool_start()) {
+		return -1;
+	}
+	if (self != NULL && ctx == &self->ctx) {
+		/* spawned by a task, the dictionary is its parent's */
+		ctx = self->owner;
+	}
+	for (unsigned int i = 0; i < PAR_TASKS_MAX; i++) {
+		struct par_task *t = &pool.tasks[i];
+
+		if (t->state == TASK_FREE) {
+			*t = (struct par_task){
+			    .parent = ctx, .xt = xt, .n = n, .arg = arg};
+			t->cells = cells ? cells : &t->arg;
+			queue_task(i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Runs queued tasks on ctx until t is done, called with the lock held.
+ * Returns what t threw and frees it.
+ */
+static stack_cell_t task_wait(struct forth_ctx *ctx, struct par_task *t)
+{
+	stack_cell_t code;
+
+	while (t->state != TASK_DONE) {
+		struct par_task *other = take_task();
+
+		if (other == NULL) {
+			pthread_cond_wait(&pool.done, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		run_task(ctx, other);
+		pthread_mutex_lock(&pool.lock);
+		other->state = TASK_DONE;
+		pthread_cond_broadcast(&pool.done);
+	}
+	code = t->code;
+	t->state = TASK_FREE;
+	return code;
+}
+
+/**
+ * @brief whether any task is queued or running, and so may be reading
+ * the dictionary.
+ */
+bool par_busy(void)
+{
+	bool busy = false;
+
+	pthread_mutex_lock(&pool.lock);
+	for (unsigned int i = 0; i < PAR_TASKS_MAX && !busy; i++) {
+		busy = pool.tasks[i].state == TASK_QUEUED ||
+		       pool.tasks[i].state == TASK_RUNNING;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return busy;
+}
+
+/**
+ * @brief throws -21 when this thread is running a task, for words that
+ * change what tasks share without a lock.
+ */
+void par_task_check(struct forth_ctx *ctx)
+{
+	if (task_depth > 0) {
+		forth_throw(ctx, THROW_UNSUPPORTED);
+	}
+}
+
+/* == words == */
+
+/**
+ * @brief ( x xt -- task ) queues xt to run on x in a worker, join gives
+ * what it leaves on the stack. The task holds a slot until it is joined.
+ */
+void do_spawn(struct forth_ctx *ctx)
+{
+	stack_cell_t xt = stack_pop(ctx);
+	stack_cell_t x = stack_pop(ctx);
+	long task;
+
+	pthread_mutex_lock(&pool.lock);
+	task = task_submit(ctx, xt, NULL, 1, x);
+	pthread_mutex_unlock(&pool.lock);
+	if (task < 0) {
+		par_error(ctx, "spawn: too many tasks not joined");
+	}
+	stack_push(ctx, task + 1);
+}
+
+/**
+ * @brief ( task -- y ) waits for a spawned task and pushes its result, or
+ * throws what it threw.
+ */
+void do_join(struct forth_ctx *ctx)
+{
+	stack_cell_t task = stack_pop(ctx) - 1;
+	stack_cell_t code, result;
+
+	pthread_mutex_lock(&pool.lock);
+	if (task < 0 || task >= (stack_cell_t)PAR_TASKS_MAX ||
+	    pool.tasks[task].state == TASK_FREE ||
+	    pool.tasks[task].cells != &pool.tasks[task].arg ||
+	    pool.tasks[task].joined) {
+		pthread_mutex_unlock(&pool.lock);
+		par_error(ctx, "join: not a task");
+	}
+	/* a second join of the task fails above, not after it is freed */
+	pool.tasks[task].joined = true;
+	code = task_wait(ctx, &pool.tasks[task]);
+	result = pool.tasks[task].arg;
+	pthread_mutex_unlock(&pool.lock);
+
+	if (code != 0) {
+		forth_throw(ctx, code);
+	}
+	stack_push(ctx, result);
+}
+
+/**
+ * @brief ( xt addr n -- ) replaces each of the n cells at addr with what
+ * xt ( x -- y ) makes of it, spread over the workers. Throws the first
+ * error a chunk threw, after all of them are done.
+ */
+void do_par_map(struct forth_ctx *ctx)
+{
+	stack_cell_t n = stack_pop(ctx);
+	stack_cell_t addr = stack_pop(ctx);
+	stack_cell_t xt = stack_pop(ctx);
+	long chunks[PAR_WORKERS_MAX * PAR_CHUNKS_PER_WORKER];
+	int chunk_count = 0;
+	stack_cell_t chunk, code = 0;
+
+	if (n <= 0) {
+		return;
+	}
+	if ((size_t)n > SIZE_MAX / sizeof(stack_cell_t) ||
+	    !store_valid(ctx, addr, n * sizeof(stack_cell_t))) {
+		forth_throw(ctx, THROW_INVALID_ADDRESS);
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if (!pool_start()) {
+		pthread_mutex_unlock(&pool.lock);
+		par_error(ctx, "par-map: no workers");
+	}
+	chunk = (n + ARRAY_SIZE(chunks) - 1) / ARRAY_SIZE(chunks);
+	if (chunk < n / (pool.worker_count * PAR_CHUNKS_PER_WORKER)) {
+		chunk = n / (pool.worker_count * PAR_CHUNKS_PER_WORKER);
+	}
+	for (stack_cell_t i = 0; i < n; i += chunk) {
+		stack_cell_t *cells = (stack_cell_t *)addr + i;
+		long task = task_submit(ctx, xt, cells,
+					n - i < chunk ? n - i : chunk, 0);
+
+		if (task < 0) {
+			/* no free slot, this thread does the rest itself */
+			struct par_task t = {.parent = ctx,
+					     .xt = xt,
+					     .cells = cells,
+					     .n = n - i};
+
+			pthread_mutex_unlock(&pool.lock);
+			run_task(ctx, &t);
+			pthread_mutex_lock(&pool.lock);
+			code = t.code;
+			break;
+		}
+		chunks[chunk_count++] = task;
+	}
+	for (int i = 0; i < chunk_count; i++) {
+		stack_cell_t c = task_wait(ctx, &pool.tasks[chunks[i]]);
+
+		if (code == 0) {
+			code = c;
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (code != 0) {
+		forth_throw(ctx, code);
+	}
+}
+
+static const struct bultin_entry par_builtin_table[] = {
+    {.word = "spawn", .c_func = do_spawn, .flags = {}},
+    {.word = "join", .c_func = do_join, .flags = {}},
+    {.word = "par-map", .c_func = do_par_map, .flags = {}},
+};
+
+int par_builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, par_builtin_table,
+				 ARRAY_SIZE(par_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
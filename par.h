@@ -0,0 +1,17 @@
+/**
+ * @file par.h
+ *
+ * @brief Words that run other words on a pool of worker threads.
+ */
+
+#ifndef __PAR_H__
+#define __PAR_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+int par_builtins_init(struct forth_ctx *ctx);
+bool par_busy(void);
+#endif
+
+#endif /* __PAR_H__ */
@@ -2,51 +2,33 @@
  * @file platform_web.c
  * @brief Implementation of platform-specific functions for web (Emscripten)
  * environment.
+ *
+ * The page owns the event loop: it feeds typed lines with emforth_web_feed
+ * and calls emforth_web_step from timers until it reports that all input
+ * was interpreted, so long running words never block the browser.
  */
 
-#include <emscripten.h> // Required for emscripten_sleep and EM_ASM_INT macros
+#include "emforth.h"
+#include <emscripten.h>
+
+/* instructions per step, small enough to keep the page responsive */
+#define WEB_STEP_BUDGET 100000
 
 extern struct forth_ctx ctx;
-int emforth_web_getchar()
+
+/**
+ * @brief buffers input bytes, returns how many were accepted. The page
+ * keeps the rest and feeds it again after stepping.
+ */
+EMSCRIPTEN_KEEPALIVE int emforth_web_feed(const char *buf, int len)
 {
-	while (1) {
-		/*
-		 * Execute inline JavaScript to request a character from the
-		 * `Module.stdin` function defined in `template.html`.
-		 *
-		 * - If `Module.stdin()` returns `undefined` (JS buffer is
-		 * empty), we treat this as a signal to yield and return a
-		 * sentinel value (-2).
-		 * - Otherwise, return the character code received from JS.
-		 */
-		int ch = EM_ASM_INT({
-			var charCode = Module.stdin();
-			if (charCode == = undefined) {
-				/* Sentinel value: indicates that C should yield
-				 */
-				return -2;
-			}
-			/* Return the character received from JS */
-			return charCode;
-		});
+	return (int)emforth_feed(&ctx, buf, len);
+}
 
-		if (ch == -2) {
-			/*
-			 * No character available from JavaScript's input
-			 * buffer. Call emscripten_sleep(0) to explicitly yield
-			 * control back to the browser's event loop. ASYNCIFY
-			 * will suspend the C stack at this point, and resume
-			 * when JS puts data into the input buffer and
-			 * Module.stdin() can return a character.
-			 */
-			emscripten_sleep(0); /* Sleep for 0ms, effectively a
-						non-blocking yield */
-		} else {
-			/*
-			 * A character has been received from JavaScript.
-			 * Return it to the calling C function.
-			 */
-			return ch;
-		}
-	}
+/**
+ * @brief interprets for one time slice, returns an emforth_status_e
+ */
+EMSCRIPTEN_KEEPALIVE int emforth_web_step(void)
+{
+	return emforth_step(&ctx, WEB_STEP_BUDGET);
 }
@@ -0,0 +1,471 @@
+/**
+ * @file prof.c
+ *
+ * @brief A sampling profiler that finds out which words the time goes to.
+ *
+ * 'profile-start' arms a SIGPROF timer that fires every PROF_INTERVAL_US
+ * microseconds of CPU time. The handler copies ip and the top of the
+ * return stack of the context that started profiling into a buffer that
+ * was allocated beforehand, and does nothing else. 'profile-stop' disarms
+ * it, and 'profile-save <file>' turns the samples into word names through
+ * the dictionary and writes them as folded stacks, one line per distinct
+ * call stack with the number of samples that had it:
+ *
+ *   outer;inner;+ 42
+ *
+ * which flamegraph.pl and similar tools read. Samples taken while the
+ * outer interpreter itself runs are put under [interpreter].
+ *
+ * ip points just past the cell running now, so it names both the
+ * innermost colon definition and the primitive it is in, without the
+ * inner interpreter doing anything for the profiler. Every other frame is
+ * a return address on the return stack. Locals share that stack, so
+ * frames are taken apart along the fp chain and only cells that follow a
+ * call are taken for return addresses. Samples are resolved when saved,
+ * words forgotten since then show up as [unknown].
+ *
+ * Only the thread that ran profile-start is sampled, time spent in par.c
+ * workers is not attributed.
+ */
+#define _DEFAULT_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+#include "prof.h"
+
+#ifdef EMFORTH_HOSTED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define PROF_INTERVAL_US 1000
+#define PROF_SAMPLES_MAX 16384u
+
+/* return stack cells copied per sample, deeper frames are cut off */
+#define PROF_DEPTH_MAX 32
+
+struct prof_sample {
+	thread_t *ip;
+	stack_cell_t rsp;
+	stack_cell_t fp;
+	stack_cell_t depth;		  /* cells in frames */
+	thread_t *frames[PROF_DEPTH_MAX]; /* rstack[rsp - depth] onwards */
+};
+
+static struct {
+	struct prof_sample *samples;
+	volatile size_t count;
+	volatile size_t dropped; /* samples that did not fit */
+	volatile bool running;
+	bool handler_set; /* stays set, a late SIGPROF must not kill us */
+} prof;
+
+/* the context profiled on this thread, set while the timer runs */
+static __thread struct forth_ctx *volatile prof_self;
+
+static void prof_handler(int sig)
+{
+	struct forth_ctx *ctx = prof_self;
+	struct prof_sample *s;
+	stack_cell_t rsp;
+
+	(void)sig;
+	if (ctx == NULL || !prof.running) {
+		return;
+	}
+	if (prof.count >= PROF_SAMPLES_MAX) {
+		prof.dropped++;
+		return;
+	}
+
+	s = &prof.samples[prof.count];
+	rsp = ctx->rsp;
+	if (rsp > RSTACK_SIZE_MAX) {
+		rsp = RSTACK_SIZE_MAX;
+	}
+	s->ip = ctx->ip;
+	s->rsp = rsp;
+	s->fp = ctx->fp;
+	s->depth = rsp < PROF_DEPTH_MAX ? rsp : PROF_DEPTH_MAX;
+	for (stack_cell_t i = 0; i < s->depth; i++) {
+		s->frames[i] = ctx->rstack[rsp - s->depth + i];
+	}
+	prof.count++;
+}
+
+static bool prof_timer(long usec)
+{
+	struct itimerval it = {
+	    .it_interval = {.tv_sec = 0, .tv_usec = usec},
+	    .it_value = {.tv_sec = 0, .tv_usec = usec},
+	};
+
+	return setitimer(ITIMER_PROF, &it, NULL) == 0;
+}
+
+static void prof_stop(void)
+{
+	if (!prof.running) {
+		return;
+	}
+	prof.running = false;
+	prof_timer(0);
+	prof_self = NULL;
+}
+
+/* == resolving samples == */
+
+struct prof_word {
+	unsigned char *cfa;
+	dict_header_t *header;
+};
+
+struct prof_map {
+	struct forth_ctx *ctx;
+	struct prof_word *words; /* every word, by codeword address */
+	size_t count;
+};
+
+static int prof_word_compare(const void *a, const void *b)
+{
+	const struct prof_word *wa = a, *wb = b;
+
+	return (wa->cfa > wb->cfa) - (wa->cfa < wb->cfa);
+}
+
+static bool prof_map_init(struct prof_map *m, struct forth_ctx *ctx)
+{
+	size_t n = 0;
+
+	m->ctx = ctx;
+	for (int pass = 0; pass < 2; pass++) {
+		for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+			for (dict_header_t *h = wl->latest; h; h = h->link) {
+				if (pass == 1) {
+					m->words[n].cfa =
+					    (unsigned char *)dict_header_cfa(h);
+					m->words[n].header = h;
+				}
+				n++;
+			}
+		}
+		if (pass == 0) {
+			m->words = calloc(n ? n : 1, sizeof(*m->words));
+			if (m->words == NULL) {
+				return false;
+			}
+			n = 0;
+		}
+	}
+	m->count = n;
+	qsort(m->words, n, sizeof(*m->words), prof_word_compare);
+	return true;
+}
+
+/* the word whose code addr is in, NULL when outside the dictionary */
+static struct prof_word *prof_word_at(struct prof_map *m, const void *addr)
+{
+	size_t lo = 0, hi = m->count;
+
+	if (!addr_valid(m->ctx, (stack_cell_t)addr, 1) ||
+	    (unsigned char *)addr >= m->ctx->dict.here) {
+		return NULL;
+	}
+	/* last word with cfa <= addr */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (m->words[mid].cfa <= (unsigned char *)addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0 ? &m->words[lo - 1] : NULL;
+}
+
+/* header of the primitive fn */
+static dict_header_t *prof_prim_header(struct prof_map *m, word_t fn)
+{
+	for (size_t i = 0; i < m->count; i++) {
+		if (*(word_t *)m->words[i].cfa == fn &&
+		    !m->words[i].header->flags.f.hidden) {
+			return m->words[i].header;
+		}
+	}
+	return DICT_NULL;
+}
+
+/*
+ * The word a thread cell calls: a primitive, or a word with a codeword.
+ * NULL when the cell is not an xt, e.g. a literal or branch offset.
+ */
+static dict_header_t *prof_cell_word(struct prof_map *m, thread_t cell)
+{
+	struct prof_word *w;
+	word_t *cfa;
+
+#ifdef EMFORTH_TOKEN_THREADED
+	if (cell < PRIM_TABLE_MAX) {
+		return cell < prim_count ? prof_prim_header(m, prim_table[cell])
+					 : DICT_NULL;
+	}
+	cfa = token_cfa(m->ctx, cell);
+#else
+	if (prim_index(cell) != PRIM_TABLE_MAX) {
+		return prof_prim_header(m, cell);
+	}
+	cfa = (word_t *)cell;
+	if ((uintptr_t)cfa % sizeof(word_t) != 0) {
+		return DICT_NULL;
+	}
+#endif
+	w = prof_word_at(m, cfa);
+	if (w == NULL || w->cfa != (unsigned char *)cfa || !is_codeword(*cfa)) {
+		return DICT_NULL;
+	}
+	return w->header;
+}
+
+/* whether a return stack cell is the address after a call */
+static bool prof_return_address(struct prof_map *m, thread_t *r)
+{
+	struct prof_word *w = prof_word_at(m, r);
+
+	if (w == NULL || (uintptr_t)r % sizeof(thread_t) != 0 ||
+	    (unsigned char *)(r - 1) < w->cfa + sizeof(word_t)) {
+		return false;
+	}
+	return prof_cell_word(m, r[-1]) != DICT_NULL;
+}
+
+/* appends a frame name, ; and spaces would break the folded format */
+static void prof_append(char *line, size_t *len, size_t size,
+			const char *name, size_t name_len)
+{
+	if (*len > 0 && *len + 1 < size) {
+		line[(*len)++] = ';';
+	}
+	for (size_t i = 0; i < name_len && *len + 1 < size; i++) {
+		char c = name[i];
+
+		line[(*len)++] = (c == ';' || c == ' ') ? '_' : c;
+	}
+	line[*len] = 0;
+}
+
+static void prof_append_word(char *line, size_t *len, size_t size,
+			     dict_header_t *h)
+{
+	if (h == DICT_NULL) {
+		prof_append(line, len, size, "[unknown]", 9);
+		return;
+	}
+	prof_append(line, len, size, dict_header_name(h), h->flags.f.length);
+}
+
+#define PROF_LINE_MAX ((PROF_DEPTH_MAX + 3) * (WORD_NAME_MAX_LEN + 1) + 1)
+
+/* writes the call stack of s into line, outermost word first */
+static void prof_fold(struct prof_map *m, struct prof_sample *s, char *line)
+{
+	dict_header_t *stack[PROF_DEPTH_MAX + 2];
+	int n = 0;
+	size_t len = 0;
+	stack_cell_t fp = s->fp;
+	struct prof_word *inner;
+
+	line[0] = 0;
+	if (s->ip == NULL) {
+		prof_append(line, &len, PROF_LINE_MAX, "[interpreter]", 13);
+		return;
+	}
+
+	/* innermost first, reversed when written */
+	inner = prof_word_at(m, s->ip - 1);
+	if (inner != NULL &&
+	    (unsigned char *)(s->ip - 1) >= inner->cfa + sizeof(word_t)) {
+		dict_header_t *leaf = prof_cell_word(m, s->ip[-1]);
+
+		if (leaf != DICT_NULL) {
+			stack[n++] = leaf;
+		}
+	}
+	stack[n++] = inner ? inner->header : DICT_NULL;
+
+	for (stack_cell_t i = s->rsp - 1; i >= s->rsp - s->depth; i--) {
+		thread_t *r = s->frames[i - (s->rsp - s->depth)];
+
+		if (fp > 0 && i == fp - 1) {
+			/* saved fp of a locals frame, the locals are above */
+			fp = (stack_cell_t)r;
+			continue;
+		}
+		if (r != NULL && prof_return_address(m, r)) {
+			stack[n++] = prof_word_at(m, r)->header;
+		}
+	}
+
+	if (s->depth < s->rsp) {
+		prof_append(line, &len, PROF_LINE_MAX, "[truncated]", 11);
+	}
+	while (n > 0) {
+		prof_append_word(line, &len, PROF_LINE_MAX, stack[--n]);
+	}
+}
+
+static int prof_line_compare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* writes the samples as folded stacks, returns false on errors */
+static bool prof_write(struct forth_ctx *ctx, FILE *f)
+{
+	struct prof_map m;
+	char **lines;
+	size_t count = prof.count;
+	bool ok = true;
+
+	if (!prof_map_init(&m, ctx)) {
+		return false;
+	}
+	lines = calloc(count ? count : 1, sizeof(*lines));
+	if (lines == NULL) {
+		free(m.words);
+		return false;
+	}
+	for (size_t i = 0; i < count && ok; i++) {
+		char line[PROF_LINE_MAX];
+
+		prof_fold(&m, &prof.samples[i], line);
+		lines[i] = strdup(line);
+		ok = lines[i] != NULL;
+	}
+
+	if (ok) {
+		qsort(lines, count, sizeof(*lines), prof_line_compare);
+		for (size_t i = 0; i < count;) {
+			size_t j = i + 1;
+
+			while (j < count && strcmp(lines[i], lines[j]) == 0) {
+				j++;
+			}
+			fprintf(f, "%s %zu\n", lines[i], j - i);
+			i = j;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(lines[i]);
+	}
+	free(lines);
+	free(m.words);
+	return ok;
+}
+
+/* == words == */
+
+/**
+ * @brief ( -- ) starts sampling this context, dropping earlier samples
+ */
+void do_profile_start(struct forth_ctx *ctx)
+{
+	struct sigaction sa;
+
+	if (prof.running) {
+		ctx->plat.puts("profile-start: already profiling\n");
+		return;
+	}
+	if (prof.samples == NULL) {
+		prof.samples = malloc(PROF_SAMPLES_MAX * sizeof(*prof.samples));
+		if (prof.samples == NULL) {
+			ctx->plat.puts("profile-start: out of memory\n");
+			return;
+		}
+	}
+	if (!prof.handler_set) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = prof_handler;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGPROF, &sa, NULL) != 0) {
+			ctx->plat.puts("profile-start: cannot handle SIGPROF\n");
+			return;
+		}
+		prof.handler_set = true;
+	}
+	prof.count = 0;
+	prof.dropped = 0;
+	prof_self = ctx;
+	prof.running = true;
+	if (!prof_timer(PROF_INTERVAL_US)) {
+		prof_stop();
+		ctx->plat.puts("profile-start: cannot start timer\n");
+	}
+}
+
+/**
+ * @brief ( -- ) stops sampling, the samples are kept for profile-save
+ */
+void do_profile_stop(struct forth_ctx *ctx)
+{
+	(void)ctx;
+	prof_stop();
+}
+
+/**
+ * @brief profile-save <file>, stops sampling and writes the samples as
+ * folded stacks
+ */
+void do_profile_save(struct forth_ctx *ctx)
+{
+	char name[MAX_INPUT_LEN + 1];
+	int len = read_token(ctx, name, MAX_INPUT_LEN);
+	FILE *f;
+	bool ok;
+
+	if (len <= 0) {
+		ctx->plat.puts("profile-save: file name expected\n");
+		return;
+	}
+	name[len] = '\0';
+	prof_stop();
+
+	f = fopen(name, "w");
+	if (f == NULL) {
+		ctx->plat.puts("profile-save: cannot write ");
+		ctx->plat.puts(name);
+		ctx->plat.puts("\n");
+		return;
+	}
+	ok = prof_write(ctx, f) && !ferror(f);
+	if (fclose(f) != 0 || !ok) {
+		ctx->plat.puts("profile-save: cannot write ");
+		ctx->plat.puts(name);
+		ctx->plat.puts("\n");
+	}
+	if (prof.dropped > 0) {
+		ctx->plat.puts("profile-save: sample buffer was full\n");
+	}
+}
+
+static const struct bultin_entry prof_builtin_table[] = {
+    {.word = "profile-start", .c_func = do_profile_start, .flags = {}},
+    {.word = "profile-stop", .c_func = do_profile_stop, .flags = {}},
+    {.word = "profile-save", .c_func = do_profile_save, .flags = {}},
+};
+
+int prof_builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, prof_builtin_table,
+				 ARRAY_SIZE(prof_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
@@ -0,0 +1,16 @@
+/**
+ * @file prof.h
+ *
+ * @brief A sampling profiler for hosted builds.
+ */
+
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+int prof_builtins_init(struct forth_ctx *ctx);
+#endif
+
+#endif /* __PROF_H__ */
@@ -0,0 +1,914 @@
+/**
+ * @file save_c.c
+ *
+ * @brief save-c, which translates the colon definitions in the dictionary
+ * to C.
+ *
+ * 'save-c app.c' writes a translation unit with one C function per colon
+ * definition made after emforth_init. Calls to other colon definitions
+ * become direct C calls, branches become gotos, literals are pushed by
+ * the function itself (and folded when simple stack and arithmetic words
+ * work on them only), and those words are expanded to C. Other primitives
+ * are called through pointers that are looked up by name when the file
+ * is loaded, so the file does not depend on what the runtime names its C
+ * functions, nor on the order in which primitives were registered.
+ *
+ * The file ends with app_init(ctx), named after the file, which registers
+ * the translated words as primitives in the current wordlist. Build it
+ * with the runtime and call it after emforth_init:
+ *
+ *   emforth_init(&ctx, ...);
+ *   app_init(&ctx);
+ *
+ * Only colon definitions are translated. Constants, values, variables
+ * and words made by create have no C function, and markers, vocabularies
+ * and anything else that pushes a dictionary address would be wrong in
+ * another process, so these are left out with a comment saying why,
+ * together with every definition that calls or ticks one of them.
+ * Translated words run to completion, emforth_step cannot suspend them.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+#include "save_c.h"
+
+#ifdef EMFORTH_HOSTED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+enum inline_op {
+	INL_ADD,
+	INL_SUB,
+	INL_MUL,
+	INL_DROP,
+	INL_DUP,
+	INL_SWAP,
+	INL_OVER,
+	INL_INCR,
+	INL_DECR,
+	INL_EQUAL,
+	INL_LESS,
+	INL_GREATER,
+	INL_ZERO_EQUAL,
+};
+
+/*
+ * C for primitives that are simple enough to expand, popping through
+ * stack_pop so that underflow still throws.
+ */
+static const struct {
+	word_t fn;
+	unsigned char inputs;
+	const char *c;
+} inline_prims[] = {
+    [INL_ADD] = {do_plus, 2, "stack_push(ctx, a + b);"},
+    [INL_SUB] = {do_minus, 2, "stack_push(ctx, a - b);"},
+    [INL_MUL] = {do_multiply, 2, "stack_push(ctx, a * b);"},
+    [INL_DROP] = {do_drop, 1, ""},
+    [INL_DUP] = {do_dup, 1, "stack_push(ctx, b); stack_push(ctx, b);"},
+    [INL_SWAP] = {do_swap, 2, "stack_push(ctx, b); stack_push(ctx, a);"},
+    [INL_OVER] = {do_over, 2,
+		  "stack_push(ctx, a); stack_push(ctx, b); stack_push(ctx, a);"},
+    [INL_INCR] = {do_incr, 1, "stack_push(ctx, b + 1);"},
+    [INL_DECR] = {do_decr, 1, "stack_push(ctx, b - 1);"},
+    [INL_EQUAL] = {do_equal, 2, "stack_push(ctx, a == b);"},
+    [INL_LESS] = {do_less_than, 2, "stack_push(ctx, a < b);"},
+    [INL_GREATER] = {do_greater_than, 2, "stack_push(ctx, a > b);"},
+    [INL_ZERO_EQUAL] = {do_zero_equal, 1, "stack_push(ctx, b == 0);"},
+};
+
+enum op_kind {
+	OP_PRIM,   /* call prims[a] */
+	OP_INLINE, /* expand inline_prims[a] */
+	OP_WORD,   /* call translated word a */
+	OP_LIT,	   /* push a */
+	OP_TICK,   /* push the xt of translated word a, or prims[b] if a < 0 */
+	OP_BRANCH, /* goto cell a */
+	OP_0BRANCH,
+	OP_OF,	   /* (of), goto cell a unless equal */
+	OP_SWITCH, /* (jumptable) on values from a, b of them */
+	OP_CASE,   /* goto cell a for value b of the switch, default if -1 */
+	OP_SWITCH_END,
+	OP_EXIT,
+	OP_LOCALS,  /* a locals, the first b taken from the stack */
+	OP_UNLOCALS,
+	OP_LOCAL_FETCH, /* local a */
+	OP_LOCAL_STORE,
+};
+
+struct op {
+	enum op_kind kind;
+	size_t cell; /* index of its first thread cell in the body */
+	stack_cell_t a, b;
+};
+
+struct translated_word {
+	dict_header_t *header;
+	word_t *cfa;
+	struct op *ops;
+	size_t op_count;
+	size_t cells; /* length of the body in thread cells */
+	stack_cell_t locals;
+	const char *skipped; /* why it is not translated, or NULL */
+};
+
+struct translation {
+	struct forth_ctx *ctx;
+	struct translated_word *words;
+	size_t word_count;
+	word_t *prims; /* primitives called or ticked */
+	size_t prim_count;
+};
+
+static int cfa_compare(const void *a, const void *b)
+{
+	const struct translated_word *wa = a, *wb = b;
+
+	return (wa->cfa > wb->cfa) - (wa->cfa < wb->cfa);
+}
+
+/* finds the colon definitions above the fence, oldest first */
+static bool collect_words(struct translation *t)
+{
+	struct forth_ctx *ctx = t->ctx;
+	size_t n = 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+			for (dict_header_t *h = wl->latest; h; h = h->link) {
+				word_t *cfa = dict_header_cfa(h);
+
+				if ((unsigned char *)cfa < ctx->dict.fence ||
+				    h->flags.f.hidden || *cfa != do_docol) {
+					continue;
+				}
+				if (pass == 1) {
+					t->words[n].header = h;
+					t->words[n].cfa = cfa;
+				}
+				n++;
+			}
+		}
+		if (pass == 0) {
+			t->words = calloc(n ? n : 1, sizeof(*t->words));
+			if (t->words == NULL) {
+				return false;
+			}
+			n = 0;
+		}
+	}
+	t->word_count = n;
+	qsort(t->words, n, sizeof(*t->words), cfa_compare);
+	return true;
+}
+
+static long find_translated(struct translation *t, word_t *cfa)
+{
+	for (size_t i = 0; i < t->word_count; i++) {
+		if (t->words[i].cfa == cfa) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* index of fn in the primitives the file looks up, added if needed */
+static long add_prim(struct translation *t, word_t fn)
+{
+	for (size_t i = 0; i < t->prim_count; i++) {
+		if (t->prims[i] == fn) {
+			return i;
+		}
+	}
+	word_t *prims = realloc(t->prims, (t->prim_count + 1) * sizeof(fn));
+	if (prims == NULL) {
+		return -1;
+	}
+	t->prims = prims;
+	t->prims[t->prim_count] = fn;
+	return t->prim_count++;
+}
+
+/* header of the primitive fn, newest first */
+static dict_header_t *prim_header(struct forth_ctx *ctx, word_t fn)
+{
+	for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+		for (dict_header_t *h = wl->latest; h; h = h->link) {
+			if (*dict_header_cfa(h) == fn && !h->flags.f.hidden) {
+				return h;
+			}
+		}
+	}
+	return DICT_NULL;
+}
+
+static bool points_into_dict(struct forth_ctx *ctx, stack_cell_t n)
+{
+#ifdef EMFORTH_SPLIT_DICT
+	if ((uintptr_t)n >= (uintptr_t)ctx->dict.names &&
+	    (uintptr_t)n < (uintptr_t)ctx->dict.names_limit) {
+		return true;
+	}
+#endif
+	return addr_valid(ctx, n, 1);
+}
+
+/*
+ * Splits an xt into the translated word it calls, or the primitive it
+ * calls. Returns false for colon definitions that are not translated.
+ */
+static bool resolve_xt(struct translation *t, stack_cell_t xt, long *word,
+		       word_t *prim)
+{
+	word_t *cfa;
+
+	*word = -1;
+	*prim = NULL;
+#ifdef EMFORTH_TOKEN_THREADED
+	if (xt < PRIM_TABLE_MAX) {
+		*prim = prim_table[xt];
+		return *prim != NULL;
+	}
+	cfa = token_cfa(t->ctx, xt);
+#else
+	cfa = (word_t *)xt;
+	if (!code_addr_valid(t->ctx, cfa) || !is_codeword(*cfa)) {
+		*prim = (word_t)xt;
+		return prim_index(*prim) != PRIM_TABLE_MAX;
+	}
+#endif
+	*word = find_translated(t, cfa);
+	return *word >= 0 && t->words[*word].skipped == NULL;
+}
+
+static bool add_op(struct translated_word *w, enum op_kind kind, size_t cell,
+		   stack_cell_t a, stack_cell_t b)
+{
+	struct op *ops = realloc(w->ops, (w->op_count + 1) * sizeof(*ops));
+
+	if (ops == NULL) {
+		return false;
+	}
+	w->ops = ops;
+	w->ops[w->op_count++] = (struct op){kind, cell, a, b};
+	return true;
+}
+
+/*
+ * Decodes the body of a colon definition. It ends at the first exit that
+ * no branch jumps over.
+ */
+static const char *decode_word(struct translation *t,
+			       struct translated_word *w)
+{
+	thread_t *body = (thread_t *)(w->cfa + 1);
+	thread_t *ip = body;
+	thread_t *last_target = body;
+
+	for (;;) {
+		size_t cell = ip - body;
+		stack_cell_t xt;
+
+		if (!code_addr_valid(t->ctx, ip)) {
+			return "runs past the end of the dictionary";
+		}
+		xt = (stack_cell_t)*ip++;
+		long word;
+		word_t fn;
+		bool ok = true;
+
+		if (!resolve_xt(t, xt, &word, &fn)) {
+			return "calls a word that is not translated";
+		}
+		if (word >= 0) {
+			ok = add_op(w, OP_WORD, cell, word, 0);
+		} else if (fn == do_exit) {
+			ok = add_op(w, OP_EXIT, cell, 0, 0);
+			if (ip > last_target) {
+				w->cells = ip - body;
+				return ok ? NULL : "out of memory";
+			}
+		} else if (fn == do_lit) {
+			stack_cell_t n = thread_literal(ip);
+
+			if (points_into_dict(t->ctx, n)) {
+				return "pushes an address in the dictionary";
+			}
+			ok = add_op(w, OP_LIT, cell, n, 0);
+			ip += LITERAL_THREAD_CELLS;
+#ifdef EMFORTH_TOKEN_THREADED
+		} else if (fn == do_lit16) {
+			ok = add_op(w, OP_LIT, cell, (int16_t)*ip++, 0);
+#endif
+		} else if (fn == do_branch || fn == do_0branch) {
+			thread_t *target = ip + thread_offset(ip) /
+						    (stack_cell_t)sizeof(thread_t);
+
+			if (target < body) {
+				return "branches outside its body";
+			}
+			if (target > last_target) {
+				last_target = target;
+			}
+			ok = add_op(w, fn == do_branch ? OP_BRANCH : OP_0BRANCH,
+				    cell, target - body, 0);
+			ip++;
+		} else if (fn == do_of) {
+			thread_t *target = ip + thread_offset(ip) /
+						    (stack_cell_t)sizeof(thread_t);
+
+			if (target < body) {
+				return "branches outside its body";
+			}
+			if (target > last_target) {
+				last_target = target;
+			}
+			ok = add_op(w, OP_OF, cell, target - body, 0);
+			ip++;
+		} else if (fn == do_jumptable) {
+			stack_cell_t n;
+
+			ok = add_op(w, OP_SWITCH, cell, thread_literal(ip),
+				    thread_offset(ip + LITERAL_THREAD_CELLS));
+			ip += LITERAL_THREAD_CELLS;
+			n = thread_offset(ip++);
+			/* the default first, values without code are left out */
+			for (stack_cell_t i = -1; ok && i < n; i++, ip++) {
+				thread_t *target = ip + thread_offset(ip) /
+						   (stack_cell_t)sizeof(thread_t);
+
+				if (i >= 0 && thread_offset(ip) == 0) {
+					continue;
+				}
+				if (target < body) {
+					return "branches outside its body";
+				}
+				if (target > last_target) {
+					last_target = target;
+				}
+				ok = add_op(w, OP_CASE, ip - body, target - body,
+					    i);
+			}
+			ok = ok && add_op(w, OP_SWITCH_END, ip - 1 - body, 0, 0);
+		} else if (fn == do_tick) {
+			if (!resolve_xt(t, (stack_cell_t)*ip++, &word, &fn)) {
+				return "ticks a word that is not translated";
+			}
+			if (word < 0 && prim_header(t->ctx, fn) == DICT_NULL) {
+				return "ticks a primitive without a name";
+			}
+			ok = add_op(w, OP_TICK, cell, word,
+				    word < 0 ? add_prim(t, fn) : 0);
+		} else if (fn == do_locals_enter) {
+			w->locals = thread_offset(ip + 1);
+			ok = add_op(w, OP_LOCALS, cell, w->locals,
+				    thread_offset(ip));
+			ip += 2;
+		} else if (fn == do_locals_leave) {
+			ok = add_op(w, OP_UNLOCALS, cell, 0, 0);
+		} else if (fn == do_local_fetch || fn == do_local_store) {
+			ok = add_op(w,
+				    fn == do_local_fetch ? OP_LOCAL_FETCH
+							 : OP_LOCAL_STORE,
+				    cell, thread_offset(ip++), 0);
+		} else {
+			long i = ARRAY_SIZE(inline_prims);
+
+			while (--i >= 0 && inline_prims[i].fn != fn)
+				;
+			if (i >= 0) {
+				ok = add_op(w, OP_INLINE, cell, i, 0);
+			} else if (prim_header(t->ctx, fn) == DICT_NULL) {
+				return "calls a primitive without a name";
+			} else {
+				ok = add_op(w, OP_PRIM, cell, add_prim(t, fn), 0);
+			}
+		}
+		if (!ok) {
+			return "out of memory";
+		}
+	}
+}
+
+/* == writing C == */
+
+/* literals waiting to be pushed, so that expansions can fold them */
+#define PENDING_MAX 8
+
+struct emitter {
+	FILE *f; /* NULL while working out which labels are used */
+	stack_cell_t pending[PENDING_MAX];
+	int pending_count;
+	bool *labels; /* cells that get a label */
+	bool *jumps;  /* cells a goto was written for */
+};
+
+static void out(struct emitter *e, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (e->f == NULL) {
+		return;
+	}
+	va_start(ap, fmt);
+	vfprintf(e->f, fmt, ap);
+	va_end(ap);
+}
+
+static void emit_number(struct emitter *e, stack_cell_t n)
+{
+	if (n > -1000000 && n < 1000000) {
+		out(e, "%ld", (long)n);
+	} else {
+		out(e, "(stack_cell_t)0x%llxull",
+			(unsigned long long)(uintptr_t)n);
+	}
+}
+
+static void emit_flush(struct emitter *e)
+{
+	for (int i = 0; i < e->pending_count; i++) {
+		out(e, "\tstack_push(ctx, ");
+		emit_number(e, e->pending[i]);
+		out(e, ");\n");
+	}
+	e->pending_count = 0;
+}
+
+static void emit_literal(struct emitter *e, stack_cell_t n)
+{
+	if (e->pending_count == PENDING_MAX) {
+		emit_flush(e);
+	}
+	e->pending[e->pending_count++] = n;
+}
+
+/* applies an expansion to pending literals, false if it cannot */
+static bool fold_inline(struct emitter *e, enum inline_op op)
+{
+	stack_cell_t *p = &e->pending[e->pending_count - 1];
+	stack_cell_t a, b;
+
+	if (e->pending_count < inline_prims[op].inputs) {
+		return false;
+	}
+	b = p[0];
+	a = inline_prims[op].inputs > 1 ? p[-1] : 0;
+	e->pending_count -= inline_prims[op].inputs;
+
+	switch (op) {
+	case INL_ADD:
+		emit_literal(e, a + b);
+		break;
+	case INL_SUB:
+		emit_literal(e, a - b);
+		break;
+	case INL_MUL:
+		emit_literal(e, a * b);
+		break;
+	case INL_DROP:
+		break;
+	case INL_DUP:
+		emit_literal(e, b);
+		emit_literal(e, b);
+		break;
+	case INL_SWAP:
+		emit_literal(e, b);
+		emit_literal(e, a);
+		break;
+	case INL_OVER:
+		emit_literal(e, a);
+		emit_literal(e, b);
+		emit_literal(e, a);
+		break;
+	case INL_INCR:
+		emit_literal(e, b + 1);
+		break;
+	case INL_DECR:
+		emit_literal(e, b - 1);
+		break;
+	case INL_EQUAL:
+		emit_literal(e, a == b);
+		break;
+	case INL_LESS:
+		emit_literal(e, a < b);
+		break;
+	case INL_GREATER:
+		emit_literal(e, a > b);
+		break;
+	case INL_ZERO_EQUAL:
+		emit_literal(e, b == 0);
+		break;
+	}
+	return true;
+}
+
+
+/* prints a name inside a C comment */
+static void emit_comment_name(FILE *f, dict_header_t *h)
+{
+	const char *name = dict_header_name(h);
+
+	for (int i = 0; i < h->flags.f.length; i++) {
+		/* keep the comment open */
+		bool closes = name[i] == '*' && i + 1 < h->flags.f.length &&
+			      name[i + 1] == '/';
+		fputc(closes ? '.' : name[i], f);
+	}
+}
+
+static void emit_string(FILE *f, const char *s, size_t len)
+{
+	fputc('"', f);
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\' || s[i] == '?') {
+			/* '?' is escaped so that names cannot form trigraphs */
+			fputc('\\', f);
+		}
+		fputc(s[i], f);
+	}
+	fputc('"', f);
+}
+
+static void emit_call_comment(struct emitter *e, dict_header_t *h)
+{
+	if (e->f == NULL) {
+		return;
+	}
+	fprintf(e->f, " /* ");
+	emit_comment_name(e->f, h);
+	fprintf(e->f, " */\n");
+}
+
+static void emit_goto(struct emitter *e, stack_cell_t cell)
+{
+	out(e, "\tgoto L%ld;\n", (long)cell);
+	e->jumps[cell] = true;
+}
+
+static void emit_op(struct translation *t, struct emitter *e, struct op *op)
+{
+	if (op->kind != OP_LIT && op->kind != OP_INLINE &&
+	    op->kind != OP_0BRANCH && op->kind != OP_OF &&
+	    op->kind != OP_LOCAL_STORE) {
+		emit_flush(e);
+	}
+
+	switch (op->kind) {
+	case OP_PRIM:
+		out(e, "\tprims[%ld](ctx);", (long)op->a);
+		emit_call_comment(e, prim_header(t->ctx, t->prims[op->a]));
+		break;
+	case OP_INLINE:
+		if (fold_inline(e, op->a)) {
+			break;
+		}
+		emit_flush(e);
+		out(e, "\t{\n\t\tstack_cell_t b = stack_pop(ctx);\n");
+		if (inline_prims[op->a].inputs > 1) {
+			out(e, "\t\tstack_cell_t a = stack_pop(ctx);\n");
+		}
+		if (op->a == INL_DROP) {
+			out(e, "\t\t(void)b;\n");
+		} else {
+			out(e, "\t\t%s\n", inline_prims[op->a].c);
+		}
+		out(e, "\t}\n");
+		break;
+	case OP_WORD:
+		out(e, "\tw_%ld(ctx);", (long)op->a);
+		emit_call_comment(e, t->words[op->a].header);
+		break;
+	case OP_LIT:
+		emit_literal(e, op->a);
+		break;
+	case OP_TICK:
+		if (op->a >= 0) {
+			out(e, "\tstack_push(ctx, prim_xt(w_%ld));",
+				(long)op->a);
+			emit_call_comment(e, t->words[op->a].header);
+		} else {
+			out(e, "\tstack_push(ctx, prim_xt(prims[%ld]));",
+				(long)op->b);
+			emit_call_comment(e, prim_header(t->ctx, t->prims[op->b]));
+		}
+		break;
+	case OP_BRANCH:
+		emit_goto(e, op->a);
+		break;
+	case OP_0BRANCH:
+		if (e->pending_count > 0) {
+			/* the flag is known, the branch is either always or
+			 * never taken */
+			if (e->pending[--e->pending_count] == 0) {
+				emit_flush(e);
+				emit_goto(e, op->a);
+			}
+			break;
+		}
+		out(e, "\tif (stack_pop(ctx) == 0) {\n\t");
+		emit_goto(e, op->a);
+		out(e, "\t}\n");
+		break;
+	case OP_OF:
+		if (e->pending_count > 0) {
+			/* compared with a literal, as of usually is */
+			stack_cell_t b = e->pending[--e->pending_count];
+
+			emit_flush(e);
+			out(e, "\t{\n\t\tstack_cell_t a = stack_pop(ctx);\n\n");
+			out(e, "\t\tif (a != ");
+			emit_number(e, b);
+			out(e, ") {\n");
+		} else {
+			out(e, "\t{\n\t\tstack_cell_t b = stack_pop(ctx);\n");
+			out(e, "\t\tstack_cell_t a = stack_pop(ctx);\n\n");
+			out(e, "\t\tif (a != b) {\n");
+		}
+		out(e, "\t\t\tstack_push(ctx, a);\n\t\t");
+		emit_goto(e, op->a);
+		out(e, "\t\t}\n\t}\n");
+		break;
+	case OP_SWITCH:
+		out(e, "\t{\n\t\tstack_cell_t x = stack_pop(ctx);\n\n");
+		out(e, "\t\tswitch ((uintptr_t)x - (uintptr_t)");
+		emit_number(e, op->a);
+		out(e, ") {\n");
+		break;
+	case OP_CASE:
+		if (op->b < 0) {
+			out(e, "\t\tdefault:\n\t\t\tstack_push(ctx, x);\n\t\t");
+		} else {
+			out(e, "\t\tcase %ld:\n\t\t", (long)op->b);
+		}
+		emit_goto(e, op->a);
+		break;
+	case OP_SWITCH_END:
+		out(e, "\t\t}\n\t}\n");
+		break;
+	case OP_EXIT:
+		out(e, "\treturn;\n");
+		break;
+	case OP_LOCALS:
+		/* the top of the stack goes to the last initialized local */
+		for (stack_cell_t i = op->b - 1; i >= 0; i--) {
+			out(e, "\tl[%ld] = stack_pop(ctx);\n", (long)i);
+		}
+		for (stack_cell_t i = op->b; i < op->a; i++) {
+			out(e, "\tl[%ld] = 0;\n", (long)i);
+		}
+		break;
+	case OP_UNLOCALS:
+		/* the locals live in the C frame */
+		break;
+	case OP_LOCAL_FETCH:
+		out(e, "\tstack_push(ctx, l[%ld]);\n", (long)op->a);
+		break;
+	case OP_LOCAL_STORE:
+		if (e->pending_count > 0) {
+			out(e, "\tl[%ld] = ", (long)op->a);
+			emit_number(e, e->pending[--e->pending_count]);
+			out(e, ";\n");
+		} else {
+			out(e, "\tl[%ld] = stack_pop(ctx);\n", (long)op->a);
+		}
+		break;
+	}
+}
+
+static void emit_body(struct translation *t, struct emitter *e,
+		      struct translated_word *w)
+{
+	e->pending_count = 0;
+	memset(e->jumps, 0, w->cells);
+	for (size_t i = 0; i < w->op_count; i++) {
+		if (e->labels[w->ops[i].cell]) {
+			emit_flush(e);
+			out(e, "L%zu:\n", w->ops[i].cell);
+		}
+		emit_op(t, e, &w->ops[i]);
+	}
+}
+
+static void emit_word(struct translation *t, FILE *f, size_t index)
+{
+	struct translated_word *w = &t->words[index];
+	struct emitter e = {.f = NULL};
+	bool changed = true;
+
+	fprintf(f, "\n/* : ");
+	emit_comment_name(f, w->header);
+	if (w->skipped != NULL) {
+		fprintf(f, " not translated, it %s */\n", w->skipped);
+		return;
+	}
+	fprintf(f, " */\nstatic void w_%zu(struct forth_ctx *ctx)\n{\n", index);
+	if (w->locals > 0) {
+		fprintf(f, "\tstack_cell_t l[%ld];\n\n", (long)w->locals);
+	}
+
+	/*
+	 * Folding can make a conditional branch always or never taken, so
+	 * its label may go unused, and fewer labels let more code fold.
+	 * Start with a label at every branch target and drop those no goto
+	 * was written for, until nothing changes.
+	 */
+	e.labels = calloc(w->cells, sizeof(bool));
+	e.jumps = calloc(w->cells, sizeof(bool));
+	if (e.labels == NULL || e.jumps == NULL) {
+		fprintf(f, "#error out of memory\n");
+		changed = false;
+	}
+	for (size_t i = 0; changed && i < w->op_count; i++) {
+		if (w->ops[i].kind == OP_BRANCH || w->ops[i].kind == OP_0BRANCH ||
+		    w->ops[i].kind == OP_OF || w->ops[i].kind == OP_CASE) {
+			e.labels[w->ops[i].a] = true;
+		}
+	}
+	while (changed) {
+		emit_body(t, &e, w);
+		changed = memcmp(e.labels, e.jumps, w->cells) != 0;
+		memcpy(e.labels, e.jumps, w->cells);
+	}
+	if (e.labels != NULL && e.jumps != NULL) {
+		e.f = f;
+		emit_body(t, &e, w);
+	}
+	free(e.labels);
+	free(e.jumps);
+	fprintf(f, "}\n");
+}
+
+/*
+ * Decodes every word, until no word is left out because of a word it
+ * refers to.
+ */
+static void translate(struct translation *t)
+{
+	bool changed = true;
+
+	while (changed) {
+		changed = false;
+		for (size_t i = 0; i < t->word_count; i++) {
+			struct translated_word *w = &t->words[i];
+
+			if (w->skipped != NULL) {
+				continue;
+			}
+			w->op_count = 0;
+			w->locals = 0;
+			if (w->header->flags.f.length >= WORD_NAME_MAX_LEN) {
+				w->skipped = "has a name too long for a table";
+			} else {
+				w->skipped = decode_word(t, w);
+			}
+			changed |= w->skipped != NULL;
+		}
+	}
+}
+
+static void emit_file(struct translation *t, FILE *f, const char *init)
+{
+	size_t translated = 0;
+
+	fprintf(f, "/* Generated by emForth save-c, do not edit. */\n"
+		   "#include <string.h>\n\n"
+		   "#include \"builtins.h\"\n"
+		   "#include \"builtins_common.h\"\n"
+		   "#include \"emforth.h\"\n\n"
+		   "/* primitives, looked up by name in %s() */\n"
+		   "static const char *const prim_names[] = {\n",
+		init);
+	for (size_t i = 0; i < t->prim_count; i++) {
+		dict_header_t *h = prim_header(t->ctx, t->prims[i]);
+
+		fprintf(f, "    ");
+		emit_string(f, dict_header_name(h), h->flags.f.length);
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "    NULL,\n};\nstatic word_t prims[%zu];\n\n",
+		t->prim_count + 1);
+
+	for (size_t i = 0; i < t->word_count; i++) {
+		if (t->words[i].skipped == NULL) {
+			fprintf(f, "static void w_%zu(struct forth_ctx *ctx);\n",
+				i);
+			translated++;
+		}
+	}
+	for (size_t i = 0; i < t->word_count; i++) {
+		emit_word(t, f, i);
+	}
+
+	fprintf(f, "\nstatic const struct bultin_entry saved_words[%zu] = {\n",
+		translated ? translated : 1);
+	for (size_t i = 0; i < t->word_count; i++) {
+		dict_header_t *h = t->words[i].header;
+
+		if (t->words[i].skipped != NULL) {
+			continue;
+		}
+		fprintf(f, "    {.word = ");
+		emit_string(f, dict_header_name(h), h->flags.f.length);
+		fprintf(f, ", .c_func = w_%zu, .flags = {%s}},\n", i,
+			h->flags.f.immediate ? ".f.immediate = 1" : "");
+	}
+	fprintf(f, "};\n\n"
+		   "int %s(struct forth_ctx *ctx);\n\n"
+		   "/**\n"
+		   " * @brief registers the translated words, call after "
+		   "emforth_init\n"
+		   " */\n"
+		   "int %s(struct forth_ctx *ctx)\n"
+		   "{\n"
+		   "\tfor (size_t i = 0; prim_names[i] != NULL; i++) {\n"
+		   "\t\tdict_header_t *h = find_word_header(ctx, prim_names[i],\n"
+		   "\t\t\t\t\t\t   strlen(prim_names[i]));\n\n"
+		   "\t\tif (h == NULL || *dict_header_cfa(h) == do_docol) {\n"
+		   "\t\t\treturn -1;\n"
+		   "\t\t}\n"
+		   "\t\tprims[i] = *dict_header_cfa(h);\n"
+		   "\t}\n"
+		   "\treturn builtins_register(ctx, saved_words, %zu);\n"
+		   "}\n",
+		init, init, translated);
+}
+
+/* <name>_init, from the file name without directories and extension */
+static void init_name(const char *file, char *out, size_t size)
+{
+	const char *base = strrchr(file, '/');
+	size_t n = 0;
+
+	base = base ? base + 1 : file;
+	if (*base >= '0' && *base <= '9') {
+		out[n++] = '_';
+	}
+	for (; *base && *base != '.' && n + sizeof("_init") < size; base++) {
+		bool ident = (*base >= 'a' && *base <= 'z') ||
+			     (*base >= 'A' && *base <= 'Z') ||
+			     (*base >= '0' && *base <= '9');
+		out[n++] = ident ? *base : '_';
+	}
+	strcpy(out + n, "_init");
+}
+
+/**
+ * @brief save-c <file>, writes the colon definitions as C
+ */
+void do_save_c(struct forth_ctx *ctx)
+{
+	char name[MAX_INPUT_LEN + 1];
+	char init[MAX_INPUT_LEN + sizeof("_init") + 1];
+	int len = read_token(ctx, name, MAX_INPUT_LEN);
+	struct translation t = {.ctx = ctx};
+	FILE *f;
+
+	if (len <= 0) {
+		ctx->plat.puts("save-c: file name expected\n");
+		return;
+	}
+	name[len] = '\0';
+	init_name(name, init, sizeof(init));
+
+	f = fopen(name, "w");
+	if (f == NULL || !collect_words(&t)) {
+		ctx->plat.puts("save-c: cannot write ");
+		ctx->plat.puts(name);
+		ctx->plat.puts("\n");
+		if (f != NULL) {
+			fclose(f);
+		}
+		return;
+	}
+	translate(&t);
+	emit_file(&t, f, init);
+	if (ferror(f) | fclose(f)) {
+		ctx->plat.puts("save-c: cannot write ");
+		ctx->plat.puts(name);
+		ctx->plat.puts("\n");
+	}
+
+	for (size_t i = 0; i < t.word_count; i++) {
+		free(t.words[i].ops);
+	}
+	free(t.words);
+	free(t.prims);
+}
+
+static const struct bultin_entry save_c_builtin_table[] = {
+    {.word = "save-c", .c_func = do_save_c, .flags = {}},
+};
+
+int save_c_builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, save_c_builtin_table,
+				 ARRAY_SIZE(save_c_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
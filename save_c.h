@@ -0,0 +1,17 @@
+/**
+ * @file save_c.h
+ *
+ * @brief save-c, which writes the colon definitions in the dictionary as
+ * a C file to build with the runtime.
+ */
+
+#ifndef __SAVE_C_H__
+#define __SAVE_C_H__
+
+#include "emforth.h"
+
+#ifdef EMFORTH_HOSTED
+int save_c_builtins_init(struct forth_ctx *ctx);
+#endif
+
+#endif /* __SAVE_C_H__ */
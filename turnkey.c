@@ -0,0 +1,430 @@
+/**
+ * @file turnkey.c
+ *
+ * @brief Turnkey images: 'turnkey <entry> <file>' and emforth_boot.
+ *
+ * A deployed program does not look words up or compile, so all it needs
+ * of the dictionary is the code and data of the words its entry word
+ * reaches. turnkey follows every cell of the entry word to the words and
+ * data it points to, and so on, and writes only those words to the image,
+ * one after the other, without their headers and names. emforth_boot
+ * then numbers the primitives without giving them headers either, copies
+ * the image to the start of an empty dictionary and runs the entry word.
+ *
+ * The image is the entry xt followed by the words, and a list of the cells
+ * to relocate: each is stored either as an offset in the image or as the
+ * index of a primitive, which is only the same in the same build. Words
+ * keep their layout, so relative branches need no fixing up, and
+ * variables start out with the values they had when the image was made.
+ *
+ * As for modules, cells are found by value, so token threaded builds have
+ * no turnkey images. Words that refer to headers, wordlists for example,
+ * cannot be in one, and the heap and block buffers are not saved.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "builtins_common.h"
+#include "emforth.h"
+#include "turnkey.h"
+
+#ifndef EMFORTH_TOKEN_THREADED
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define TURNKEY_MAGIC "EMFTURNK"
+#define TURNKEY_VERSION 1u
+
+/* a relocation is the offset of a cell, with its kind in the low bits */
+#define TURNKEY_RELOC_CODE 0u /* the cell holds an offset in the image */
+#define TURNKEY_RELOC_PRIM 1u /* the cell holds a primitive index */
+#define TURNKEY_RELOC_KIND 3u
+
+struct turnkey_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t cell_size;
+	uint32_t prim_count; /* primitives of the build that made it */
+	uint32_t reloc_count;
+	uint64_t code_len; /* the entry xt included */
+};
+
+bool turnkey_load(struct forth_ctx *ctx, const void *image, size_t len,
+		  stack_cell_t *entry)
+{
+	const unsigned char *src = image;
+	const unsigned char *relocs = src + sizeof(struct turnkey_header);
+	struct turnkey_header h;
+	unsigned char *code;
+
+	if (len < sizeof(h)) {
+		return false;
+	}
+	memcpy(&h, src, sizeof(h));
+	if (memcmp(h.magic, TURNKEY_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.version != TURNKEY_VERSION || h.cell_size != sizeof(uintptr_t) ||
+	    h.prim_count != prim_count || h.code_len < sizeof(uintptr_t) ||
+	    h.code_len % sizeof(uintptr_t) != 0 ||
+	    (len - sizeof(h)) / sizeof(uint32_t) < h.reloc_count ||
+	    len - sizeof(h) - h.reloc_count * sizeof(uint32_t) != h.code_len) {
+		return false;
+	}
+
+	code = (unsigned char *)ALIGN_UP_WORD_T(ctx->dict.here);
+	if (!dict_reserve(ctx, code - ctx->dict.here + h.code_len)) {
+		return false;
+	}
+	memcpy(code, relocs + h.reloc_count * sizeof(uint32_t), h.code_len);
+
+	for (uint32_t i = 0; i < h.reloc_count; i++) {
+		uint32_t r, offset;
+		uintptr_t v;
+
+		memcpy(&r, relocs + i * sizeof(r), sizeof(r));
+		offset = r & ~TURNKEY_RELOC_KIND;
+		if (offset % sizeof(v) != 0 ||
+		    offset > h.code_len - sizeof(v)) {
+			return false;
+		}
+		memcpy(&v, code + offset, sizeof(v));
+		switch (r & TURNKEY_RELOC_KIND) {
+		case TURNKEY_RELOC_CODE:
+			if (v > h.code_len) {
+				return false;
+			}
+			v += (uintptr_t)code;
+			break;
+		case TURNKEY_RELOC_PRIM:
+			if (v >= prim_count) {
+				return false;
+			}
+			v = (uintptr_t)prim_table[v];
+			break;
+		default:
+			return false;
+		}
+		memcpy(code + offset, &v, sizeof(v));
+	}
+
+	ctx->dict.here = code + h.code_len;
+	memcpy(entry, code, sizeof(*entry));
+	return true;
+}
+
+#ifdef EMFORTH_HOSTED
+
+/* the code and data of a word with a codeword, up to the next word */
+struct turnkey_word {
+	dict_header_t *h;
+	unsigned char *start, *end;
+	uint64_t offset; /* in the image */
+	bool reached, scanned;
+};
+
+/* what turnkey collects */
+struct turnkey_out {
+	struct turnkey_word *words; /* by address */
+	size_t word_count;
+	unsigned char *code;
+	uint64_t code_len;
+	uint32_t *relocs;
+	uint32_t reloc_count;
+	const char *error;
+	dict_header_t *error_word;
+};
+
+/* finds the extent of every word with a codeword */
+static bool turnkey_words(struct forth_ctx *ctx, struct turnkey_out *t)
+{
+	dict_header_t **all;
+	size_t n = 0, i = 0;
+
+	for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+		for (dict_header_t *h = wl->latest; h; h = h->link) {
+			n++;
+		}
+	}
+	all = malloc((n ? n : 1) * sizeof(*all));
+	t->words = malloc((n ? n : 1) * sizeof(*t->words));
+	if (all == NULL || t->words == NULL) {
+		free(all);
+		return false;
+	}
+	for (wordlist_t *wl = ctx->dict.wordlists; wl; wl = wl->prev) {
+		for (dict_header_t *h = wl->latest; h; h = h->link) {
+			all[i++] = h;
+		}
+	}
+	qsort(all, n, sizeof(*all), dict_header_compare);
+
+	for (i = 0; i < n; i++) {
+		word_t *cfa = dict_header_cfa(all[i]);
+
+		if (!is_codeword(*cfa)) {
+			continue;
+		}
+		t->words[t->word_count++] = (struct turnkey_word){
+		    .h = all[i],
+		    .start = (unsigned char *)cfa,
+		    .end = i + 1 < n ? dict_word_start(all[i + 1]) : ctx->dict.here,
+		};
+	}
+	free(all);
+	return true;
+}
+
+/* the word whose code or data holds v, NULL if none does */
+static struct turnkey_word *turnkey_word_at(struct turnkey_out *t,
+					    uintptr_t v)
+{
+	size_t lo = 0, hi = t->word_count;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if ((uintptr_t)t->words[mid].start <= v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0 || v >= (uintptr_t)t->words[lo - 1].end) {
+		return NULL;
+	}
+	return &t->words[lo - 1];
+}
+
+/* marks the word v points into, false if v points into a header */
+static bool turnkey_reach(struct forth_ctx *ctx, struct turnkey_out *t,
+			  uintptr_t v)
+{
+	struct turnkey_word *w;
+
+#ifdef EMFORTH_SPLIT_DICT
+	if (v >= (uintptr_t)ctx->dict.names &&
+	    v < (uintptr_t)ctx->dict.names_here) {
+		return false;
+	}
+#endif
+	if (v < (uintptr_t)ctx->dict.mem || v >= (uintptr_t)ctx->dict.here) {
+		return true;
+	}
+	w = turnkey_word_at(t, v);
+	if (w == NULL) {
+		return false;
+	}
+	w->reached = true;
+	return true;
+}
+
+/* marks everything the entry word reaches */
+static bool turnkey_closure(struct forth_ctx *ctx, struct turnkey_out *t,
+			    uintptr_t entry)
+{
+	bool more;
+
+	if (!turnkey_reach(ctx, t, entry)) {
+		t->error = "is not a word";
+		return false;
+	}
+	do {
+		more = false;
+		for (size_t i = 0; i < t->word_count; i++) {
+			struct turnkey_word *w = &t->words[i];
+
+			if (!w->reached || w->scanned) {
+				continue;
+			}
+			w->scanned = true;
+			more = true;
+			for (unsigned char *p = w->start;
+			     p + sizeof(uintptr_t) <= w->end;
+			     p += sizeof(uintptr_t)) {
+				uintptr_t v;
+
+				memcpy(&v, p, sizeof(v));
+				if (!turnkey_reach(ctx, t, v)) {
+					t->error = "refers to a header";
+					t->error_word = w->h;
+					return false;
+				}
+			}
+		}
+	} while (more);
+	return true;
+}
+
+static bool reloc_add(struct turnkey_out *t, uint64_t offset, uint32_t kind)
+{
+	uint32_t *r;
+
+	if (offset > UINT32_MAX - TURNKEY_RELOC_KIND) {
+		t->error = "is too large";
+		return false;
+	}
+	r = realloc(t->relocs, (t->reloc_count + 1) * sizeof(*r));
+	if (r == NULL) {
+		t->error = "out of memory";
+		return false;
+	}
+	t->relocs = r;
+	t->relocs[t->reloc_count++] = (uint32_t)offset | kind;
+	return true;
+}
+
+/* stores the cell at offset in the form turnkey_load relocates */
+static bool turnkey_cell(struct turnkey_out *t, uint64_t offset)
+{
+	struct turnkey_word *w;
+	uintptr_t v;
+
+	memcpy(&v, t->code + offset, sizeof(v));
+	if ((w = turnkey_word_at(t, v)) != NULL) {
+		v = w->offset + (v - (uintptr_t)w->start);
+		memcpy(t->code + offset, &v, sizeof(v));
+		return reloc_add(t, offset, TURNKEY_RELOC_CODE);
+	}
+	if (prim_index((word_t)v) < prim_count) {
+		v = prim_index((word_t)v);
+		memcpy(t->code + offset, &v, sizeof(v));
+		return reloc_add(t, offset, TURNKEY_RELOC_PRIM);
+	}
+	return true;
+}
+
+/* lays the reached words out one after the other and relocates them */
+static bool turnkey_build(struct turnkey_out *t, uintptr_t entry)
+{
+	uint64_t offset = sizeof(uintptr_t);
+
+	for (size_t i = 0; i < t->word_count; i++) {
+		struct turnkey_word *w = &t->words[i];
+
+		if (w->reached) {
+			w->offset = offset;
+			offset = ALIGN_UP_WORD_T(offset + (w->end - w->start));
+		}
+	}
+	t->code_len = offset;
+	t->code = calloc(1, t->code_len);
+	if (t->code == NULL) {
+		t->error = "out of memory";
+		return false;
+	}
+	memcpy(t->code, &entry, sizeof(entry));
+	if (!turnkey_cell(t, 0)) {
+		return false;
+	}
+	for (size_t i = 0; i < t->word_count; i++) {
+		struct turnkey_word *w = &t->words[i];
+		size_t len = w->end - w->start;
+
+		if (!w->reached) {
+			continue;
+		}
+		memcpy(t->code + w->offset, w->start, len);
+		for (size_t at = 0; at + sizeof(uintptr_t) <= len;
+		     at += sizeof(uintptr_t)) {
+			if (!turnkey_cell(t, w->offset + at)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool turnkey_write(const char *path, struct turnkey_out *t)
+{
+	struct turnkey_header h = {.magic = TURNKEY_MAGIC,
+				   .version = TURNKEY_VERSION,
+				   .cell_size = sizeof(uintptr_t),
+				   .prim_count = prim_count,
+				   .reloc_count = t->reloc_count,
+				   .code_len = t->code_len};
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if (f == NULL) {
+		return false;
+	}
+	ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+	     fwrite(t->relocs, sizeof(*t->relocs), t->reloc_count, f) ==
+		 t->reloc_count &&
+	     fwrite(t->code, 1, t->code_len, f) == t->code_len;
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		remove(path);
+	}
+	return ok;
+}
+
+/**
+ * @brief turnkey <entry> <file>, writes the words entry reaches to file
+ * as an image for emforth_boot, which runs entry
+ */
+void do_turnkey(struct forth_ctx *ctx)
+{
+	char entry_name[MAX_INPUT_LEN + 1], name[MAX_INPUT_LEN + 1];
+	int entry_len = read_token(ctx, entry_name, MAX_INPUT_LEN);
+	int len = entry_len > 0 ? read_token(ctx, name, MAX_INPUT_LEN) : 0;
+	struct turnkey_out t = {0};
+	dict_header_t *h;
+	uintptr_t entry;
+
+	if (len <= 0) {
+		ctx->plat.puts("turnkey: entry word and file expected\n");
+		return;
+	}
+	entry_name[entry_len] = '\0';
+	name[len] = '\0';
+	h = find_word_header(ctx, entry_name, entry_len);
+	if (h == DICT_NULL) {
+		forth_throw(ctx, THROW_UNDEFINED_WORD);
+	}
+	entry = cfa_to_xt(ctx, dict_header_cfa(h));
+
+	if (!turnkey_words(ctx, &t)) {
+		t.error = "out of memory";
+	} else if (turnkey_closure(ctx, &t, entry) &&
+		   turnkey_build(&t, entry) && !turnkey_write(name, &t)) {
+		t.error = "cannot be written";
+	}
+	if (t.error != NULL) {
+		char word[WORD_NAME_MAX_LEN + 1];
+
+		if (t.error_word != NULL) {
+			memcpy(word, dict_header_name(t.error_word),
+			       t.error_word->flags.f.length);
+			word[t.error_word->flags.f.length] = '\0';
+		}
+		ctx->plat.puts("turnkey: ");
+		ctx->plat.puts(t.error_word != NULL ? word : entry_name);
+		ctx->plat.puts(" ");
+		ctx->plat.puts(t.error);
+		ctx->plat.puts("\n");
+	}
+	free(t.words);
+	free(t.code);
+	free(t.relocs);
+	if (t.error != NULL) {
+		forth_throw(ctx, THROW_ABORT_MESSAGE);
+	}
+}
+
+static const struct bultin_entry turnkey_builtin_table[] = {
+    {.word = "turnkey", .c_func = do_turnkey, .flags = {}},
+};
+
+int turnkey_builtins_init(struct forth_ctx *ctx)
+{
+	return builtins_register(ctx, turnkey_builtin_table,
+				 ARRAY_SIZE(turnkey_builtin_table));
+}
+
+#endif /* EMFORTH_HOSTED */
+#endif /* !EMFORTH_TOKEN_THREADED */
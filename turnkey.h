@@ -0,0 +1,28 @@
+/**
+ * @file turnkey.h
+ *
+ * @brief Turnkey images: the code reachable from one word, without
+ * headers, for direct threaded builds.
+ */
+
+#ifndef __TURNKEY_H__
+#define __TURNKEY_H__
+
+#include "emforth.h"
+
+#ifndef EMFORTH_TOKEN_THREADED
+/**
+ * @brief copies a turnkey image to 'here' and relocates it, for
+ * emforth_boot. Sets entry to the xt of the entry word.
+ * @returns false, with the dictionary unchanged, when the image is not
+ * one made by this build.
+ */
+bool turnkey_load(struct forth_ctx *ctx, const void *image, size_t len,
+		  stack_cell_t *entry);
+
+#ifdef EMFORTH_HOSTED
+int turnkey_builtins_init(struct forth_ctx *ctx);
+#endif
+#endif
+
+#endif /* __TURNKEY_H__ */